@@ -0,0 +1,21 @@
+#!/bin/sh
+# Compare two microbench result files (from `make bench > file`).
+# Usage: bench/compare.sh before.tsv after.tsv
+
+if [ $# -ne 2 ]; then
+    echo "usage: bench/compare.sh before.tsv after.tsv" >&2
+    exit 2
+fi
+
+awk -F '\t' '
+    NF != 3 || $2 == "iterations" { next } # Headers and make output
+    NR == FNR { before[$1] = $3; next }
+    {
+        if ($1 in before) {
+            change = (before[$1] > 0) ? ($3 - before[$1]) * 100 / before[$1] : 0
+            printf "%-34s %12.1f %12.1f ns/op %+7.1f%%\n", $1, before[$1], $3, change
+        } else {
+            printf "%-34s %12s %12.1f ns/op\n", $1, "-", $3
+        }
+    }
+' "$1" "$2"
@@ -0,0 +1,121 @@
+// Measure time to first prompt: start a command under a pseudo-terminal,
+// wait until its output contains the prompt marker, and repeat.
+// Prints one line of percentiles in milliseconds; -v also prints what the
+// command wrote before its prompt on the last run.
+// Usage: first_prompt [-v] [-n runs] [-m marker] [-l label] command [args...]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define TIMEOUT_MS 10000
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+bool verbose = false;
+
+// One launch; returns milliseconds until marker appeared, or -1
+double time_one_launch(char **command, const char *marker) {
+    int master;
+    double start = now_ms();
+    pid_t pid = forkpty(&master, NULL, NULL, NULL);
+    if (pid == -1) {
+        perror("first_prompt: forkpty");
+        return -1;
+    }
+    if (pid == 0) {
+        execvp(command[0], command);
+        perror("first_prompt: exec");
+        _exit(127);
+    }
+
+    char seen[8192];
+    size_t seen_len = 0;
+    double elapsed = -1;
+    while (elapsed < 0) {
+        int remaining = TIMEOUT_MS - (int)(now_ms() - start);
+        struct pollfd pfd = {master, POLLIN, 0};
+        if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0) break;
+        ssize_t n = read(master, seen + seen_len, sizeof(seen) - 1 - seen_len);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            break;
+        }
+        seen_len += n;
+        seen[seen_len] = '\0';
+        if (strstr(seen, marker)) elapsed = now_ms() - start;
+        if (seen_len == sizeof(seen) - 1) { // Keep the tail so a marker split across reads is still found
+            size_t keep = strlen(marker);
+            memmove(seen, seen + seen_len - keep, keep);
+            seen_len = keep;
+        }
+    }
+    if (verbose) {
+        for (size_t i = 0; i < seen_len; i++) {
+            if (seen[i] != '\r') putchar(seen[i]);
+        }
+        putchar('\n');
+    }
+    kill(pid, SIGKILL);
+    close(master);
+    waitpid(pid, NULL, 0);
+    return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 100;
+    const char *marker = "> ";
+    const char *label = "first-prompt";
+    int opt;
+    while ((opt = getopt(argc, argv, "+vn:m:l:")) != -1) {
+        if (opt == 'v') verbose = true;
+        else if (opt == 'n') runs = atoi(optarg);
+        else if (opt == 'm') marker = optarg;
+        else if (opt == 'l') label = optarg;
+        else break;
+    }
+    if (optind >= argc || runs < 1) {
+        fprintf(stderr, "usage: first_prompt [-v] [-n runs] [-m marker] [-l label] command [args...]\n");
+        return 2;
+    }
+
+    double *samples = malloc(runs * sizeof(double));
+    if (!samples) {
+        perror("first_prompt: malloc");
+        return 1;
+    }
+    int count = 0, failures = 0;
+    for (int i = 0; i < runs; i++) {
+        double ms = time_one_launch(argv + optind, marker);
+        if (ms < 0) failures++;
+        else samples[count++] = ms;
+    }
+    if (count == 0) {
+        fprintf(stderr, "first_prompt: the prompt never appeared\n");
+        return 1;
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+    printf("%-16s runs=%d p50=%.3fms p99=%.3fms min=%.3fms max=%.3fms failures=%d\n", label, count,
+           samples[count / 2], samples[(count * 99) / 100 < count ? (count * 99) / 100 : count - 1],
+           samples[0], samples[count - 1], failures);
+    free(samples);
+    return failures ? 1 : 0;
+}
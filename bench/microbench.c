@@ -0,0 +1,216 @@
+// Microbenchmarks for the shell's hot paths: parsing, expansion, globbing,
+// completion and history search. sdn.c is compiled into this file with its
+// main() left out, so the benchmarks always call the real functions with the
+// real types. Each benchmark repeats its workload for at least the minimum
+// time and prints one tab-separated line:
+//   name  iterations  ns/op
+// Compare two runs with bench/compare.sh.
+// Usage: microbench [-t seconds] [name-filter]
+
+#define SDN_NO_MAIN
+#include "../sdn.c"
+
+typedef struct {
+    const char *name;
+    void (*setup)(void);
+    void (*run)(void);
+} Benchmark;
+
+char bench_dir[FILENAME_MAX];
+const char *volatile bench_sink; // Results the compiler must not optimize away
+HistoryCache bench_history;
+FileMatches bench_matches;
+
+// A directory of 5000 files named file_0000.txt ... for globbing and completion
+void setup_file_tree() {
+    if (bench_dir[0]) return;
+    snprintf(bench_dir, sizeof(bench_dir), "/tmp/sdn-microbench-XXXXXX");
+    if (!mkdtemp(bench_dir)) {
+        perror("microbench: mkdtemp");
+        exit(1);
+    }
+    for (int i = 0; i < 5000; i++) {
+        char path[FILENAME_MAX + 32];
+        snprintf(path, sizeof(path), "%s/file_%04d.txt", bench_dir, i);
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd != -1) close(fd);
+    }
+    if (chdir(bench_dir) == -1) {
+        perror("microbench: chdir");
+        exit(1);
+    }
+}
+
+void remove_file_tree() {
+    if (!bench_dir[0]) return;
+    char command[FILENAME_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf '%s'", bench_dir);
+    if (system(command) != 0) fprintf(stderr, "microbench: could not remove %s\n", bench_dir);
+}
+
+// A 100k-line history file in a private $HOME, loaded once into bench_history
+void setup_history() {
+    setup_file_tree();
+    if (bench_history.count > 0) return;
+    setenv("HOME", bench_dir, 1);
+    char path[FILENAME_MAX];
+    get_history_file_path(path, sizeof(path));
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("microbench: history");
+        exit(1);
+    }
+    for (int i = 0; i < 100000; i++) fprintf(fp, "[2026-01-01 00:00:00] make -j8 target_%d\n", i);
+    fclose(fp);
+    load_history_cache(&bench_history);
+}
+
+void setup_matches() {
+    if (bench_matches.count > 0) return;
+    init_file_matches(&bench_matches);
+    for (int i = 0; i < 1000; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "src/components/widget_%04d.c", i);
+        if (bench_matches.count == bench_matches.capacity) {
+            bench_matches.capacity *= 2;
+            bench_matches.files = realloc(bench_matches.files, bench_matches.capacity * sizeof(char*));
+        }
+        bench_matches.files[bench_matches.count++] = strdup(name);
+    }
+}
+
+void setup_variables() {
+    setenv("PROJECT", "sdn", 1);
+    setenv("BUILD_DIR", "/var/tmp/build", 1);
+}
+
+// Scripts and interactive lines share one parser, parse_script(): these two
+// time it on a multi-line script and on a typical single command line.
+void run_parse_script() {
+    static const char *script =
+        "for f in *.c; do\n"
+        "    if test -f \"$f\"; then gcc -c \"$f\" -o \"${f%.c}.o\" && echo built $f; fi\n"
+        "done | tee build.log\n"
+        "count=$((count + 1))\n";
+    ParseStatus status;
+    char error[128];
+    Node *root = parse_script(script, &status, error, sizeof(error), NULL);
+    free_node(root);
+}
+
+void run_parse_line() {
+    ParseStatus status;
+    char error[128];
+    Node *root = parse_script("grep -n --color=auto \"$PATTERN\" src/main.c include/*.h > matches.txt", &status,
+                              error, sizeof(error), NULL);
+    free_node(root);
+}
+
+void run_expand_variables() {
+    char *expanded = expand_single_argument("\"$BUILD_DIR/$PROJECT/${PROJECT}-release\"");
+    free(expanded);
+}
+
+void run_expand_arithmetic() {
+    char *expanded = expand_single_argument("$(( (17 * 3 + 4) % 7 << 2 ))");
+    free(expanded);
+}
+
+void run_glob() {
+    char *words[] = {"ls", "file_4*.txt"};
+    CommandSegment segment;
+    memset(&segment, 0, sizeof(segment));
+    build_segment_from_tokens(words, 2, &segment);
+    expand_segment_args(&segment);
+    free_command_segment_internals(&segment);
+}
+
+void run_complete_files() {
+    FileMatches matches;
+    init_file_matches(&matches);
+    find_matching_files("file_12", &matches, false);
+    free_file_matches(&matches);
+}
+
+void run_history_search() {
+    // The oldest entry matches, so the whole cache is scanned
+    bench_sink = find_matching_command("make -j8 target_0", &bench_history);
+}
+
+void run_history_load() {
+    HistoryCache cache = {0};
+    load_history_cache(&cache);
+    free_history_cache(&cache);
+}
+
+void run_history_query() {
+    // Answered from the on-disk index, which the warm-up run builds
+    HistoryQuery query;
+    memset(&query, 0, sizeof(query));
+    query.since = query.until = -1;
+    query.text = "target_4242";
+    query_history(&query, stdout);
+}
+
+void run_common_prefix() {
+    free(find_common_prefix(&bench_matches));
+}
+
+const Benchmark benchmarks[] = {
+    {"parse_script", NULL, run_parse_script},
+    {"parse_script/line", NULL, run_parse_line},
+    {"expand_single_argument/vars", setup_variables, run_expand_variables},
+    {"expand_single_argument/arith", NULL, run_expand_arithmetic},
+    {"glob/5000_files", setup_file_tree, run_glob},
+    {"find_matching_files/5000_files", setup_file_tree, run_complete_files},
+    {"find_matching_command/1000", setup_history, run_history_search},
+    {"load_history_cache/100k_lines", setup_history, run_history_load},
+    {"query_history/100k_lines", setup_history, run_history_query},
+    {"find_common_prefix/1000", setup_matches, run_common_prefix},
+};
+
+int main(int argc, char *argv[]) {
+    double min_seconds = 0.5;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't') min_seconds = atof(optarg);
+        else {
+            fprintf(stderr, "usage: microbench [-t seconds] [name-filter]\n");
+            return 2;
+        }
+    }
+    const char *filter = optind < argc ? argv[optind] : NULL;
+
+    // The benchmarks write nothing useful to stdout; keep it for the results
+    int results_fd = dup(STDOUT_FILENO);
+    FILE *results = fdopen(results_fd, "w");
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (!results || null_fd == -1) {
+        perror("microbench");
+        return 1;
+    }
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    fprintf(results, "benchmark\titerations\tns_per_op\n");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        const Benchmark *bench = &benchmarks[i];
+        if (filter && !strstr(bench->name, filter)) continue;
+        if (bench->setup) bench->setup();
+        bench->run(); // Warm caches
+
+        long iterations = 0, batch = 1;
+        double start = monotonic_seconds(), elapsed = 0;
+        while (elapsed < min_seconds) {
+            for (long k = 0; k < batch; k++) bench->run();
+            iterations += batch;
+            elapsed = monotonic_seconds() - start;
+            if (batch < 1 << 20) batch *= 2;
+        }
+        fprintf(results, "%s\t%ld\t%.1f\n", bench->name, iterations, elapsed * 1e9 / iterations);
+        fflush(results);
+    }
+    free_history_cache(&bench_history);
+    remove_file_tree();
+    return 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Measure pipeline throughput with the default pipe capacity, with
+# SDN_PIPE_SIZE, and with SDN_PIPE_SIZE plus SDN_PIPE_AFFINITY, by pushing
+# the same bytes through a chain of filters that each touch every byte.
+# Usage: bench/pipe_throughput.sh [path/to/sdn] [megabytes] [pipe size]
+
+SDN=${1:-./sdn}
+MEGABYTES=${2:-512}
+PIPE_SIZE=${3:-1M}
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+export HOME="$WORK_DIR"
+
+PIPELINE="head -c ${MEGABYTES}M /dev/zero | tr '\\0' a | tr a b | tr b c | wc -c"
+
+now_ns() {
+    date +%s%N
+}
+
+run() { # label settings
+    start=$(now_ns)
+    "$SDN" -c "$2 $PIPELINE" > /dev/null
+    end=$(now_ns)
+    awk -v label="$1" -v mb="$MEGABYTES" -v ns="$((end - start))" 'BEGIN {
+        s = ns / 1e9
+        printf "%-22s %6d MiB  %8.3f s  %8.1f MiB/s\n", label, mb, s, mb / s
+    }'
+}
+
+run "default pipes" ""
+run "SDN_PIPE_SIZE=$PIPE_SIZE" "SDN_PIPE_SIZE=$PIPE_SIZE"
+run "+ SDN_PIPE_AFFINITY=1" "SDN_PIPE_SIZE=$PIPE_SIZE SDN_PIPE_AFFINITY=1"
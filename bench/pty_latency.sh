@@ -0,0 +1,20 @@
+#!/bin/sh
+# End-to-end keystroke latency of the line editor: replay a keystroke script
+# against sdn under a pseudo-terminal and report latency per key class.
+# Usage: bench/pty_latency.sh [path/to/sdn] [repeats] [script] [path/to/ptyreplay]
+
+SDN=$(cd "$(dirname "${1:-./sdn}")" && pwd)/$(basename "${1:-./sdn}")
+REPEATS=${2:-20}
+SCRIPT=$(cd "$(dirname "${3:-bench/sessions/editing.keys}")" && pwd)/$(basename "${3:-bench/sessions/editing.keys}")
+PTYREPLAY=$(cd "$(dirname "${4:-./bench/ptyreplay}")" && pwd)/$(basename "${4:-./bench/ptyreplay}")
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# A private HOME with some history, and a directory to complete in
+export HOME="$WORK_DIR"
+printf '[2026-01-01 00:00:00] make test\n[2026-01-01 00:00:01] git status\n' > "$HOME/.sdn_history"
+mkdir -p "$WORK_DIR/work/subdir/alpha" "$WORK_DIR/work/subdir/beta"
+cd "$WORK_DIR/work" || exit 1
+
+"$PTYREPLAY" -r "$REPEATS" "$SCRIPT" "$SDN"
@@ -0,0 +1,262 @@
+// Replay a keystroke script against a command running in a pseudo-terminal
+// and measure keystroke-to-output latency: the time from writing a key to the
+// first byte the command writes back. Before each key the output must have
+// been quiet for the settle time, so every sample measures one key alone.
+//
+// Script lines (# starts a comment):
+//   type TEXT     type TEXT one key at a time
+//   key NAME      tab, enter, backspace, up, down, left, right, ctrl-c, ctrl-d
+//   paste TEXT    write TEXT in a single write, as a terminal paste does
+//   wait TEXT     wait until the output contains TEXT (e.g. a prompt)
+//   sleep MS      pause
+//
+// Results are tab-separated, one line per key class:
+//   class  samples  p50_ms  p90_ms  p99_ms  max_ms  no_output
+// Usage: ptyreplay [-r repeats] [-s settle_ms] script command [args...]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define KEY_TIMEOUT_MS 1000
+#define WAIT_TIMEOUT_MS 10000
+#define MAX_CLASSES 16
+
+typedef struct {
+    const char *name;
+    double *samples;
+    int count;
+    int capacity;
+    int no_output; // Keys the command never answered within KEY_TIMEOUT_MS
+} KeyClass;
+
+typedef struct {
+    const char *name;
+    const char *bytes;
+} NamedKey;
+
+const NamedKey named_keys[] = {
+    {"tab", "\t"}, {"enter", "\r"}, {"backspace", "\177"},
+    {"up", "\033[A"}, {"down", "\033[B"}, {"right", "\033[C"}, {"left", "\033[D"},
+    {"ctrl-c", "\003"}, {"ctrl-d", "\004"},
+};
+
+KeyClass classes[MAX_CLASSES];
+int class_count = 0;
+int settle_ms = 5;
+char recent[4096]; // Tail of the output, for wait
+size_t recent_len = 0;
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+KeyClass *find_class(const char *name) {
+    for (int i = 0; i < class_count; i++) {
+        if (strcmp(classes[i].name, name) == 0) return &classes[i];
+    }
+    if (class_count == MAX_CLASSES) return NULL;
+    classes[class_count].name = strdup(name);
+    return &classes[class_count++];
+}
+
+void add_sample(KeyClass *class, double ms) {
+    if (class->count == class->capacity) {
+        class->capacity = class->capacity ? class->capacity * 2 : 256;
+        class->samples = realloc(class->samples, class->capacity * sizeof(double));
+        if (!class->samples) {
+            perror("ptyreplay: realloc");
+            exit(1);
+        }
+    }
+    class->samples[class->count++] = ms;
+}
+
+// Read whatever is available within timeout_ms. Returns bytes read, 0 on
+// timeout, -1 when the command has gone away.
+ssize_t read_output(int master, int timeout_ms) {
+    struct pollfd pfd = {master, POLLIN, 0};
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready <= 0) return ready == 0 || errno == EINTR ? 0 : -1;
+    char buffer[4096];
+    ssize_t n = read(master, buffer, sizeof(buffer));
+    if (n <= 0) return -1;
+    for (ssize_t i = 0; i < n; i++) { // Keep the tail for wait
+        if (recent_len == sizeof(recent) - 1) {
+            memmove(recent, recent + sizeof(recent) / 2, sizeof(recent) / 2 - 1);
+            recent_len = sizeof(recent) / 2 - 1;
+        }
+        recent[recent_len++] = buffer[i];
+    }
+    recent[recent_len] = '\0';
+    return n;
+}
+
+// Drain output until none has arrived for settle_ms
+int settle(int master) {
+    ssize_t n;
+    while ((n = read_output(master, settle_ms)) > 0) {}
+    return n == -1 ? -1 : 0;
+}
+
+// Send one key (or paste) and record how long the first byte of output took
+int send_timed(int master, const char *bytes, size_t len, const char *class_name) {
+    if (settle(master) == -1) return -1;
+    double start = now_ms();
+    if (write(master, bytes, len) != (ssize_t)len) return -1;
+    KeyClass *class = find_class(class_name);
+    ssize_t n = read_output(master, KEY_TIMEOUT_MS);
+    if (n == -1) return -1;
+    if (!class) return 0;
+    if (n == 0) class->no_output++;
+    else add_sample(class, now_ms() - start);
+    return 0;
+}
+
+int wait_for_text(int master, const char *text) {
+    double deadline = now_ms() + WAIT_TIMEOUT_MS;
+    while (!strstr(recent, text)) {
+        int remaining = (int)(deadline - now_ms());
+        if (remaining <= 0) {
+            fprintf(stderr, "ptyreplay: timed out waiting for \"%s\"\n", text);
+            return -1;
+        }
+        if (read_output(master, remaining) == -1) return -1;
+    }
+    recent_len = 0; // Later waits only look at newer output
+    recent[0] = '\0';
+    return 0;
+}
+
+// Expand \n, \t, \e and \\ in a script argument
+void unescape(char *text) {
+    char *out = text;
+    for (const char *in = text; *in; in++) {
+        if (*in != '\\' || !in[1]) {
+            *out++ = *in;
+            continue;
+        }
+        in++;
+        *out++ = *in == 'n' ? '\n' : *in == 't' ? '\t' : *in == 'r' ? '\r' : *in == 'e' ? '\033' : *in;
+    }
+    *out = '\0';
+}
+
+int run_line(int master, char *line, int line_number) {
+    line[strcspn(line, "\n")] = '\0';
+    char *verb = line + strspn(line, " \t");
+    if (*verb == '\0' || *verb == '#') return 0;
+    char *arg = verb + strcspn(verb, " \t");
+    if (*arg) *arg++ = '\0';
+    unescape(arg);
+
+    if (strcmp(verb, "type") == 0) {
+        for (char *c = arg; *c; c++) {
+            if (send_timed(master, c, 1, "type") == -1) return -1;
+        }
+        return 0;
+    }
+    if (strcmp(verb, "key") == 0) {
+        for (size_t i = 0; i < sizeof(named_keys) / sizeof(named_keys[0]); i++) {
+            if (strcmp(named_keys[i].name, arg) == 0) {
+                return send_timed(master, named_keys[i].bytes, strlen(named_keys[i].bytes), arg);
+            }
+        }
+        fprintf(stderr, "ptyreplay: line %d: unknown key `%s'\n", line_number, arg);
+        return -1;
+    }
+    if (strcmp(verb, "paste") == 0) return send_timed(master, arg, strlen(arg), "paste");
+    if (strcmp(verb, "wait") == 0) return wait_for_text(master, arg);
+    if (strcmp(verb, "sleep") == 0) {
+        usleep(atoi(arg) * 1000);
+        return 0;
+    }
+    fprintf(stderr, "ptyreplay: line %d: unknown directive `%s'\n", line_number, verb);
+    return -1;
+}
+
+// One session: start the command, replay the script, stop the command
+int replay(const char *script_path, char **command) {
+    FILE *script = fopen(script_path, "r");
+    if (!script) {
+        perror(script_path);
+        return -1;
+    }
+    struct winsize size = {24, 80, 0, 0};
+    int master;
+    pid_t pid = forkpty(&master, NULL, NULL, &size);
+    if (pid == -1) {
+        perror("ptyreplay: forkpty");
+        fclose(script);
+        return -1;
+    }
+    if (pid == 0) {
+        execvp(command[0], command);
+        perror("ptyreplay: exec");
+        _exit(127);
+    }
+
+    recent_len = 0;
+    recent[0] = '\0';
+    char line[4096];
+    int status = 0, line_number = 0;
+    while (status == 0 && fgets(line, sizeof(line), script)) {
+        status = run_line(master, line, ++line_number);
+    }
+    fclose(script);
+    kill(pid, SIGKILL);
+    close(master);
+    waitpid(pid, NULL, 0);
+    return status;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(const KeyClass *class, int p) {
+    int index = (class->count * p) / 100;
+    return class->samples[index < class->count ? index : class->count - 1];
+}
+
+int main(int argc, char *argv[]) {
+    int repeats = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "+r:s:")) != -1) {
+        if (opt == 'r') repeats = atoi(optarg);
+        else if (opt == 's') settle_ms = atoi(optarg);
+        else break;
+    }
+    if (argc - optind < 2 || repeats < 1) {
+        fprintf(stderr, "usage: ptyreplay [-r repeats] [-s settle_ms] script command [args...]\n");
+        return 2;
+    }
+    for (int i = 0; i < repeats; i++) {
+        if (replay(argv[optind], argv + optind + 1) == -1) return 1;
+    }
+
+    printf("class\tsamples\tp50_ms\tp90_ms\tp99_ms\tmax_ms\tno_output\n");
+    for (int i = 0; i < class_count; i++) {
+        KeyClass *class = &classes[i];
+        if (class->count == 0) {
+            printf("%s\t0\t-\t-\t-\t-\t%d\n", class->name, class->no_output);
+            continue;
+        }
+        qsort(class->samples, class->count, sizeof(double), compare_doubles);
+        printf("%s\t%d\t%.3f\t%.3f\t%.3f\t%.3f\t%d\n", class->name, class->count, percentile(class, 50),
+               percentile(class, 90), percentile(class, 99), class->samples[class->count - 1], class->no_output);
+    }
+    return 0;
+}
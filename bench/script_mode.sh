@@ -0,0 +1,43 @@
+#!/bin/sh
+# Compare batch (script) mode against the interactive line-editor path by
+# running the same N trivial builtin commands through both.
+# Usage: bench/script_mode.sh [path/to/sdn] [commands]
+
+SDN=${1:-./sdn}
+COUNT=${2:-10000}
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+SCRIPT="$WORK_DIR/bench.sdn"
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo "echo trivial $i"
+    i=$((i + 1))
+done > "$SCRIPT"
+echo "exit" >> "$SCRIPT"
+
+now_ns() {
+    date +%s%N
+}
+
+report() { # label start_ns end_ns
+    elapsed_ns=$(($3 - $2))
+    awk -v label="$1" -v n="$COUNT" -v ns="$elapsed_ns" 'BEGIN {
+        s = ns / 1e9
+        printf "%-12s %8d commands  %8.3f s  %10.0f commands/s\n", label, n, s, n / s
+    }'
+}
+
+# History and aliases are per-HOME; keep the interactive run away from the real ones
+export HOME="$WORK_DIR"
+
+start=$(now_ns)
+"$SDN" "$SCRIPT" > /dev/null
+end=$(now_ns)
+report "script" "$start" "$end"
+
+start=$(now_ns)
+"$SDN" -i < "$SCRIPT" > /dev/null
+end=$(now_ns)
+report "interactive" "$start" "$end"
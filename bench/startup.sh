@@ -0,0 +1,22 @@
+#!/bin/sh
+# Time to first prompt under a pseudo-terminal with synthetic histories of
+# 1k, 100k and 1M entries, plus one --profile-startup breakdown for each.
+# Usage: bench/startup.sh [path/to/sdn] [runs] [path/to/first_prompt]
+
+SDN=${1:-./sdn}
+RUNS=${2:-200}
+FIRST_PROMPT=${3:-./bench/first_prompt}
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+for entries in 1000 100000 1000000; do
+    export HOME="$WORK_DIR/$entries"
+    mkdir -p "$HOME"
+    awk -v n="$entries" 'BEGIN {
+        for (i = 0; i < n; i++) printf "[2026-01-01 00:00:00] git commit -m \"change %d\"\n", i
+    }' > "$HOME/.sdn_history"
+
+    "$FIRST_PROMPT" -n "$RUNS" -l "history=$entries" "$SDN"
+    "$FIRST_PROMPT" -v -n 1 -l "profile" "$SDN" --profile-startup | sed -n '/^phase/,/^total/s/^/  /p'
+done
@@ -1,6 +1,7 @@
-#define _DEFAULT_SOURCE // For DT_DIR
+#define _GNU_SOURCE // For DT_DIR, memfd_create() and splice()
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
@@ -11,12 +12,32 @@
 #include <dirent.h> // Add for directory operations
 #include <glob.h>   // For wildcard expansion (globbing)
 #include <stdbool.h> // ADDED FOR bool, true, false
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sys/file.h>
 
-#define MAX_LINE 80 
-#define MAX_ARGS 20 
+#define MAX_LINE 1024
+#define MAX_ARGS 20 // Initial argv capacity; argv grows as words and expansions need
+#define ARG_MAX_HEADROOM 2048 // Bytes kept free below ARG_MAX, as POSIX xargs does
 #define HISTORY_FILE_NAME ".sdn_history"
 #define MAX_HISTORY_ENTRIES 1000
-#define MAX_COMMAND_SEGMENTS 10 
+#define HISTORY_LINE_MAX (MAX_LINE + FILENAME_MAX * 3 + 64) // Command plus timestamp, status and escaped directory
 #define MAX_ALIASES 50
 #define MAX_ALIAS_NAME_LEN 50
 #define MAX_ALIAS_COMMAND_LEN MAX_LINE
@@ -34,13 +55,24 @@ struct termios orig_termios;
 typedef struct {
     char *commands[MAX_HISTORY_ENTRIES];
     int count;
+    off_t file_offset; // How much of the history file has been read into the cache
+    ino_t file_ino;    // Which file that was: compaction replaces it
 } HistoryCache;
 
 typedef struct {
-    char *args[MAX_ARGS];
+    char **args;      // NULL-terminated, grown on demand by add_segment_arg()
+    int arg_count;
+    int arg_capacity;
+    int batch_start;  // [batch_start, batch_end) is the expanded range argbatch may split
+    int batch_end;
     char *inputFile;
+    char *inputText;  // Expanded here-document or here-string, fed to stdin instead of inputFile
     char *outputFile;
     int appendMode;
+    char **assignments;       // Expanded NAME=value prefixes, exported to this command only
+    struct Node *compound;    // Compound command run in place of args (borrowed from the parse tree)
+    struct CaptureBuffer *arg_storage; // $(...) output that args point into; freed with the segment
+    struct SpawnAttrs *spawn; // Limits, niceness, I/O priority and affinity from prefix modifiers, or NULL
 } CommandSegment;
 
 typedef struct {
@@ -50,7 +82,8 @@ typedef struct {
 
 typedef struct {
     char name[MAX_VAR_NAME_LEN];
-    char value[MAX_VAR_VALUE_LEN];
+    char *value; // Heap-allocated; command substitutions can make values large
+    size_t value_capacity;
 } VariableEntry;
 
 AliasEntry alias_table[MAX_ALIASES];
@@ -62,6 +95,161 @@ int local_alias_count = 0;
 VariableEntry variable_table[MAX_VARIABLES];
 int variable_count = 0;
 
+int last_exit_status = 0; // Exposed to the user as $?
+bool exit_requested = false; // Set by the exit builtin; stops script and REPL execution
+bool expansion_failed = false; // Set when expanding a word fails, e.g. on a bad $(( )) expression
+
+// Interpreter control flow. break/continue/return set these and every list,
+// loop and function unwinds until the construct they target consumes them.
+int loop_depth = 0;
+int break_levels = 0;
+int continue_levels = 0;
+int function_depth = 0;
+bool return_requested = false;
+volatile sig_atomic_t interrupt_pending = 0; // Ctrl+C while the shell itself runs a loop
+
+char **positional_params = NULL; // $0, $1, ... for scripts and -c
+int positional_count = 0;
+
+// Options toggled with `set -o name` / `set +o name`
+typedef enum {
+    OPT_ARGBATCH,
+    OPT_PIPETRACE,
+    OPT_PIPEMON,
+    OPT_ALIASWATCH,
+    OPT_TRACEPERF,
+    OPT_COUNT
+} ShellOptionId;
+
+typedef struct {
+    const char *name;
+    bool enabled;
+    const char *description;
+} ShellOption;
+
+ShellOption shell_options[OPT_COUNT] = {
+    [OPT_ARGBATCH] = {"argbatch", false, "split argv that exceeds ARG_MAX into batches, like xargs"},
+    [OPT_PIPETRACE] = {"pipetrace", false, "report each pipeline rewrite on stderr"},
+    [OPT_PIPEMON] = {"pipemon", false, "relay pipes through the shell and report throughput per stage"},
+    [OPT_ALIASWATCH] = {"aliaswatch", false, "watch local alias files with inotify instead of checking them on cd"},
+    [OPT_TRACEPERF] = {"trace-perf", false, "write a Chrome trace of each command's phases to $SDN_TRACE_FILE"},
+};
+
+// --- Performance trace ---
+// With `set -o trace-perf` the shell records a span for each phase of running
+// a command line: alias expansion, parsing, expansion and globbing, fork and
+// waiting, plus one span per child process from fork to reap. They are
+// written to $SDN_TRACE_FILE, or by default to a new uniquely named
+// sdn-trace.PID.XXXXXX.json in $XDG_RUNTIME_DIR (or /tmp), in Chrome
+// trace-event format, which Perfetto and chrome://tracing load directly. Each
+// event goes out with a single write() as soon as it ends, so forked children
+// never re-flush it and a killed shell still leaves a loadable file.
+
+int trace_fd = -1;
+pid_t trace_owner = 0;    // The process that opened the file closes the JSON array
+bool trace_has_events = false;
+
+double trace_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Start time of a span, or 0 when tracing is off
+double trace_begin() {
+    return shell_options[OPT_TRACEPERF].enabled ? trace_now_us() : 0;
+}
+
+// Append text to out as the inside of a JSON string
+size_t json_escape(char *out, size_t size, const char *text) {
+    size_t len = 0;
+    for (const unsigned char *p = (const unsigned char *)text; *p && len + 7 < size; p++) {
+        if (*p == '"' || *p == '\\') {
+            out[len++] = '\\';
+            out[len++] = *p;
+        } else if (*p < 0x20) {
+            len += snprintf(out + len, size - len, "\\u%04x", *p);
+        } else {
+            out[len++] = *p;
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// Label a track in the viewer; children get their command name
+void trace_thread_name(pid_t tid, const char *name) {
+    char escaped_name[256], event[384];
+    json_escape(escaped_name, sizeof(escaped_name), name);
+    int len = snprintf(event, sizeof(event),
+                       "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                       trace_has_events ? "," : "", (int)trace_owner, (int)tid, escaped_name);
+    if (len > 0 && len < (int)sizeof(event) && write(trace_fd, event, len) > 0) trace_has_events = true;
+}
+
+void close_trace_file() {
+    if (trace_fd == -1 || getpid() != trace_owner) return;
+    if (write(trace_fd, "\n]\n", 3) == -1) {} // Best effort: the viewer accepts an unclosed array too
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+bool open_trace_file() {
+    static bool exit_hook = false;
+    const char *path = getenv("SDN_TRACE_FILE");
+    char default_path[FILENAME_MAX];
+    if (path && *path) {
+        trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC | O_NOFOLLOW, 0644);
+    } else {
+        // A fresh, unguessable name: a symlink planted in a shared /tmp cannot redirect the write
+        const char *dir = getenv("XDG_RUNTIME_DIR");
+        snprintf(default_path, sizeof(default_path), "%s/sdn-trace.%d.XXXXXX.json",
+                 dir && *dir ? dir : "/tmp", (int)getpid());
+        path = default_path;
+        trace_fd = mkostemps(default_path, 5, O_APPEND | O_CLOEXEC);
+    }
+    if (trace_fd == -1) {
+        fprintf(stderr, "sdn: trace-perf: %s: %s\n", path, strerror(errno));
+        shell_options[OPT_TRACEPERF].enabled = false;
+        return false;
+    }
+    trace_owner = getpid();
+    trace_has_events = false;
+    if (write(trace_fd, "[", 1) == -1) {}
+    trace_thread_name(trace_owner, "sdn");
+    if (!exit_hook) {
+        atexit(close_trace_file);
+        exit_hook = true;
+    }
+    fprintf(stderr, "sdn: trace-perf: writing %s\n", path);
+    return true;
+}
+
+// Write one complete ("X") event. tid groups spans into tracks: the shell's
+// own pid for its phases, a child's pid for the child.
+void trace_event(const char *name, const char *category, double start_us, double end_us, pid_t tid,
+                 const char *detail) {
+    if (trace_fd == -1 && !open_trace_file()) return;
+    char escaped_name[256], escaped_detail[512], event[1024];
+    json_escape(escaped_name, sizeof(escaped_name), name);
+    json_escape(escaped_detail, sizeof(escaped_detail), detail ? detail : "");
+    int len = snprintf(event, sizeof(event),
+                       "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"%s\"}}",
+                       trace_has_events ? "," : "", escaped_name, category, start_us, end_us - start_us,
+                       (int)trace_owner, (int)tid, escaped_detail);
+    if (len > 0 && write(trace_fd, event, len < (int)sizeof(event) ? len : (int)sizeof(event) - 1) > 0) {
+        trace_has_events = true;
+    }
+}
+
+// End a span begun with trace_begin() in the shell's own track
+void trace_end(const char *name, double start_us, const char *detail) {
+    if (start_us > 0 && shell_options[OPT_TRACEPERF].enabled) {
+        trace_event(name, "shell", start_us, trace_now_us(), getpid(), detail);
+    }
+}
+
 // Helper structure to store matching files
 typedef struct {
     char **files;
@@ -70,20 +258,451 @@ typedef struct {
 } FileMatches;
 
 void get_history_file_path(char *path_buffer, size_t buffer_size);
+int lock_history(int operation);
+void maybe_compact_history(off_t size);
+void set_shell_variable(const char *name, const char *value);
 
 void disable_raw_mode() {
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
 }
 
 void enable_raw_mode() {
+    static bool atexit_registered = false;
     tcgetattr(STDIN_FILENO, &orig_termios);
-    atexit(disable_raw_mode);
+    if (!atexit_registered) {
+        atexit(disable_raw_mode);
+        atexit_registered = true;
+    }
     
     struct termios raw = orig_termios;
-    raw.c_lflag &= ~(ECHO | ICANON);
+    // ISIG off: Ctrl+C and Ctrl+Z arrive as bytes while editing instead of signalling the shell
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG);
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
 }
 
+// --- Job control ---
+// Every pipeline the shell starts is a job. Children are reaped only through
+// reap_children(), which the event loop runs whenever its signalfd reports
+// SIGCHLD, so completion notices appear immediately.
+
+typedef struct {
+    pid_t pid;
+    int status;
+    bool completed;
+    bool stopped;
+    char name[64];            // Command name, for per-stage reports
+    struct timespec started;  // CLOCK_MONOTONIC at fork
+    struct timespec finished; // CLOCK_MONOTONIC when reaped
+    struct rusage usage;      // From wait4()
+} JobProcess;
+
+typedef struct Job {
+    int id;
+    pid_t pgid;
+    char *command;
+    JobProcess *procs;
+    int num_procs;
+    bool background;
+    bool notified;            // State change already reported to the user
+    struct termios tmodes;    // Terminal modes saved when the job was stopped
+    struct Job *next;
+} Job;
+
+Job *job_list = NULL;
+bool interactive_shell = false;   // Reading commands from the line editor rather than a script
+bool job_control_enabled = false; // Interactive terminal: use process groups and tcsetpgrp
+pid_t shell_pgid;
+struct termios shell_tmodes;
+
+void handle_interrupt_signal(int signo) {
+    (void)signo;
+    interrupt_pending = 1;
+}
+
+void init_job_control() {
+    if (!isatty(STDIN_FILENO)) return;
+
+    // Wait until we are in the foreground before taking the terminal
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+        kill(-shell_pgid, SIGTTIN);
+    }
+    // Ctrl+C only reaches the shell while it runs a loop or function itself, which it then abandons
+    struct sigaction interrupt_action;
+    memset(&interrupt_action, 0, sizeof(interrupt_action));
+    interrupt_action.sa_handler = handle_interrupt_signal;
+    sigemptyset(&interrupt_action.sa_mask);
+    interrupt_action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &interrupt_action, NULL);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    shell_pgid = getpid();
+    if (getpgrp() != shell_pgid && setpgid(shell_pgid, shell_pgid) < 0) {
+        perror("sdn: setpgid");
+        return;
+    }
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+    job_control_enabled = true;
+}
+
+// Undo the shell's signal dispositions in a freshly forked child
+void reset_child_signals() {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+
+    // The shell blocks these to read them from its signalfd; exec'd programs must not inherit that
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGWINCH);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+Job *create_job(const char *command, int num_procs, bool background) {
+    Job *job = calloc(1, sizeof(Job));
+    if (!job) return NULL;
+    job->procs = calloc(num_procs, sizeof(JobProcess));
+    job->command = strdup(command ? command : "");
+    if (!job->procs || !job->command) {
+        free(job->procs);
+        free(job->command);
+        free(job);
+        return NULL;
+    }
+    job->num_procs = num_procs;
+    job->background = background;
+
+    // Take the lowest free job number, like other shells
+    int id = 1;
+    for (bool taken = true; taken; ) {
+        taken = false;
+        for (Job *j = job_list; j; j = j->next) {
+            if (j->id == id) { id++; taken = true; break; }
+        }
+    }
+    job->id = id;
+
+    Job **tail = &job_list;
+    while (*tail) tail = &(*tail)->next;
+    *tail = job;
+    return job;
+}
+
+void free_job(Job *job) {
+    for (int i = 0; i < job->num_procs && shell_options[OPT_TRACEPERF].enabled; i++) {
+        const JobProcess *proc = &job->procs[i];
+        if (!proc->completed) continue;
+        int code = WIFSIGNALED(proc->status) ? 128 + WTERMSIG(proc->status) : WEXITSTATUS(proc->status);
+        char detail[48];
+        snprintf(detail, sizeof(detail), "pid %d, status %d", (int)proc->pid, code);
+        if (trace_fd != -1) trace_thread_name(proc->pid, proc->name);
+        trace_event(proc->name, "process", proc->started.tv_sec * 1e6 + proc->started.tv_nsec / 1e3,
+                    proc->finished.tv_sec * 1e6 + proc->finished.tv_nsec / 1e3, proc->pid, detail);
+    }
+    Job **link = &job_list;
+    while (*link && *link != job) link = &(*link)->next;
+    if (*link) *link = job->next;
+    free(job->procs);
+    free(job->command);
+    free(job);
+}
+
+bool job_is_completed(const Job *job) {
+    for (int i = 0; i < job->num_procs; i++) {
+        if (!job->procs[i].completed) return false;
+    }
+    return true;
+}
+
+bool job_is_stopped(const Job *job) {
+    for (int i = 0; i < job->num_procs; i++) {
+        if (!job->procs[i].completed && !job->procs[i].stopped) return false;
+    }
+    return true;
+}
+
+// Exit status of a finished job, shell style: the last process decides
+int job_exit_status(const Job *job) {
+    int status = job->procs[job->num_procs - 1].status;
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    return WEXITSTATUS(status);
+}
+
+Job *find_job_by_pid(pid_t pid) {
+    for (Job *j = job_list; j; j = j->next) {
+        for (int i = 0; i < j->num_procs; i++) {
+            if (j->procs[i].pid == pid) return j;
+        }
+    }
+    return NULL;
+}
+
+Job *find_job_by_id(int id) {
+    for (Job *j = job_list; j; j = j->next) {
+        if (j->id == id) return j;
+    }
+    return NULL;
+}
+
+// Record a wait status (and, once it exits, the resource usage) for whichever
+// job owns pid. Returns false for unknown pids.
+bool mark_process_status(pid_t pid, int status, const struct rusage *usage) {
+    Job *job = find_job_by_pid(pid);
+    if (!job) return false;
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].pid != pid) continue;
+        job->procs[i].status = status;
+        if (WIFSTOPPED(status)) {
+            job->procs[i].stopped = true;
+        } else if (WIFCONTINUED(status)) {
+            job->procs[i].stopped = false;
+        } else {
+            job->procs[i].completed = true;
+            job->procs[i].usage = *usage;
+            clock_gettime(CLOCK_MONOTONIC, &job->procs[i].finished);
+        }
+        job->notified = false;
+    }
+    return true;
+}
+
+// Collect every pending child state change without blocking
+void reap_children() {
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        mark_process_status(pid, status, &usage);
+    }
+}
+
+bool has_pending_job_notifications() {
+    for (Job *j = job_list; j; j = j->next) {
+        if (!j->background || j->notified) continue;
+        if (job_is_completed(j) || job_is_stopped(j)) return true;
+    }
+    return false;
+}
+
+void format_job_state(const Job *job, char *buffer, size_t size) {
+    if (job_is_completed(job)) {
+        int status = job->procs[job->num_procs - 1].status;
+        if (WIFSIGNALED(status)) {
+            snprintf(buffer, size, "Terminated (%s)", strsignal(WTERMSIG(status)));
+        } else if (WEXITSTATUS(status) != 0) {
+            snprintf(buffer, size, "Exit %d", WEXITSTATUS(status));
+        } else {
+            snprintf(buffer, size, "Done");
+        }
+    } else if (job_is_stopped(job)) {
+        snprintf(buffer, size, "Stopped");
+    } else {
+        snprintf(buffer, size, "Running");
+    }
+}
+
+// Report finished and stopped background jobs, forgetting the finished ones
+void print_job_notifications() {
+    Job *j = job_list;
+    while (j) {
+        Job *next = j->next;
+        if (j->background && !j->notified && (job_is_completed(j) || job_is_stopped(j))) {
+            char state[64];
+            format_job_state(j, state, sizeof(state));
+            printf("[%d]  %-24s %s\n", j->id, state, j->command);
+            j->notified = true;
+            if (job_is_completed(j)) free_job(j);
+        }
+        j = next;
+    }
+    fflush(stdout);
+}
+
+// Block until the job finishes or stops, recording other children on the way
+void wait_for_job(Job *job) {
+    while (!job_is_completed(job) && !job_is_stopped(job)) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            break; // ECHILD: nothing left to wait for
+        }
+        mark_process_status(pid, status, &usage);
+    }
+}
+
+// --- Resource accounting ---
+// Foreground pipelines are reaped with wait4(), so each stage's rusage is kept.
+// The figures of the last one are published as $SDN_TIME_* and printed per
+// stage by the `time` keyword.
+
+typedef struct {
+    char name[64];
+    double wall_seconds;
+    double user_seconds;
+    double system_seconds;
+    long max_rss_kb;
+    long voluntary_switches;
+    long involuntary_switches;
+} StageStats;
+
+typedef struct {
+    StageStats *stages;
+    int count;
+    int capacity;
+    double wall_seconds; // First fork to last exit
+} PipelineStats;
+
+PipelineStats last_pipeline_stats = {0};
+
+double timespec_seconds_between(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double timeval_seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void reset_pipeline_stats(int count) {
+    if (count > last_pipeline_stats.capacity) {
+        StageStats *grown = realloc(last_pipeline_stats.stages, count * sizeof(StageStats));
+        if (!grown) {
+            last_pipeline_stats.count = 0;
+            return;
+        }
+        last_pipeline_stats.stages = grown;
+        last_pipeline_stats.capacity = count;
+    }
+    memset(last_pipeline_stats.stages, 0, count * sizeof(StageStats));
+    last_pipeline_stats.count = count;
+    last_pipeline_stats.wall_seconds = 0;
+}
+
+void fill_stage_stats(StageStats *stage, const char *name, double wall, const struct rusage *usage) {
+    size_t name_len = strnlen(name, sizeof(stage->name) - 1); // Runs once per in-shell command; skip printf
+    memcpy(stage->name, name, name_len);
+    stage->name[name_len] = '\0';
+    stage->wall_seconds = wall;
+    stage->user_seconds = timeval_seconds(&usage->ru_utime);
+    stage->system_seconds = timeval_seconds(&usage->ru_stime);
+    stage->max_rss_kb = usage->ru_maxrss;
+    stage->voluntary_switches = usage->ru_nvcsw;
+    stage->involuntary_switches = usage->ru_nivcsw;
+}
+
+void record_job_stats(const Job *job) {
+    reset_pipeline_stats(job->num_procs);
+    struct timespec first_start = job->procs[0].started;
+    struct timespec last_finish = job->procs[0].finished;
+    for (int i = 0; i < last_pipeline_stats.count; i++) {
+        const JobProcess *proc = &job->procs[i];
+        fill_stage_stats(&last_pipeline_stats.stages[i], proc->name,
+                         timespec_seconds_between(&proc->started, &proc->finished), &proc->usage);
+        if (timespec_seconds_between(&proc->started, &first_start) > 0) first_start = proc->started;
+        if (timespec_seconds_between(&last_finish, &proc->finished) > 0) last_finish = proc->finished;
+    }
+    last_pipeline_stats.wall_seconds = timespec_seconds_between(&first_start, &last_finish);
+}
+
+// Value of one of the $SDN_TIME_* variables, computed when it is read so that
+// running a command costs nothing extra. Returns NULL for other names.
+const char *pipeline_stats_variable(const char *name) {
+    static char value[32];
+    double user = 0, sys = 0;
+    long max_rss = 0, switches = 0;
+    for (int i = 0; i < last_pipeline_stats.count; i++) {
+        const StageStats *stage = &last_pipeline_stats.stages[i];
+        user += stage->user_seconds;
+        sys += stage->system_seconds;
+        if (stage->max_rss_kb > max_rss) max_rss = stage->max_rss_kb;
+        switches += stage->voluntary_switches + stage->involuntary_switches;
+    }
+    if (strcmp(name, "SDN_TIME_REAL") == 0) {
+        snprintf(value, sizeof(value), "%.3f", last_pipeline_stats.wall_seconds);
+    } else if (strcmp(name, "SDN_TIME_USER") == 0) {
+        snprintf(value, sizeof(value), "%.3f", user);
+    } else if (strcmp(name, "SDN_TIME_SYS") == 0) {
+        snprintf(value, sizeof(value), "%.3f", sys);
+    } else if (strcmp(name, "SDN_TIME_MAXRSS") == 0) {
+        snprintf(value, sizeof(value), "%ld", max_rss);
+    } else if (strcmp(name, "SDN_TIME_CSW") == 0) {
+        snprintf(value, sizeof(value), "%ld", switches);
+    } else {
+        return NULL;
+    }
+    return value;
+}
+
+void print_pipeline_stats() {
+    fprintf(stderr, "%-5s %-16s %9s %9s %9s %10s %7s %7s\n",
+            "stage", "command", "real", "user", "sys", "maxrss", "vcsw", "ivcsw");
+    double user = 0, sys = 0;
+    long max_rss = 0, vcsw = 0, ivcsw = 0;
+    for (int i = 0; i < last_pipeline_stats.count; i++) {
+        const StageStats *stage = &last_pipeline_stats.stages[i];
+        fprintf(stderr, "%5d %-16.16s %8.3fs %8.3fs %8.3fs %8ldkB %7ld %7ld\n", i + 1, stage->name,
+                stage->wall_seconds, stage->user_seconds, stage->system_seconds,
+                stage->max_rss_kb, stage->voluntary_switches, stage->involuntary_switches);
+        user += stage->user_seconds;
+        sys += stage->system_seconds;
+        if (stage->max_rss_kb > max_rss) max_rss = stage->max_rss_kb;
+        vcsw += stage->voluntary_switches;
+        ivcsw += stage->involuntary_switches;
+    }
+    if (last_pipeline_stats.count > 1) {
+        fprintf(stderr, "%5s %-16s %8.3fs %8.3fs %8.3fs %8ldkB %7ld %7ld\n", "", "total",
+                last_pipeline_stats.wall_seconds, user, sys, max_rss, vcsw, ivcsw);
+    }
+}
+
+// Give the terminal to job, optionally resume it, and wait for it.
+// Returns the job's exit status; a stopped job is turned into a background job.
+int run_job_in_foreground(Job *job, bool resume) {
+    job->background = false;
+    if (job_control_enabled) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+        if (resume) tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+    }
+    if (resume) {
+        for (int i = 0; i < job->num_procs; i++) job->procs[i].stopped = false;
+        kill(-job->pgid, SIGCONT);
+    }
+
+    double trace_start = trace_begin();
+    wait_for_job(job);
+    trace_end("wait", trace_start, job->command);
+
+    if (job_control_enabled) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcgetattr(STDIN_FILENO, &job->tmodes);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+
+    int status = job_exit_status(job);
+    const JobProcess *last = &job->procs[job->num_procs - 1];
+    if (last->completed && WIFSIGNALED(last->status) && WTERMSIG(last->status) == SIGINT) {
+        interrupt_pending = 1; // Ctrl+C on a command also stops the loop running it
+    }
+    if (job_is_completed(job)) {
+        record_job_stats(job);
+        free_job(job);
+    } else {
+        job->background = true;
+        job->notified = true;
+        printf("\n[%d]  Stopped                  %s\n", job->id, job->command);
+    }
+    return status;
+}
+
 // Function to find a matching command in history
 char *find_matching_command(const char *partial, HistoryCache *cache) {
     if (strlen(partial) == 0) return NULL;
@@ -96,24 +715,95 @@ char *find_matching_command(const char *partial, HistoryCache *cache) {
     return NULL;
 }
 
-void load_history_cache(HistoryCache *cache) {
-    char history_file_path[FILENAME_MAX];
-    get_history_file_path(history_file_path, sizeof(history_file_path));
-    
-    FILE *fp = fopen(history_file_path, "r");
-    if (!fp) return;
-    
-    char line[MAX_LINE + 30]; 
-    cache->count = 0;
+// A history line is "[YYYY-MM-DD HH:MM:SS STATUS SECONDS CWD] command", written
+// once the command has finished. Lines from before commands were timed close
+// the bracket right after the timestamp; their status and directory are
+// unknown. CWD is the last field and escapes %, ] and control characters as
+// %XX, so the first ']' always ends the bracket.
+typedef struct {
+    time_t time;            // -1 if the timestamp does not parse
+    int status;             // -1 when not recorded
+    double seconds;
+    char cwd[FILENAME_MAX]; // "" when not recorded or not asked for
+    const char *command;    // Points into the parsed line
+} HistoryRecord;
+
+// Local "YYYY-MM-DD HH:MM:SS" to seconds since the epoch. Lines arrive in time
+// order, so mktime() only runs when the hour changes.
+time_t parse_history_time(const char *text) {
+    static char cached_hour[14];
+    static time_t cached_base;
+    int year, month, day, hour, minute, second;
+    if (sscanf(text, "%4d-%2d-%2d %2d:%2d:%2d", &year, &month, &day, &hour, &minute, &second) != 6) return -1;
+    if (memcmp(text, cached_hour, 13) != 0) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        tm.tm_hour = hour;
+        tm.tm_isdst = -1;
+        cached_base = mktime(&tm);
+        memcpy(cached_hour, text, 13);
+    }
+    return cached_base + minute * 60 + second;
+}
+
+void encode_history_cwd(const char *cwd, char *out, size_t size) {
+    size_t len = 0;
+    for (const unsigned char *p = (const unsigned char *)cwd; *p && len + 4 < size; p++) {
+        if (*p == '%' || *p == ']' || *p < 0x20) len += snprintf(out + len, size - len, "%%%02X", *p);
+        else out[len++] = *p;
+    }
+    out[len] = '\0';
+}
+
+void decode_history_cwd(const char *start, const char *end, char *out, size_t size) {
+    size_t len = 0;
+    for (const char *p = start; p < end && len + 1 < size; p++) {
+        unsigned int byte;
+        if (*p == '%' && end - p >= 3 && sscanf(p + 1, "%2x", &byte) == 1) {
+            out[len++] = (char)byte;
+            p += 2;
+        } else {
+            out[len++] = *p;
+        }
+    }
+    out[len] = '\0';
+}
+
+// Split a NUL-terminated history line into its fields. The directory is only
+// decoded when want_cwd is set, since most callers never look at it.
+bool parse_history_line(const char *line, HistoryRecord *record, bool want_cwd) {
+    record->time = -1;
+    record->status = -1;
+    record->seconds = 0;
+    record->cwd[0] = '\0';
+    if (line[0] != '[') return false;
+    const char *close = strchr(line, ']');
+    if (!close || close[1] != ' ') return false;
+    record->command = close + 2;
+    if (close - line < 20) return true;
+    record->time = parse_history_time(line + 1);
+    const char *meta = line + 20;
+    if (*meta != ' ' || meta >= close) return true;
+    char *end;
+    record->status = (int)strtol(meta + 1, &end, 10);
+    if (*end == ' ') record->seconds = strtod(end + 1, &end);
+    if (*end == ' ' && want_cwd) decode_history_cwd(end + 1, close, record->cwd, sizeof(record->cwd));
+    return true;
+}
+
+// Add the commands in fp's remaining lines to the cache, skipping duplicates
+void read_history_lines(HistoryCache *cache, FILE *fp) {
+    char line[HISTORY_LINE_MAX];
+    HistoryRecord record;
     
     while (fgets(line, sizeof(line), fp) && cache->count < MAX_HISTORY_ENTRIES) {
-        char *cmd_start = strchr(line, ']');
-        if (!cmd_start) continue;
-        
-        cmd_start += 2; // Skip "] "
-        
         // Remove trailing newline
         line[strcspn(line, "\n")] = 0;
+        if (!parse_history_line(line, &record, false)) continue;
+        const char *cmd_start = record.command;
         
         // Store unique commands only
         int is_duplicate = 0;
@@ -129,7 +819,20 @@ void load_history_cache(HistoryCache *cache) {
             cache->count++;
         }
     }
+    cache->file_offset = ftello(fp);
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0) cache->file_ino = st.st_ino;
+}
+
+void load_history_cache(HistoryCache *cache) {
+    char history_file_path[FILENAME_MAX];
+    get_history_file_path(history_file_path, sizeof(history_file_path));
     
+    FILE *fp = fopen(history_file_path, "r");
+    if (!fp) return;
+    
+    cache->count = 0;
+    read_history_lines(cache, fp);
     fclose(fp);
 }
 
@@ -138,6 +841,149 @@ void free_history_cache(HistoryCache *cache) {
         free(cache->commands[i]);
     }
     cache->count = 0;
+    cache->file_offset = 0;
+}
+
+// Pick up commands other sdn sessions appended since we last read the file
+void sync_history_cache(HistoryCache *cache) {
+    char history_file_path[FILENAME_MAX];
+    get_history_file_path(history_file_path, sizeof(history_file_path));
+
+    FILE *fp = fopen(history_file_path, "r");
+    if (!fp) return;
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && (st.st_size < cache->file_offset || st.st_ino != cache->file_ino)) {
+        // The file was rewritten or compacted, not appended to: start over
+        free_history_cache(cache);
+    }
+    if (fseeko(fp, cache->file_offset, SEEK_SET) == 0) {
+        read_history_lines(cache, fp);
+    }
+    fclose(fp);
+}
+
+// --- Event loop ---
+// The line editor waits in epoll on the terminal plus every registered source:
+// a signalfd for SIGCHLD and SIGWINCH, an inotify watch that keeps the history
+// cache in sync with other sessions, and any eventfd a background worker adds
+// with event_loop_add(). Nothing is polled on a timer, so an idle shell sleeps.
+
+#define MAX_EVENT_SOURCES 16
+
+typedef void (*EventCallback)(int fd, void *data);
+
+typedef struct {
+    int fd;
+    EventCallback callback;
+    void *data;
+} EventSource;
+
+int event_loop_fd = -1;
+EventSource event_sources[MAX_EVENT_SOURCES];
+int event_source_count = 0;
+bool stdin_in_event_loop = false; // epoll refuses regular files, which are always readable anyway
+bool redraw_requested = false;    // A source printed or changed something the line editor must redraw
+int terminal_columns = 80;
+
+int event_loop_add(int fd, EventCallback callback, void *data) {
+    if (event_loop_fd == -1 || event_source_count >= MAX_EVENT_SOURCES) return -1;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(event_loop_fd, EPOLL_CTL_ADD, fd, &ev) == -1) return -1;
+    event_sources[event_source_count].fd = fd;
+    event_sources[event_source_count].callback = callback;
+    event_sources[event_source_count].data = data;
+    event_source_count++;
+    return 0;
+}
+
+void event_loop_remove(int fd) {
+    for (int i = 0; i < event_source_count; i++) {
+        if (event_sources[i].fd != fd) continue;
+        epoll_ctl(event_loop_fd, EPOLL_CTL_DEL, fd, NULL);
+        event_sources[i] = event_sources[--event_source_count];
+        return;
+    }
+}
+
+void update_terminal_columns() {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        terminal_columns = ws.ws_col;
+    }
+}
+
+void handle_signal_event(int fd, void *data) {
+    (void)data;
+    struct signalfd_siginfo info;
+    bool child_changed = false;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD) {
+            child_changed = true;
+        } else if (info.ssi_signo == SIGWINCH) {
+            update_terminal_columns();
+        }
+    }
+    if (child_changed) {
+        reap_children();
+        if (has_pending_job_notifications()) redraw_requested = true;
+    }
+}
+
+void handle_history_watch_event(int fd, void *data) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool history_changed = false;
+    ssize_t len;
+    while ((len = read(fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len > 0 && strcmp(ev->name, HISTORY_FILE_NAME) == 0) history_changed = true;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    if (history_changed) sync_history_cache((HistoryCache *)data);
+}
+
+void init_event_loop(HistoryCache *cache) {
+    event_loop_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_loop_fd == -1) {
+        perror("sdn: epoll_create1");
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = STDIN_FILENO;
+    stdin_in_event_loop = epoll_ctl(event_loop_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1 || event_loop_add(signal_fd, handle_signal_event, NULL) == -1) {
+        perror("sdn: signalfd");
+    }
+
+    // Watch the directory rather than the file so rewrites via rename are seen too
+    char history_dir[FILENAME_MAX];
+    get_history_file_path(history_dir, sizeof(history_dir));
+    char *slash = strrchr(history_dir, '/');
+    if (slash) *slash = '\0'; else strcpy(history_dir, ".");
+    int watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd != -1) {
+        if (inotify_add_watch(watch_fd, history_dir, IN_MODIFY | IN_CREATE | IN_MOVED_TO) == -1 ||
+            event_loop_add(watch_fd, handle_history_watch_event, cache) == -1) {
+            close(watch_fd);
+        }
+    }
+
+    update_terminal_columns();
 }
 
 const char *find_alias_command(const char *name) {
@@ -183,7 +1029,7 @@ void add_or_update_alias(const char *name, const char *command) {
     add_alias_to_table(alias_table, &alias_count, name, command, MAX_ALIASES);
 }
 
-void remove_alias(const char *name) {
+int remove_alias(const char *name) {
     int found_idx = -1;
     for (int i = 0; i < alias_count; i++) {
         if (strcmp(alias_table[i].name, name) == 0) {
@@ -196,9 +1042,10 @@ void remove_alias(const char *name) {
             alias_table[i] = alias_table[i+1];
         }
         alias_count--;
-    } else {
-        fprintf(stderr, "sdn: unalias: %s: not found\n", name);
+        return 0;
     }
+    fprintf(stderr, "sdn: unalias: %s: not found\n", name);
+    return 1;
 }
 
 void print_all_aliases() {
@@ -214,10 +1061,10 @@ void print_all_aliases() {
     }
 }
 
-void handle_alias_builtin(char **args) {
+int handle_alias_builtin(char **args) {
     if (args[1] == NULL) {
         print_all_aliases();
-        return;
+        return 0;
     }
 
     char reconstructed_assignment[MAX_LINE]; // Buffer for "name=value"
@@ -252,13 +1099,13 @@ void handle_alias_builtin(char **args) {
         
         if (equals_ptr == NULL) { 
             fprintf(stderr, "sdn: alias: internal error parsing assignment\n");
-            return;
+            return 1;
         }
 
         size_t name_len = equals_ptr - reconstructed_assignment;
         if (name_len == 0 || name_len >= MAX_ALIAS_NAME_LEN) {
             fprintf(stderr, "sdn: alias: invalid alias name\n");
-            return;
+            return 1;
         }
         strncpy(alias_name, reconstructed_assignment, name_len);
         alias_name[name_len] = '\0';
@@ -280,52 +1127,192 @@ void handle_alias_builtin(char **args) {
     } else {
         if (args[2] != NULL) { 
             fprintf(stderr, "sdn: alias: usage: alias [name[=value] ...]\n");
-            return;
+            return 1;
         }
         const char *cmd = find_alias_command(args[1]);
         if (cmd) {
             printf("%s='%s'\n", args[1], cmd);
         } else {
             fprintf(stderr, "sdn: alias: %s: not found\n", args[1]);
+            return 1;
         }
     }
+    return 0;
 }
 
-void handle_unalias_builtin(char **args) {
+int handle_unalias_builtin(char **args) {
     if (args[1] == NULL) {
         fprintf(stderr, "sdn: unalias: usage: unalias name [name ...]\n");
-        return;
+        return 1;
     }
+    int status = 0;
     for (int i = 1; args[i] != NULL; i++) {
-        remove_alias(args[i]);
+        if (remove_alias(args[i]) != 0) status = 1;
     }
+    return status;
 }
 
-void clear_local_aliases() {
-    // For simplicity, we just reset the count.
-    // A more robust implementation would free strduped names/commands if they were dynamically allocated per entry.
-    // Since we use fixed-size arrays and strncpy, this is okay for now.
-    local_alias_count = 0;
-    // If AliasEntry members were char*, you'd loop and free them here.
-}
+// --- Working directory ---
+// The shell keeps its logical working directory ($PWD) itself. cd updates it
+// lexically, like `cd -L` elsewhere, so paths through symlinks stay as typed.
+// The cached path is trusted while "." still has the device and inode that
+// were recorded with it. That check is one stat that resolves no path, where
+// getcwd() walks the dentry chain, which is slow (or fails) on deep NFS and
+// FUSE trees. getcwd() is asked again only when the check fails.
 
-void load_local_aliases(const char *current_dir_path) {
-    char local_alias_file_path[FILENAME_MAX];
-    snprintf(local_alias_file_path, sizeof(local_alias_file_path), "%s/%s", current_dir_path, LOCAL_ALIASES_FILENAME);
+char shell_pwd[FILENAME_MAX] = "";
+dev_t shell_pwd_dev;
+ino_t shell_pwd_ino;
 
-    FILE *fp = fopen(local_alias_file_path, "r");
-    if (!fp) {
-        return; // No local alias file, or not readable
+// Collapse "//", "." and ".." in an absolute path without touching the filesystem
+void normalize_path(char *path) {
+    char *out = path;
+    const char *in = path;
+    while (*in) {
+        while (*in == '/') in++;
+        const char *component = in;
+        while (*in && *in != '/') in++;
+        size_t len = in - component;
+        if (len == 0 || (len == 1 && component[0] == '.')) continue;
+        if (len == 2 && component[0] == '.' && component[1] == '.') {
+            while (out > path && *--out != '/') {}
+            continue;
+        }
+        *out++ = '/';
+        memmove(out, component, len);
+        out += len;
     }
+    if (out == path) *out++ = '/';
+    *out = '\0';
+}
 
-    char line[MAX_LINE];
-    while (fgets(line, sizeof(line), fp)) {
-        line[strcspn(line, "\n")] = 0; // Remove newline
-
-        char *equals_ptr = strchr(line, '=');
-        if (equals_ptr != NULL) {
-            char alias_name[MAX_ALIAS_NAME_LEN];
-            char alias_value[MAX_ALIAS_COMMAND_LEN];
+// Record path as the working directory the shell has just changed to
+void set_shell_pwd(const char *path) {
+    struct stat st;
+    if (stat(".", &st) == -1) {
+        shell_pwd[0] = '\0';
+        return;
+    }
+    if (shell_pwd[0]) setenv("OLDPWD", shell_pwd, 1);
+    snprintf(shell_pwd, sizeof(shell_pwd), "%s", path);
+    shell_pwd_dev = st.st_dev;
+    shell_pwd_ino = st.st_ino;
+    setenv("PWD", shell_pwd, 1);
+}
+
+// Adopt an inherited $PWD when it is normalized and names the directory we are really in
+bool adopt_inherited_pwd() {
+    const char *pwd = getenv("PWD");
+    struct stat pwd_stat, dot_stat;
+    if (!pwd || pwd[0] != '/' || strlen(pwd) >= sizeof(shell_pwd) || stat(pwd, &pwd_stat) == -1 ||
+        stat(".", &dot_stat) == -1 || pwd_stat.st_dev != dot_stat.st_dev || pwd_stat.st_ino != dot_stat.st_ino) {
+        return false;
+    }
+    char normalized[FILENAME_MAX];
+    snprintf(normalized, sizeof(normalized), "%s", pwd);
+    normalize_path(normalized);
+    if (strcmp(normalized, pwd) != 0) return false;
+    set_shell_pwd(normalized);
+    return true;
+}
+
+// The logical working directory, or NULL if it cannot be determined
+const char *current_directory() {
+    static bool inherited_checked = false;
+    if (!inherited_checked) {
+        inherited_checked = true;
+        if (adopt_inherited_pwd()) return shell_pwd;
+    }
+    struct stat st;
+    if (shell_pwd[0] && stat(".", &st) == 0 && st.st_dev == shell_pwd_dev && st.st_ino == shell_pwd_ino) {
+        return shell_pwd;
+    }
+    char cwd[FILENAME_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) return NULL;
+    set_shell_pwd(cwd);
+    return shell_pwd[0] ? shell_pwd : NULL;
+}
+
+// --- Directory-local aliases ---
+// The local alias table merges .sdn_local_aliases from the current directory
+// and each ancestor up to the repository root (the nearest directory holding
+// .git), nearer files overriding farther ones; outside a repository only the
+// current directory counts. Parsed files are cached and reused while their
+// (dev, inode, mtime) is unchanged, and each directory's ancestor chain is
+// cached too, along with the inode and mtime of every directory searched for
+// .git, so `git init` in an ancestor is noticed. Revisiting a directory costs
+// one stat per file in its chain and one per directory searched.
+// With `set -o aliaswatch` an inotify watch on each directory marks files
+// stale instead, leaving only the stats of the directories.
+
+typedef struct LocalAliasFile {
+    char *dir;              // Directory holding the file
+    bool exists;
+    dev_t dev;              // Identity of the file as last parsed
+    ino_t ino;
+    struct timespec mtime;
+    AliasEntry *entries;
+    int count;
+    int watch;              // inotify watch on dir, or -1
+    bool stale;             // The watch saw the file change since it was parsed
+    struct LocalAliasFile *next;
+} LocalAliasFile;
+
+typedef struct {
+    ino_t ino;
+    struct timespec mtime; // Changes when an entry such as .git is created or removed
+} DirectoryStamp;
+
+typedef struct LocalAliasChain {
+    char *dir;
+    dev_t dev;
+    ino_t ino;
+    LocalAliasFile **files; // Repository root first, the directory itself last
+    int file_count;
+    DirectoryStamp *searched; // The directories searched for .git, dir itself first
+    int searched_count;
+    struct LocalAliasChain *next;
+} LocalAliasChain;
+
+LocalAliasFile *local_alias_files = NULL;
+LocalAliasChain *local_alias_chains = NULL;
+const LocalAliasChain *merged_alias_chain = NULL; // The chain local_alias_table was built from
+unsigned long local_alias_generation = 0;          // Bumped whenever a cached file is reparsed
+unsigned long merged_alias_generation = 0;
+int local_alias_watch_fd = -1;
+
+void handle_local_alias_watch_event(int fd, void *data) {
+    (void)data;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            bool overflow = ev->mask & IN_Q_OVERFLOW;
+            bool alias_file = ev->len > 0 && strcmp(ev->name, LOCAL_ALIASES_FILENAME) == 0;
+            if (!overflow && !alias_file && !(ev->mask & IN_IGNORED)) continue;
+            for (LocalAliasFile *file = local_alias_files; file; file = file->next) {
+                if (!overflow && file->watch != ev->wd) continue;
+                file->stale = true;
+                if (ev->mask & IN_IGNORED) file->watch = -1; // The directory is gone
+            }
+        }
+    }
+}
+
+// Parse one alias file into file->entries
+void parse_local_alias_file(FILE *fp, LocalAliasFile *file) {
+    static AliasEntry parsed[MAX_ALIASES];
+    int count = 0;
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = 0; // Remove newline
+
+        char *equals_ptr = strchr(line, '=');
+        if (equals_ptr != NULL) {
+            char alias_name[MAX_ALIAS_NAME_LEN];
+            char alias_value[MAX_ALIAS_COMMAND_LEN];
 
             size_t name_len = equals_ptr - line;
             if (name_len > 0 && name_len < MAX_ALIAS_NAME_LEN) {
@@ -335,7 +1322,7 @@ void load_local_aliases(const char *current_dir_path) {
                 char *value_start = equals_ptr + 1;
                 strncpy(alias_value, value_start, MAX_ALIAS_COMMAND_LEN - 1);
                 alias_value[MAX_ALIAS_COMMAND_LEN - 1] = '\0';
-                
+
                 // Optional: remove quotes like in global alias handling
                 size_t val_len = strlen(alias_value);
                 if (val_len >= 2 && ((alias_value[0] == '"' && alias_value[val_len-1] == '"') ||
@@ -343,11 +1330,231 @@ void load_local_aliases(const char *current_dir_path) {
                     memmove(alias_value, alias_value + 1, val_len - 2);
                     alias_value[val_len - 2] = '\0';
                 }
-                add_alias_to_table(local_alias_table, &local_alias_count, alias_name, alias_value, MAX_ALIASES);
+                add_alias_to_table(parsed, &count, alias_name, alias_value, MAX_ALIASES);
             }
         }
     }
+    free(file->entries);
+    file->entries = NULL;
+    file->count = 0;
+    if (count > 0 && (file->entries = malloc(count * sizeof(AliasEntry)))) {
+        memcpy(file->entries, parsed, count * sizeof(AliasEntry));
+        file->count = count;
+    }
+}
+
+// Bring a cached file up to date, reparsing it only if its identity changed
+void refresh_local_alias_file(LocalAliasFile *file) {
+    if (file->watch != -1 && !file->stale && shell_options[OPT_ALIASWATCH].enabled) return;
+    file->stale = false;
+    if (shell_options[OPT_ALIASWATCH].enabled && file->watch == -1 && local_alias_watch_fd != -1) {
+        file->watch = inotify_add_watch(local_alias_watch_fd, file->dir, IN_CREATE | IN_DELETE | IN_MODIFY |
+                                        IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+    }
+
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/%s", file->dir, LOCAL_ALIASES_FILENAME);
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        if (file->exists) {
+            file->exists = false;
+            file->count = 0;
+            local_alias_generation++;
+        }
+        return;
+    }
+    if (file->exists && st.st_dev == file->dev && st.st_ino == file->ino &&
+        st.st_mtim.tv_sec == file->mtime.tv_sec && st.st_mtim.tv_nsec == file->mtime.tv_nsec) {
+        return;
+    }
+    FILE *fp = fopen(path, "r");
+    if (!fp) { // Not readable: treat as absent
+        file->exists = false;
+        file->count = 0;
+        local_alias_generation++;
+        return;
+    }
+    parse_local_alias_file(fp, file);
     fclose(fp);
+    file->exists = true;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->mtime = st.st_mtim;
+    local_alias_generation++;
+}
+
+LocalAliasFile *find_local_alias_file(const char *dir) {
+    for (LocalAliasFile *file = local_alias_files; file; file = file->next) {
+        if (strcmp(file->dir, dir) == 0) return file;
+    }
+    LocalAliasFile *file = calloc(1, sizeof(LocalAliasFile));
+    if (!file) return NULL;
+    if (!(file->dir = strdup(dir))) {
+        free(file);
+        return NULL;
+    }
+    file->watch = -1;
+    file->next = local_alias_files;
+    local_alias_files = file;
+    return file;
+}
+
+// Truncate an absolute path to its parent. False if it is already "/".
+bool parent_directory(char *path) {
+    char *slash = strrchr(path, '/');
+    if (!slash || (slash == path && path[1] == '\0')) return false;
+    if (slash == path) path[1] = '\0';
+    else *slash = '\0';
+    return true;
+}
+
+// Find the alias files that apply in chain->dir: the directory itself and its
+// ancestors up to the repository root. Returns false on allocation failure.
+bool resolve_local_alias_chain(LocalAliasChain *chain) {
+    free(chain->files);
+    free(chain->searched);
+    chain->files = NULL;
+    chain->file_count = 0;
+    chain->searched = NULL;
+    chain->searched_count = 0;
+
+    char ancestor[FILENAME_MAX];
+    snprintf(ancestor, sizeof(ancestor), "%s", chain->dir);
+    int depth = 0, capacity = 0;
+    bool in_repository = false;
+    while (true) {
+        char git_path[FILENAME_MAX + 8];
+        struct stat st;
+        if (depth == capacity) {
+            capacity = capacity ? capacity * 2 : 8;
+            DirectoryStamp *grown = realloc(chain->searched, capacity * sizeof(DirectoryStamp));
+            if (!grown) return false;
+            chain->searched = grown;
+        }
+        DirectoryStamp *stamp = &chain->searched[depth++];
+        memset(stamp, 0, sizeof(*stamp));
+        if (stat(ancestor, &st) == 0) {
+            stamp->ino = st.st_ino;
+            stamp->mtime = st.st_mtim;
+        }
+        snprintf(git_path, sizeof(git_path), "%s/.git", strcmp(ancestor, "/") == 0 ? "" : ancestor);
+        if (stat(git_path, &st) == 0) {
+            in_repository = true;
+            break;
+        }
+        if (!parent_directory(ancestor)) break;
+    }
+    chain->searched_count = depth;
+    if (!in_repository) depth = 1;
+
+    chain->files = calloc(depth, sizeof(LocalAliasFile*));
+    if (!chain->files) return false;
+    snprintf(ancestor, sizeof(ancestor), "%s", chain->dir);
+    chain->file_count = depth;
+    for (int i = depth - 1; i >= 0; i--) {
+        chain->files[i] = find_local_alias_file(ancestor); // NULL on allocation failure is skipped
+        parent_directory(ancestor);
+    }
+    return true;
+}
+
+// True if no directory searched for .git has been replaced or had entries added or removed
+bool local_alias_chain_is_current(const LocalAliasChain *chain) {
+    char ancestor[FILENAME_MAX];
+    snprintf(ancestor, sizeof(ancestor), "%s", chain->dir);
+    for (int i = 0; i < chain->searched_count; i++) {
+        struct stat st;
+        if (i > 0) parent_directory(ancestor);
+        if (stat(ancestor, &st) == -1) return false;
+        const DirectoryStamp *stamp = &chain->searched[i];
+        if (st.st_ino != stamp->ino || st.st_mtim.tv_sec != stamp->mtime.tv_sec ||
+            st.st_mtim.tv_nsec != stamp->mtime.tv_nsec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+LocalAliasChain *build_local_alias_chain(const char *dir, const struct stat *dir_stat) {
+    LocalAliasChain *chain = calloc(1, sizeof(LocalAliasChain));
+    if (!chain || !(chain->dir = strdup(dir))) {
+        free(chain);
+        return NULL;
+    }
+    chain->dev = dir_stat->st_dev;
+    chain->ino = dir_stat->st_ino;
+    if (!resolve_local_alias_chain(chain)) {
+        free(chain->files);
+        free(chain->searched);
+        free(chain->dir);
+        free(chain);
+        return NULL;
+    }
+    chain->next = local_alias_chains;
+    local_alias_chains = chain;
+    return chain;
+}
+
+// Empty local_alias_table, e.g. when the working directory cannot be determined
+void forget_local_aliases() {
+    local_alias_count = 0;
+    merged_alias_chain = NULL;
+}
+
+// Make local_alias_table hold the aliases that apply in current_dir_path
+void load_local_aliases(const char *current_dir_path) {
+    if (local_alias_watch_fd != -1) handle_local_alias_watch_event(local_alias_watch_fd, NULL);
+
+    struct stat dir_stat;
+    if (stat(current_dir_path, &dir_stat) == -1) {
+        forget_local_aliases();
+        return;
+    }
+    LocalAliasChain *chain = local_alias_chains;
+    while (chain && strcmp(chain->dir, current_dir_path) != 0) chain = chain->next;
+    if (chain && (chain->dev != dir_stat.st_dev || chain->ino != dir_stat.st_ino ||
+                  !local_alias_chain_is_current(chain))) {
+        // Replaced by another directory of the same name, or a repository
+        // appeared or vanished above it: its files may differ
+        chain->dev = dir_stat.st_dev;
+        chain->ino = dir_stat.st_ino;
+        if (chain == merged_alias_chain) merged_alias_chain = NULL;
+        if (!resolve_local_alias_chain(chain)) {
+            forget_local_aliases();
+            return;
+        }
+    }
+    if (!chain) chain = build_local_alias_chain(current_dir_path, &dir_stat);
+    if (!chain) {
+        forget_local_aliases();
+        return;
+    }
+
+    for (int i = 0; i < chain->file_count; i++) {
+        if (chain->files[i]) refresh_local_alias_file(chain->files[i]);
+    }
+    if (chain == merged_alias_chain && merged_alias_generation == local_alias_generation) return;
+
+    local_alias_count = 0;
+    for (int i = 0; i < chain->file_count; i++) {
+        LocalAliasFile *file = chain->files[i];
+        for (int k = 0; file && file->exists && k < file->count; k++) {
+            add_alias_to_table(local_alias_table, &local_alias_count, file->entries[k].name,
+                               file->entries[k].command, MAX_ALIASES);
+        }
+    }
+    merged_alias_chain = chain;
+    merged_alias_generation = local_alias_generation;
+}
+
+// Interactive shells get an inotify fd up front so `set -o aliaswatch` can add watches later
+void init_local_alias_watch() {
+    local_alias_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (local_alias_watch_fd != -1 &&
+        event_loop_add(local_alias_watch_fd, handle_local_alias_watch_event, NULL) == -1) {
+        close(local_alias_watch_fd);
+        local_alias_watch_fd = -1;
+    }
 }
 
 // Initialize FileMatches structure
@@ -394,7 +1601,8 @@ char *get_current_word(const char *buffer, int position) {
 }
 
 // Find files that match the prefix
-void find_matching_files(const char *prefix, FileMatches *matches) {
+// With logical set, a leading ../ is resolved against $PWD the way cd resolves it
+void find_matching_files(const char *prefix, FileMatches *matches, bool logical) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-truncation"
     DIR *dir;
@@ -416,7 +1624,13 @@ void find_matching_files(const char *prefix, FileMatches *matches) {
         name_prefix = strdup(last_slash + 1);
     }
     
-    dir = opendir(dir_path);
+    char logical_dir[FILENAME_MAX * 2];
+    const char *pwd = logical && strncmp(dir_path, "../", 3) == 0 ? current_directory() : NULL;
+    if (pwd) {
+        snprintf(logical_dir, sizeof(logical_dir), "%s/%s", pwd, dir_path);
+        normalize_path(logical_dir);
+    }
+    dir = opendir(pwd ? logical_dir : dir_path);
     if (!dir) {
         if (strcmp(dir_path, ".") != 0) free(dir_path);
         free(name_prefix);
@@ -511,35 +1725,97 @@ char *find_common_prefix(FileMatches *matches) {
     return common;
 }
 
-void get_prompt(char *prompt_buffer, size_t buffer_size) {
-    char cwd[FILENAME_MAX];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        snprintf(prompt_buffer, buffer_size, "%s> ", cwd);
-    } else {
-        strncpy(prompt_buffer, "sdn> ", buffer_size);
-        prompt_buffer[buffer_size - 1] = '\0';
+#define KEY_EOF (-1)
+#define KEY_ASYNC_EVENT (-2)
+
+// Read one byte of input from the event loop, dispatching other sources meanwhile.
+// Returns the byte, KEY_EOF, or KEY_ASYNC_EVENT when the line needs a redraw.
+int read_key() {
+    while (1) {
+        if (redraw_requested) {
+            redraw_requested = false;
+            return KEY_ASYNC_EVENT;
+        }
+
+        bool stdin_ready = !stdin_in_event_loop;
+        if (event_loop_fd != -1) {
+            struct epoll_event events[MAX_EVENT_SOURCES + 1];
+            int n = epoll_wait(event_loop_fd, events, MAX_EVENT_SOURCES + 1, stdin_ready ? 0 : -1);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                return KEY_EOF;
+            }
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.fd == STDIN_FILENO) {
+                    stdin_ready = true;
+                    continue;
+                }
+                for (int j = 0; j < event_source_count; j++) {
+                    if (event_sources[j].fd == events[i].data.fd) {
+                        event_sources[j].callback(event_sources[j].fd, event_sources[j].data);
+                        break;
+                    }
+                }
+            }
+            if (redraw_requested) continue;
+        }
+
+        if (stdin_ready) {
+            unsigned char c;
+            ssize_t n = read(STDIN_FILENO, &c, 1);
+            if (n == 1) return c;
+            if (n == -1 && errno == EINTR) continue;
+            return KEY_EOF;
+        }
     }
 }
 
-int read_line_with_completion(char *buffer, int max_size, HistoryCache *cache) {
+// The next byte of an escape sequence. An event arriving between its bytes
+// (the prompt's git status, say) must not take the place of one, so its
+// redraw is put back to happen once the sequence is read.
+int read_sequence_key() {
+    bool redraw = false;
+    int c;
+    while ((c = read_key()) == KEY_ASYNC_EVENT) redraw = true;
+    if (redraw) redraw_requested = true;
+    return c;
+}
+
+// Edit one line of input. prompt is what the caller already printed; it is
+// reprinted whenever the line is redrawn.
+int read_line_with_completion(char *buffer, int max_size, HistoryCache *cache, const char *prompt) {
     int c;
     int position = 0;
     char suggestion[MAX_LINE] = {0}; // Initialize to empty
     int history_nav_idx = cache->count; // Current position in history navigation
     FileMatches file_matches;
     init_file_matches(&file_matches);
-    char prompt[FILENAME_MAX + 3]; 
-    get_prompt(prompt, sizeof(prompt));
 
     memset(buffer, 0, max_size);
     enable_raw_mode();
     
     while (1) {
-        c = getchar();
+        c = read_key();
+        int escape_code = 0;
+        if (c == '\033') {
+            int bracket = read_sequence_key(); // Normally '['
+            escape_code = bracket == KEY_EOF ? KEY_EOF : read_sequence_key();
+            if (escape_code == KEY_EOF) c = KEY_EOF; // Input ended inside the sequence
+        }
         
-        if (c == '\033') { // Escape sequence
-            getchar(); // Skip '['
-            switch(getchar()) {
+        if (c == KEY_ASYNC_EVENT) {
+            // Print any notices above the line being edited, then redraw it
+            printf("\033[2K\r");
+            print_job_notifications();
+            printf("%s%s", prompt, buffer);
+            if (suggestion[0] != '\0') {
+                printf("%s%s%s", ANSI_COLOR_GRAY, suggestion, ANSI_COLOR_RESET);
+                printf("\033[%dD", (int)strlen(suggestion));
+            }
+            fflush(stdout);
+            continue;
+        } else if (c == '\033') { // Escape sequence
+            switch(escape_code) {
                 case 'A': // Up arrow
                     if (cache->count > 0 && history_nav_idx > 0) {
                         history_nav_idx--;
@@ -615,7 +1891,8 @@ int read_line_with_completion(char *buffer, int max_size, HistoryCache *cache) {
                 if (strlen(word) > 0) {
                     free_file_matches(&file_matches);
                     init_file_matches(&file_matches);
-                    find_matching_files(word, &file_matches);
+                    bool completing_cd = strncmp(buffer, "cd ", 3) == 0 && strchr(buffer + 3, ' ') == NULL;
+                    find_matching_files(word, &file_matches, completing_cd);
                     
                     if (file_matches.count == 1) {
                         // Single match - complete the word
@@ -654,13 +1931,19 @@ int read_line_with_completion(char *buffer, int max_size, HistoryCache *cache) {
                             }
                         }
                         
-                        // Display all matches below
+                        // Display all matches below, as many per row as the terminal fits
+                        size_t widest = 0;
+                        for (int i = 0; i < file_matches.count; i++) {
+                            if (strlen(file_matches.files[i]) > widest) widest = strlen(file_matches.files[i]);
+                        }
+                        int per_row = terminal_columns / (int)(widest + 2);
+                        if (per_row < 1) per_row = 1;
                         printf("\n");
                         for (int i = 0; i < file_matches.count; i++) {
-                            printf("%s  ", file_matches.files[i]);
-                            if ((i + 1) % 4 == 0) printf("\n");
+                            printf("%-*s  ", (int)widest, file_matches.files[i]);
+                            if ((i + 1) % per_row == 0) printf("\n");
                         }
-                        if (file_matches.count % 4 != 0) printf("\n");
+                        if (file_matches.count % per_row != 0) printf("\n");
                         
                         // Redraw the prompt and buffer
                         printf("%s%s", prompt, buffer);
@@ -671,7 +1954,14 @@ int read_line_with_completion(char *buffer, int max_size, HistoryCache *cache) {
                 free(word);
             }
             fflush(stdout);
-        } else if (c == 4) { // CTRL+D
+        } else if (c == 3) { // CTRL+C: abandon the current line
+            printf("^C\n%s", prompt);
+            buffer[0] = '\0';
+            position = 0;
+            suggestion[0] = '\0';
+            history_nav_idx = cache->count;
+            fflush(stdout);
+        } else if (c == 4 || c == KEY_EOF) { // CTRL+D or end of input
             disable_raw_mode();
             free_file_matches(&file_matches);
             return -1;
@@ -741,30 +2031,46 @@ void get_history_file_path(char *path_buffer, size_t buffer_size) {
     }
 }
 
-void save_to_history(const char *command) {
+// Append a finished command, one history line per line of its text
+void save_to_history(const char *command, time_t started, int status, double seconds, const char *cwd) {
     char history_file_path[FILENAME_MAX];
     get_history_file_path(history_file_path, sizeof(history_file_path));
 
+    int lock_fd = lock_history(LOCK_SH); // Keeps compaction from renaming the file under us
+    off_t size = -1;
     FILE *fp = fopen(history_file_path, "a"); 
     if (fp) {
-        time_t now = time(NULL);
-        struct tm *timeinfo = localtime(&now);
+        struct tm *timeinfo = localtime(&started);
         char timestamp[20];
         strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", timeinfo);
-        
-        fprintf(fp, "[%s] %s\n", timestamp, command);
+        char encoded_cwd[FILENAME_MAX * 3];
+        encode_history_cwd(cwd ? cwd : "", encoded_cwd, sizeof(encoded_cwd));
+
+        for (const char *line = command; *line; ) {
+            size_t length = strcspn(line, "\n");
+            if (length > 0) {
+                fprintf(fp, "[%s %d %.3f %s] %.*s\n", timestamp, status, seconds, encoded_cwd, (int)length, line);
+            }
+            line += length;
+            if (*line == '\n') line++;
+        }
+        struct stat st;
+        if (fflush(fp) == 0 && fstat(fileno(fp), &st) == 0) size = st.st_size;
         fclose(fp);
     } else {
         perror("sdn: error writing to history file");
     }
+    if (lock_fd != -1) close(lock_fd);
+    if (size > 0) maybe_compact_history(size);
 }
 
-void display_history() {
+int display_history() {
     char history_file_path[FILENAME_MAX];
     get_history_file_path(history_file_path, sizeof(history_file_path));
     FILE *fp = fopen(history_file_path, "r");
     if (fp) {
-        char line[MAX_LINE + 30]; // Extra space for timestamp
+        char line[HISTORY_LINE_MAX]; // Extra space for timestamp, status and directory
+        HistoryRecord record;
         int count = 1;
         
         printf("\nCommand History:\n");
@@ -773,7 +2079,8 @@ void display_history() {
         while (fgets(line, sizeof(line), fp)) {
             // Remove trailing newline
             line[strcspn(line, "\n")] = 0;
-            printf("%3d  %s\n", count++, line);
+            if (parse_history_line(line, &record, false)) printf("%3d  [%.19s] %s\n", count++, line + 1, record.command);
+            else printf("%3d  %s\n", count++, line);
         }
         printf("----------------\n");
         fclose(fp);
@@ -782,8 +2089,644 @@ void display_history() {
             printf("No command history found.\n");
         } else {
             perror("sdn: error reading history file");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// --- History index ---
+// `history` with filters answers from ~/.sdn_history.idx instead of reading
+// every line. The index covers the history file up to indexed_size and holds:
+//   - one fixed-size record per line: file offset, start time, status, duration
+//   - the record numbers again, sorted by start time, for --since/--until
+//   - for each of 65536 hashed trigrams of the lowercased command, the
+//     records containing it, as varint-encoded gaps
+// A substring query reads the posting lists of its trigrams, intersects them
+// and checks only the surviving lines. Hash collisions only add candidates,
+// which the check drops. Lines appended since the index was written are
+// scanned directly until there are more than HISTORY_INDEX_MAX_TAIL bytes of
+// them; then the next query rebuilds the index and replaces it with rename().
+// An index read from disk is checked before use: every record and time entry
+// must point inside the indexed part, each posting must name a record, and a
+// hash of the last HISTORY_INDEX_CHECK_SIZE indexed bytes must still match,
+// so a history file rewritten in place is not searched through a stale index.
+// Postings are checked as a query decodes them; a bad one makes that query
+// scan every line instead.
+
+#define HISTORY_INDEX_MAGIC "SDNHIX2"
+#define HISTORY_INDEX_BUCKETS 65536
+#define HISTORY_INDEX_MAX_TAIL (256 * 1024)
+#define HISTORY_INDEX_CHECK_SIZE 4096
+
+typedef struct {
+    char magic[8];
+    uint64_t history_dev;
+    uint64_t history_ino;
+    uint64_t indexed_size;  // Bytes of the history file covered, always whole lines
+    uint32_t record_count;
+    uint32_t postings_size;
+    uint32_t check_hash;    // hash_bytes() of the last HISTORY_INDEX_CHECK_SIZE indexed bytes
+    uint32_t reserved;
+} HistoryIndexHeader;
+
+typedef struct {
+    uint64_t offset;        // Start of the line in the history file
+    int64_t time;
+    int32_t status;
+    uint32_t milliseconds;
+} HistoryIndexRecord;
+
+typedef struct {
+    void *data;             // The whole index: mapped from disk or just built
+    size_t size;
+    bool mapped;
+    const HistoryIndexHeader *header;
+    const HistoryIndexRecord *records;
+    const uint32_t *by_time;
+    const uint32_t *buckets;    // HISTORY_INDEX_BUCKETS + 1 offsets into postings
+    const uint8_t *postings;
+} HistoryIndex;
+
+typedef struct {
+    const char *text;       // Substring of the command, or NULL
+    regex_t *regex;         // Extended regex on the command, or NULL
+    char regex_literal[MAX_LINE]; // Text every regex match contains, to narrow with the index
+    bool ignore_case;
+    char directory[FILENAME_MAX]; // Ran in this directory or below it, or ""
+    time_t since, until;    // -1 when open
+    bool failed_only;
+    int limit;              // Only the last N matches; 0 for all
+    bool long_format;
+} HistoryQuery;
+
+uint32_t trigram_bucket(const char *p) {
+    uint32_t trigram = (uint32_t)tolower((unsigned char)p[0]) << 16 |
+                       (uint32_t)tolower((unsigned char)p[1]) << 8 | (uint32_t)tolower((unsigned char)p[2]);
+    return (trigram * 2654435761u) >> 16;
+}
+
+size_t varint_length(uint32_t value) {
+    size_t length = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        length++;
+    }
+    return length;
+}
+
+uint8_t *put_varint(uint8_t *p, uint32_t value) {
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint32_t *value) {
+    uint32_t result = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7) {
+        result |= (uint32_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *value = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+uint32_t hash_bytes(const char *data, size_t length) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    return hash;
+}
+
+void get_history_index_path(char *path_buffer, size_t buffer_size) {
+    char history_file_path[FILENAME_MAX];
+    get_history_file_path(history_file_path, sizeof(history_file_path));
+    snprintf(path_buffer, buffer_size, "%s.idx", history_file_path);
+}
+
+// Copy the line at offset into buffer, NUL-terminated; returns the offset after it
+size_t copy_history_line(const char *text, size_t size, size_t offset, char *buffer, size_t buffer_size) {
+    const char *start = text + offset;
+    const char *newline = memchr(start, '\n', size - offset);
+    size_t length = newline ? (size_t)(newline - start) : size - offset;
+    size_t copied = length < buffer_size - 1 ? length : buffer_size - 1;
+    memcpy(buffer, start, copied);
+    buffer[copied] = '\0';
+    return offset + length + (newline ? 1 : 0);
+}
+
+void free_history_index(HistoryIndex *index) {
+    if (index->mapped) munmap(index->data, index->size);
+    else free(index->data);
+    memset(index, 0, sizeof(*index));
+}
+
+// Point the section pointers into data, or return false if it is not a sane index
+bool attach_history_index(HistoryIndex *index, void *data, size_t size) {
+    const HistoryIndexHeader *header = data;
+    if (size < sizeof(*header) || memcmp(header->magic, HISTORY_INDEX_MAGIC, 8) != 0) return false;
+    size_t records_size = (size_t)header->record_count * sizeof(HistoryIndexRecord);
+    size_t by_time_size = (size_t)header->record_count * sizeof(uint32_t);
+    size_t buckets_size = (HISTORY_INDEX_BUCKETS + 1) * sizeof(uint32_t);
+    if (size != sizeof(*header) + records_size + by_time_size + buckets_size + header->postings_size) return false;
+    index->data = data;
+    index->size = size;
+    index->header = header;
+    index->records = (const HistoryIndexRecord *)(header + 1);
+    index->by_time = (const uint32_t *)(index->records + header->record_count);
+    index->buckets = index->by_time + header->record_count;
+    index->postings = (const uint8_t *)(index->buckets + HISTORY_INDEX_BUCKETS + 1);
+    return index->buckets[HISTORY_INDEX_BUCKETS] == header->postings_size;
+}
+
+uint32_t history_index_check_hash(const char *text, size_t indexed_size) {
+    size_t length = indexed_size < HISTORY_INDEX_CHECK_SIZE ? indexed_size : HISTORY_INDEX_CHECK_SIZE;
+    return hash_bytes(text + indexed_size - length, length);
+}
+
+// True if every offset in the index stays inside what it covers
+bool history_index_is_consistent(const HistoryIndex *index) {
+    uint32_t count = index->header->record_count;
+    uint64_t previous_end = 0;
+    for (uint32_t r = 0; r < count; r++) { // Records are in file order
+        if (index->records[r].offset < previous_end || index->records[r].offset >= index->header->indexed_size) {
+            return false;
+        }
+        previous_end = index->records[r].offset + 1;
+        if (index->by_time[r] >= count) return false;
+    }
+    for (uint32_t b = 0; b < HISTORY_INDEX_BUCKETS; b++) {
+        if (index->buckets[b] > index->buckets[b + 1]) return false;
+    }
+    return true; // Postings are checked as they are decoded, which is cheaper than reading them all
+}
+
+// Map the index on disk if it still describes this history file
+bool load_history_index(HistoryIndex *index, const struct stat *history_st, const char *text) {
+    char index_path[FILENAME_MAX + 8];
+    get_history_index_path(index_path, sizeof(index_path));
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    index->mapped = true;
+    if (!attach_history_index(index, data, st.st_size)) {
+        munmap(data, st.st_size);
+        memset(index, 0, sizeof(*index));
+        return false;
+    }
+    const HistoryIndexHeader *header = index->header;
+    if (header->history_dev != (uint64_t)history_st->st_dev || header->history_ino != (uint64_t)history_st->st_ino ||
+        header->indexed_size > (uint64_t)history_st->st_size ||
+        (header->indexed_size > 0 && text[header->indexed_size - 1] != '\n') ||
+        header->check_hash != history_index_check_hash(text, header->indexed_size) ||
+        !history_index_is_consistent(index)) {
+        free_history_index(index); // The file was replaced or rewritten since, or the index is damaged
+        return false;
+    }
+    return true;
+}
+
+const HistoryIndexRecord *sort_records; // qsort() has no context argument
+
+int compare_record_numbers(const void *a, const void *b) {
+    uint32_t left = *(const uint32_t *)a, right = *(const uint32_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+int compare_record_times(const void *a, const void *b) {
+    uint32_t left = *(const uint32_t *)a, right = *(const uint32_t *)b;
+    if (sort_records[left].time != sort_records[right].time) {
+        return sort_records[left].time < sort_records[right].time ? -1 : 1;
+    }
+    return left < right ? -1 : left > right;
+}
+
+// Index every complete line of text and try to save the result for later queries
+bool build_history_index(HistoryIndex *index, const struct stat *history_st, const char *text, size_t size) {
+    size_t indexed_size = size;
+    while (indexed_size > 0 && text[indexed_size - 1] != '\n') indexed_size--;
+    uint32_t count = 0;
+    for (const char *p = text; p < text + indexed_size && (p = memchr(p, '\n', text + indexed_size - p)); p++) {
+        count++;
+    }
+
+    // Pass 1: the records, and how many bytes each trigram's posting list needs
+    HistoryIndexRecord *records = malloc((count ? count : 1) * sizeof(*records));
+    uint32_t *command_starts = malloc((count ? count : 1) * sizeof(uint32_t)); // Offsets within each line
+    uint32_t *bucket_sizes = calloc(HISTORY_INDEX_BUCKETS + 1, sizeof(uint32_t));
+    uint32_t *last_record = malloc(HISTORY_INDEX_BUCKETS * sizeof(uint32_t));
+    bool ok = records && command_starts && bucket_sizes && last_record;
+    char line[HISTORY_LINE_MAX];
+    HistoryRecord parsed;
+    uint64_t postings_size = 0;
+    if (ok) memset(last_record, 0xff, HISTORY_INDEX_BUCKETS * sizeof(uint32_t));
+    size_t offset = 0;
+    for (uint32_t r = 0; ok && r < count; r++) {
+        size_t next = copy_history_line(text, indexed_size, offset, line, sizeof(line));
+        records[r].offset = offset;
+        command_starts[r] = 0;
+        if (parse_history_line(line, &parsed, false)) command_starts[r] = parsed.command - line;
+        else parsed.command = line + strlen(line); // Not a history line: nothing to search
+        records[r].time = parsed.time;
+        records[r].status = parsed.status;
+        records[r].milliseconds = parsed.seconds > 4e6 ? UINT32_MAX : (uint32_t)(parsed.seconds * 1000);
+        for (const char *p = parsed.command; p[0] && p[1] && p[2]; p++) {
+            uint32_t bucket = trigram_bucket(p);
+            if (last_record[bucket] == r) continue;
+            uint32_t previous = last_record[bucket] == UINT32_MAX ? 0 : last_record[bucket];
+            bucket_sizes[bucket] += varint_length(r - previous);
+            postings_size += varint_length(r - previous);
+            last_record[bucket] = r;
+        }
+        offset = next;
+    }
+    if (postings_size > UINT32_MAX - 1) ok = false;
+
+    size_t total = sizeof(HistoryIndexHeader) + (size_t)count * (sizeof(HistoryIndexRecord) + sizeof(uint32_t)) +
+                   (HISTORY_INDEX_BUCKETS + 1) * sizeof(uint32_t) + postings_size;
+    uint8_t *data = ok ? calloc(1, total) : NULL;
+    if (data) {
+        HistoryIndexHeader *header = (HistoryIndexHeader *)data;
+        memcpy(header->magic, HISTORY_INDEX_MAGIC, 8);
+        header->history_dev = history_st->st_dev;
+        header->history_ino = history_st->st_ino;
+        header->indexed_size = indexed_size;
+        header->record_count = count;
+        header->postings_size = (uint32_t)postings_size;
+        header->check_hash = history_index_check_hash(text, indexed_size);
+        HistoryIndexRecord *out_records = (HistoryIndexRecord *)(header + 1);
+        memcpy(out_records, records, (size_t)count * sizeof(*records));
+        uint32_t *by_time = (uint32_t *)(out_records + count);
+        for (uint32_t r = 0; r < count; r++) by_time[r] = r;
+        sort_records = out_records;
+        qsort(by_time, count, sizeof(uint32_t), compare_record_times);
+        uint32_t *buckets = by_time + count;
+        uint32_t position = 0;
+        for (uint32_t b = 0; b < HISTORY_INDEX_BUCKETS; b++) {
+            buckets[b] = position;
+            position += bucket_sizes[b];
+        }
+        buckets[HISTORY_INDEX_BUCKETS] = position;
+
+        // Pass 2: write the posting lists, reusing bucket_sizes as write cursors
+        uint8_t *postings = (uint8_t *)(buckets + HISTORY_INDEX_BUCKETS + 1);
+        memcpy(bucket_sizes, buckets, HISTORY_INDEX_BUCKETS * sizeof(uint32_t));
+        memset(last_record, 0xff, HISTORY_INDEX_BUCKETS * sizeof(uint32_t));
+        for (uint32_t r = 0; r < count; r++) {
+            copy_history_line(text, indexed_size, records[r].offset, line, sizeof(line));
+            for (const char *p = line + command_starts[r]; p[0] && p[1] && p[2]; p++) {
+                uint32_t bucket = trigram_bucket(p);
+                if (last_record[bucket] == r) continue;
+                uint32_t previous = last_record[bucket] == UINT32_MAX ? 0 : last_record[bucket];
+                bucket_sizes[bucket] = put_varint(postings + bucket_sizes[bucket], r - previous) - postings;
+                last_record[bucket] = r;
+            }
+        }
+    }
+    free(records);
+    free(command_starts);
+    free(bucket_sizes);
+    free(last_record);
+    if (!data) return false;
+    attach_history_index(index, data, total);
+    index->mapped = false;
+
+    // Saving is an optimization for the next query: failures are not errors
+    char index_path[FILENAME_MAX + 8], temp_path[FILENAME_MAX + 32];
+    get_history_index_path(index_path, sizeof(index_path));
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", index_path, (int)getpid());
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return true;
+    size_t written = 0;
+    while (written < total) {
+        ssize_t n = write(fd, data + written, total - written);
+        if (n <= 0) break;
+        written += n;
+    }
+    if (close(fd) == 0 && written == total && rename(temp_path, index_path) == 0) return true;
+    unlink(temp_path);
+    return true;
+}
+
+// Intersect the sorted candidates with the records in one posting list.
+// Returns how many are kept, or UINT32_MAX if the list is damaged.
+uint32_t intersect_posting_list(uint32_t *candidates, uint32_t count, const HistoryIndex *index, uint32_t bucket) {
+    const uint8_t *p = index->postings + index->buckets[bucket];
+    const uint8_t *end = index->postings + index->buckets[bucket + 1];
+    uint32_t kept = 0, delta;
+    uint64_t record = 0;
+    for (uint32_t i = 0; i < count && p < end; ) {
+        if (!(p = get_varint(p, end, &delta)) || (record += delta) >= index->header->record_count) return UINT32_MAX;
+        while (i < count && candidates[i] < record) i++;
+        if (i < count && candidates[i] == record) candidates[kept++] = candidates[i++];
+    }
+    return kept;
+}
+
+const HistoryIndex *sort_index;
+
+int compare_bucket_sizes(const void *a, const void *b) {
+    uint32_t left = *(const uint32_t *)a, right = *(const uint32_t *)b;
+    uint32_t left_size = sort_index->buckets[left + 1] - sort_index->buckets[left];
+    uint32_t right_size = sort_index->buckets[right + 1] - sort_index->buckets[right];
+    return left_size < right_size ? -1 : left_size > right_size;
+}
+
+// Records that may contain text, in file order; *count is set to their number.
+// NULL with *count == UINT32_MAX means every record is a candidate.
+uint32_t *history_index_candidates(const HistoryIndex *index, const HistoryQuery *query, uint32_t *count) {
+    uint32_t record_count = index->header ? index->header->record_count : 0;
+    const char *needle = query->text ? query->text : query->regex_literal;
+    size_t text_length = strlen(needle);
+    bool by_text = text_length >= 3;
+    bool by_time = query->since != -1 || query->until != -1;
+    *count = UINT32_MAX;
+    if (record_count == 0 || (!by_text && !by_time)) return NULL;
+
+    uint32_t *candidates;
+    if (by_text) {
+        // Start from the shortest posting list, then narrow with the others
+        uint32_t buckets[MAX_LINE];
+        size_t bucket_count = 0;
+        for (size_t i = 0; i + 2 < text_length && bucket_count < MAX_LINE; i++) {
+            buckets[bucket_count++] = trigram_bucket(needle + i);
+        }
+        sort_index = index;
+        qsort(buckets, bucket_count, sizeof(uint32_t), compare_bucket_sizes);
+        const uint8_t *p = index->postings + index->buckets[buckets[0]];
+        const uint8_t *end = index->postings + index->buckets[buckets[0] + 1];
+        candidates = malloc((end - p + 1) * sizeof(uint32_t)); // Each entry takes at least a byte
+        if (!candidates) return NULL;
+        uint64_t record = 0;
+        uint32_t delta;
+        *count = 0;
+        while (p < end) {
+            if (!(p = get_varint(p, end, &delta)) || (record += delta) >= record_count) {
+                free(candidates); // A damaged posting list: check every line instead
+                *count = UINT32_MAX;
+                return NULL;
+            }
+            candidates[(*count)++] = (uint32_t)record;
+        }
+        for (size_t i = 1; i < bucket_count && *count > 0; i++) {
+            if (buckets[i] == buckets[i - 1]) continue;
+            *count = intersect_posting_list(candidates, *count, index, buckets[i]);
+            if (*count == UINT32_MAX) {
+                free(candidates);
+                return NULL;
+            }
+        }
+    } else {
+        candidates = malloc(record_count * sizeof(uint32_t));
+        if (!candidates) return NULL;
+        *count = record_count;
+        for (uint32_t r = 0; r < record_count; r++) candidates[r] = r;
+    }
+    if (!by_time) return candidates;
+
+    // Narrow to the time range: a binary search over the time-sorted list
+    const HistoryIndexRecord *records = index->records;
+    uint32_t low = 0, high = record_count;
+    int64_t since = query->since != -1 ? query->since : 0;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (records[index->by_time[mid]].time < since) low = mid + 1;
+        else high = mid;
+    }
+    uint32_t first = low;
+    high = record_count;
+    int64_t until = query->until != -1 ? query->until : INT64_MAX;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (records[index->by_time[mid]].time <= until) low = mid + 1;
+        else high = mid;
+    }
+    if (!by_text) {
+        *count = low - first;
+        memcpy(candidates, index->by_time + first, *count * sizeof(uint32_t));
+        qsort(candidates, *count, sizeof(uint32_t), compare_record_numbers); // Back to file order
+        return candidates;
+    }
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < *count; i++) {
+        int64_t time = records[candidates[i]].time;
+        if (time >= since && time <= until) candidates[kept++] = candidates[i];
+    }
+    *count = kept;
+    return candidates;
+}
+
+// The longest run of plain characters that every match of an extended regex
+// must contain, or "" when there is none worth using. Runs inside groups and
+// characters made optional by ?, * or {} do not count; any | gives up.
+void regex_required_literal(const char *pattern, char *out, size_t size) {
+    char run[MAX_LINE];
+    size_t run_length = 0;
+    int depth = 0;
+    out[0] = '\0';
+    if (strchr(pattern, '|')) return;
+    for (const char *p = pattern; ; p++) {
+        bool literal = false;
+        char c = *p;
+        if (c == '\\' && p[1] && !isalnum((unsigned char)p[1])) {
+            c = *++p;
+            literal = true;
+        } else if (c && !strchr("\\[.^$()*?+{", c)) {
+            literal = true;
+        } else if ((c == '*' || c == '?' || c == '{') && run_length > 0) {
+            run_length--; // The character before is optional
+        }
+        if (literal && depth == 0 && run_length < sizeof(run) - 1) {
+            run[run_length++] = c;
+            continue;
+        }
+        if (run_length > strlen(out) && run_length < size) {
+            memcpy(out, run, run_length);
+            out[run_length] = '\0';
+        }
+        run_length = 0;
+        if (c == '\0') return;
+        if (c == '\\' && p[1]) p++;
+        else if (c == '(') depth++;
+        else if (c == ')' && depth > 0) depth--;
+        else if (c == '[') { // Skip the bracket expression, where ] first is literal
+            const char *close = p + 1;
+            if (*close == '^') close++;
+            if (*close == ']') close++;
+            close = strchr(close, ']');
+            if (!close) return;
+            p = close;
+        } else if (c == '{') {
+            const char *close = strchr(p, '}');
+            if (!close) return;
+            p = close;
+        }
+    }
+}
+
+// The full check of one line against the query; the index only narrows
+bool history_line_matches(const char *line, const HistoryQuery *query, HistoryRecord *record) {
+    if (!parse_history_line(line, record, query->directory[0] != '\0')) return false;
+    if (query->failed_only && record->status <= 0) return false;
+    if (query->since != -1 && (record->time == -1 || record->time < query->since)) return false;
+    if (query->until != -1 && (record->time == -1 || record->time > query->until)) return false;
+    if (query->directory[0]) {
+        size_t length = strlen(query->directory);
+        if (strncmp(record->cwd, query->directory, length) != 0) return false;
+        if (record->cwd[length] != '\0' && record->cwd[length] != '/' && strcmp(query->directory, "/") != 0) {
+            return false;
+        }
+    }
+    if (query->text) {
+        if (query->ignore_case ? !strcasestr(record->command, query->text) : !strstr(record->command, query->text)) {
+            return false;
+        }
+    }
+    if (query->regex && regexec(query->regex, record->command, 0, NULL, 0) != 0) return false;
+    return true;
+}
+
+void print_history_match(FILE *out, long number, const char *line, const HistoryQuery *query) {
+    HistoryRecord record;
+    parse_history_line(line, &record, query->long_format);
+    if (!query->long_format) {
+        fprintf(out, "%5ld  %.19s  %s\n", number, line + 1, record.command);
+    } else if (record.status == -1) {
+        fprintf(out, "%5ld  %.19s  %4s %8s  %-24s  %s\n", number, line + 1, "-", "-", "-", record.command);
+    } else {
+        fprintf(out, "%5ld  %.19s  %4d %7.2fs  %-24s  %s\n", number, line + 1, record.status, record.seconds,
+                record.cwd[0] ? record.cwd : "-", record.command);
+    }
+}
+
+// Print the history lines matching query to out; returns how many, or -1
+int query_history(const HistoryQuery *query, FILE *out) {
+    char history_file_path[FILENAME_MAX];
+    get_history_file_path(history_file_path, sizeof(history_file_path));
+    int fd = open(history_file_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) return 0;
+        fprintf(stderr, "sdn: history: %s: %s\n", history_file_path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    const char *text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        perror("sdn: history: mmap");
+        return -1;
+    }
+
+    HistoryIndex index;
+    memset(&index, 0, sizeof(index));
+    bool have_index = load_history_index(&index, &st, text);
+    if (have_index && size - index.header->indexed_size > HISTORY_INDEX_MAX_TAIL) {
+        free_history_index(&index);
+        have_index = false;
+    }
+    if (!have_index) build_history_index(&index, &st, text, size); // Without one, everything is scanned
+    uint32_t record_count = index.header ? index.header->record_count : 0;
+    size_t indexed_size = index.header ? index.header->indexed_size : 0;
+
+    uint32_t candidate_count;
+    uint32_t *candidates = history_index_candidates(&index, query, &candidate_count);
+    bool all = candidate_count == UINT32_MAX;
+    if (all) candidate_count = record_count;
+
+    // Collect (line number, offset) of each match so -n can keep the last ones
+    size_t match_count = 0, match_capacity = 64;
+    uint64_t *matches = malloc(match_capacity * 2 * sizeof(uint64_t));
+    char line[HISTORY_LINE_MAX];
+    HistoryRecord record;
+    for (uint32_t i = 0; matches && i < candidate_count; i++) {
+        uint32_t r = all ? i : candidates[i];
+        const HistoryIndexRecord *indexed = &index.records[r];
+        if (query->failed_only && indexed->status <= 0) continue;
+        copy_history_line(text, indexed_size, indexed->offset, line, sizeof(line));
+        if (!history_line_matches(line, query, &record)) continue;
+        if (match_count == match_capacity) {
+            uint64_t *grown = realloc(matches, match_capacity * 4 * sizeof(uint64_t));
+            if (!grown) break;
+            matches = grown;
+            match_capacity *= 2;
+        }
+        matches[match_count * 2] = r + 1;
+        matches[match_count * 2 + 1] = indexed->offset;
+        match_count++;
+    }
+    // The unindexed tail: lines appended since the index was written
+    long number = record_count;
+    for (size_t offset = indexed_size; matches && offset < size; ) {
+        size_t line_start = offset;
+        offset = copy_history_line(text, size, offset, line, sizeof(line));
+        number++;
+        if (!history_line_matches(line, query, &record)) continue;
+        if (match_count == match_capacity) {
+            uint64_t *grown = realloc(matches, match_capacity * 4 * sizeof(uint64_t));
+            if (!grown) break;
+            matches = grown;
+            match_capacity *= 2;
+        }
+        matches[match_count * 2] = number;
+        matches[match_count * 2 + 1] = line_start;
+        match_count++;
+    }
+
+    size_t first = query->limit > 0 && match_count > (size_t)query->limit ? match_count - query->limit : 0;
+    for (size_t i = first; i < match_count; i++) {
+        copy_history_line(text, size, matches[i * 2 + 1], line, sizeof(line));
+        print_history_match(out, (long)matches[i * 2], line, query);
+    }
+    int printed = matches ? (int)(match_count - first) : -1;
+    if (!matches) perror("sdn: history: malloc");
+    free(matches);
+    free(candidates);
+    free_history_index(&index);
+    munmap((void *)text, size);
+    return printed;
+}
+
+// A --since/--until argument: "30m", "2h", "7d", "1w", "1y" ago, or a local
+// "YYYY-MM-DD[ HH:MM[:SS]]"
+bool parse_history_time_arg(const char *arg, time_t *out) {
+    char *end;
+    long amount = strtol(arg, &end, 10);
+    if (end != arg && end[0] && !end[1]) {
+        long unit = 0;
+        switch (*end) {
+            case 's': unit = 1; break;
+            case 'm': unit = 60; break;
+            case 'h': unit = 3600; break;
+            case 'd': unit = 86400; break;
+            case 'w': unit = 7 * 86400; break;
+            case 'y': unit = 365 * 86400; break;
         }
+        if (unit == 0 || amount < 0) return false;
+        *out = time(NULL) - amount * unit;
+        return true;
     }
+    char full[20] = "0000-00-00 00:00:00";
+    size_t length = strlen(arg);
+    if (length != 10 && length != 16 && length != 19) return false;
+    memcpy(full, arg, length);
+    if (length == 16) memcpy(full + 16, ":00", 3);
+    *out = parse_history_time(full);
+    return *out != -1;
 }
 
 // Helper to check for valid variable name characters
@@ -825,31 +2768,68 @@ void set_shell_variable(const char *name, const char *value) {
         fprintf(stderr, "sdn: invalid variable name: %s\n", name);
         return;
     }
-    if (strlen(name) >= MAX_VAR_NAME_LEN || strlen(value) >= MAX_VAR_VALUE_LEN) {
-        fprintf(stderr, "sdn: variable name or value too long\n");
+    if (strlen(name) >= MAX_VAR_NAME_LEN) {
+        fprintf(stderr, "sdn: variable name too long\n");
         return;
     }
 
-    for (int i = 0; i < variable_count; i++) {
-        if (strcmp(variable_table[i].name, name) == 0) {
-            strncpy(variable_table[i].value, value, MAX_VAR_VALUE_LEN - 1);
-            variable_table[i].value[MAX_VAR_VALUE_LEN - 1] = '\0';
+    int index = 0;
+    while (index < variable_count && strcmp(variable_table[index].name, name) != 0) index++;
+    if (index == variable_count) {
+        if (variable_count >= MAX_VARIABLES) {
+            fprintf(stderr, "sdn: maximum number of variables reached\n");
             return;
         }
-    }
-    if (variable_count < MAX_VARIABLES) {
-        strncpy(variable_table[variable_count].name, name, MAX_VAR_NAME_LEN - 1);
-        variable_table[variable_count].name[MAX_VAR_NAME_LEN - 1] = '\0';
-        strncpy(variable_table[variable_count].value, value, MAX_VAR_VALUE_LEN - 1);
-        variable_table[variable_count].value[MAX_VAR_VALUE_LEN - 1] = '\0';
+        strcpy(variable_table[index].name, name); // Length checked above
+        variable_table[index].value = NULL;
+        variable_table[index].value_capacity = 0;
         variable_count++;
-    } else {
-        fprintf(stderr, "sdn: maximum number of variables reached\n");
     }
+
+    VariableEntry *entry = &variable_table[index];
+    size_t value_len = strlen(value);
+    if (value_len + 1 > entry->value_capacity) {
+        size_t new_capacity = value_len + 1 < 32 ? 32 : value_len + 1;
+        char *grown = realloc(entry->value, new_capacity);
+        if (!grown) {
+            perror("sdn: set variable");
+            if (!entry->value) variable_count--; // Drop the half-created entry
+            return;
+        }
+        entry->value = grown;
+        entry->value_capacity = new_capacity;
+    }
+    memcpy(entry->value, value, value_len + 1);
 }
 
 // Function to get a shell variable's value
 const char *get_shell_variable(const char *name) {
+    static char number_buffer[16];
+    if (strcmp(name, "?") == 0) {
+        snprintf(number_buffer, sizeof(number_buffer), "%d", last_exit_status);
+        return number_buffer;
+    }
+    if (strcmp(name, "#") == 0) {
+        snprintf(number_buffer, sizeof(number_buffer), "%d", positional_count > 0 ? positional_count - 1 : 0);
+        return number_buffer;
+    }
+    if (strcmp(name, "@") == 0 || strcmp(name, "*") == 0) {
+        static char joined_params[MAX_VAR_VALUE_LEN];
+        joined_params[0] = '\0';
+        for (int i = 1; i < positional_count; i++) {
+            if (i > 1) strncat(joined_params, " ", sizeof(joined_params) - strlen(joined_params) - 1);
+            strncat(joined_params, positional_params[i], sizeof(joined_params) - strlen(joined_params) - 1);
+        }
+        return joined_params;
+    }
+    if (isdigit((unsigned char)name[0])) { // $0, $1, ...: script name and arguments
+        int index = atoi(name);
+        return index < positional_count ? positional_params[index] : NULL;
+    }
+    if (strncmp(name, "SDN_TIME_", 9) == 0) {
+        const char *value = pipeline_stats_variable(name);
+        if (value) return value;
+    }
     for (int i = 0; i < variable_count; i++) {
         if (strcmp(variable_table[i].name, name) == 0) {
             return variable_table[i].value;
@@ -859,26 +2839,619 @@ const char *get_shell_variable(const char *name) {
     return NULL;
 }
 
-// NEW helper function to expand variables in a single argument string.
-// Returns a new heap-allocated string with variables expanded and quotes removed,
-// or NULL if no effective change was made to the string.
-// The caller is responsible for freeing the returned string.
-// Handles $VAR, ${VAR}. Expansion occurs unless within single quotes.
-// Outer single or double quotes are removed.
+// --- History compaction ---
+// Every command is appended to ~/.sdn_history, so left alone it grows for as
+// long as the shell is used. Compaction rewrites it keeping only the latest
+// line of each distinct command and, given a cutoff, only lines started since
+// then. `history --compact [--since TIME]` runs it by hand. It also runs at
+// startup and after a command once the file is larger than
+// $SDN_HISTORY_COMPACT_SIZE bytes (default 1 MiB, 0 turns it off), trimming
+// to $SDN_HISTORY_MAX_AGE (like "1y") when that is set. The new file is
+// written next to the old one and renamed over it under an exclusive flock on
+// ~/.sdn_history.lock. Appending takes the same lock shared, so no command
+// lands in the old file after compaction has read it. Lines that do not parse
+// as history are copied through unchanged. A temp file left by a compaction
+// that died before its rename is removed by the next one, since holding the
+// lock means no other compaction is writing one.
+
+#define HISTORY_COMPACT_SIZE (1024 * 1024)
+#define HISTORY_LINE_VERBATIM (UINT32_MAX - 1) // HistoryLineRef.command of a line kept as it is
+
+off_t history_compact_limit = 0; // $SDN_HISTORY_COMPACT_SIZE as last read
+off_t history_compact_at = 0;    // Size that triggers automatic compaction, at least the limit
+
+// flock() the history lock file; returns the fd to close to unlock, or -1
+int lock_history(int operation) {
+    char history_file_path[FILENAME_MAX], lock_path[FILENAME_MAX + 8];
+    get_history_file_path(history_file_path, sizeof(history_file_path));
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", history_file_path);
+    int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return -1;
+    while (flock(fd, operation) == -1) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+typedef struct {
+    uint64_t start;
+    uint32_t length;
+    uint32_t command;   // Offset of the command within the line; UINT32_MAX drops the line
+} HistoryLineRef;
+
+// Remove temp files of earlier compactions that never reached their rename:
+// the history file's name followed by "." and mkostemp()'s six characters
+void remove_stale_history_temps(const char *history_file_path) {
+    char directory[FILENAME_MAX];
+    snprintf(directory, sizeof(directory), "%s", history_file_path);
+    char *slash = strrchr(directory, '/');
+    const char *base = slash ? slash + 1 : history_file_path;
+    size_t base_length = strlen(base);
+    if (slash == directory) directory[1] = '\0';
+    else if (slash) *slash = '\0';
+    else snprintf(directory, sizeof(directory), ".");
+    DIR *dir = opendir(directory);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strncmp(name, base, base_length) != 0 || name[base_length] != '.' ||
+            strlen(name + base_length + 1) != 6) {
+            continue;
+        }
+        bool temp_name = true;
+        for (const char *p = name + base_length + 1; *p; p++) {
+            if (!isalnum((unsigned char)*p)) temp_name = false;
+        }
+        if (!temp_name) continue; // Such as .sdn_history.idx.123, an index being saved
+        char path[FILENAME_MAX * 2 + 2];
+        snprintf(path, sizeof(path), "%s/%s", directory, name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+// Rewrite the history file as described above. Returns its new size, or -1.
+off_t compact_history(time_t cutoff, bool verbose) {
+    char history_file_path[FILENAME_MAX];
+    get_history_file_path(history_file_path, sizeof(history_file_path));
+    int lock_fd = lock_history(LOCK_EX);
+    if (lock_fd != -1) remove_stale_history_temps(history_file_path);
+    off_t result = -1;
+    HistoryLineRef *lines = NULL;
+    uint32_t *table = NULL;
+    const char *text = MAP_FAILED;
+    size_t size = 0;
+
+    int fd = open(history_file_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (errno == ENOENT) result = 0;
+        else fprintf(stderr, "sdn: history: %s: %s\n", history_file_path, strerror(errno));
+        goto done;
+    }
+    size = st.st_size;
+    if (size == 0) {
+        result = 0;
+        goto done;
+    }
+    text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) {
+        perror("sdn: history: mmap");
+        goto done;
+    }
+
+    size_t line_count = 0;
+    for (const char *p = text; p < text + size; line_count++) {
+        const char *newline = memchr(p, '\n', text + size - p);
+        p = newline ? newline + 1 : text + size;
+    }
+    size_t table_size = 1;
+    while (table_size < line_count * 2) table_size <<= 1;
+    lines = malloc(line_count * sizeof(*lines));
+    table = calloc(table_size, sizeof(uint32_t)); // Line number + 1 of each command kept; 0 is empty
+    if (!lines || !table) {
+        perror("sdn: history: malloc");
+        goto done;
+    }
+
+    // Parse forwards, then keep each command's last line by walking backwards
+    char line[HISTORY_LINE_MAX];
+    HistoryRecord record;
+    size_t offset = 0;
+    for (size_t i = 0; i < line_count; i++) {
+        size_t next = copy_history_line(text, size, offset, line, sizeof(line));
+        lines[i].start = offset;
+        lines[i].length = next - offset - (text[next - 1] == '\n' ? 1 : 0);
+        lines[i].command = UINT32_MAX;
+        if (!parse_history_line(line, &record, false)) {
+            lines[i].command = HISTORY_LINE_VERBATIM; // Not ours to judge: neither deduplicated nor aged out
+        } else if (cutoff == -1 || record.time == -1 || record.time >= cutoff) {
+            lines[i].command = record.command - line;
+        }
+        offset = next;
+    }
+    size_t kept = 0;
+    for (size_t i = line_count; i-- > 0; ) {
+        if (lines[i].command == HISTORY_LINE_VERBATIM) kept++;
+        if (lines[i].command == UINT32_MAX || lines[i].command == HISTORY_LINE_VERBATIM) continue;
+        const char *command = text + lines[i].start + lines[i].command;
+        size_t length = lines[i].length - lines[i].command;
+        size_t slot = hash_bytes(command, length) & (table_size - 1);
+        bool seen = false;
+        for (; table[slot] != 0; slot = (slot + 1) & (table_size - 1)) {
+            const HistoryLineRef *other = &lines[table[slot] - 1];
+            if (other->length - other->command == length &&
+                memcmp(text + other->start + other->command, command, length) == 0) {
+                seen = true;
+                break;
+            }
+        }
+        if (seen) {
+            lines[i].command = UINT32_MAX;
+        } else {
+            table[slot] = i + 1;
+            kept++;
+        }
+    }
+
+    char temp_path[FILENAME_MAX + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", history_file_path);
+    int temp_fd = mkostemp(temp_path, O_CLOEXEC);
+    FILE *out = temp_fd == -1 ? NULL : fdopen(temp_fd, "w");
+    if (!out) {
+        fprintf(stderr, "sdn: history: %s: %s\n", temp_path, strerror(errno));
+        if (temp_fd != -1) {
+            close(temp_fd);
+            unlink(temp_path);
+        }
+        goto done;
+    }
+    for (size_t i = 0; i < line_count; i++) {
+        if (lines[i].command == UINT32_MAX) continue;
+        fwrite(text + lines[i].start, 1, lines[i].length, out);
+        fputc('\n', out);
+    }
+    off_t new_size = ftello(out);
+    bool written = fflush(out) == 0 && fsync(temp_fd) == 0 && fchmod(temp_fd, st.st_mode & 07777) == 0;
+    if (fclose(out) != 0 || !written || rename(temp_path, history_file_path) == -1) {
+        fprintf(stderr, "sdn: history: writing %s: %s\n", temp_path, strerror(errno));
+        unlink(temp_path);
+        goto done;
+    }
+    char index_path[FILENAME_MAX + 8];
+    get_history_index_path(index_path, sizeof(index_path));
+    unlink(index_path); // Describes the old file; the next query rebuilds it
+    if (verbose) {
+        printf("history: %zu lines (%lld KiB) compacted to %zu lines (%lld KiB)\n", line_count,
+               (long long)size / 1024, kept, (long long)new_size / 1024);
+    }
+    result = new_size;
+
+done:
+    free(lines);
+    free(table);
+    if (text != MAP_FAILED) munmap((void *)text, size);
+    if (fd != -1) close(fd);
+    if (lock_fd != -1) close(lock_fd);
+    return result;
+}
+
+// Called with the history file's size after each append. Once it passes the
+// threshold, compact; if the distinct commands alone are over half of it,
+// wait until the file doubles again so compaction never runs every command.
+// The limit is read each time, so setting it takes effect at once.
+void maybe_compact_history(off_t size) {
+    const char *limit = get_shell_variable("SDN_HISTORY_COMPACT_SIZE");
+    if (limit == NULL) limit = getenv("SDN_HISTORY_COMPACT_SIZE");
+    off_t configured = limit && *limit ? atoll(limit) : HISTORY_COMPACT_SIZE;
+    if (configured <= 0) return;
+    if (configured != history_compact_limit) {
+        history_compact_limit = configured;
+        history_compact_at = configured;
+    }
+    if (size <= history_compact_at) return;
+    const char *max_age = get_shell_variable("SDN_HISTORY_MAX_AGE");
+    if (max_age == NULL) max_age = getenv("SDN_HISTORY_MAX_AGE");
+    time_t cutoff = -1;
+    if (max_age && *max_age && !parse_history_time_arg(max_age, &cutoff)) {
+        fprintf(stderr, "sdn: SDN_HISTORY_MAX_AGE=%s: expected an age like `90d' or `1y'\n", max_age);
+        cutoff = -1;
+    }
+    off_t compacted = compact_history(cutoff, false);
+    if (compacted >= 0 && compacted * 2 > history_compact_at) history_compact_at = compacted * 2;
+}
+
+// --- Arithmetic expansion ---
+// $(( expr )) evaluates C-style integer expressions over shell variables, without forking.
+// Arithmetic wraps at 64 bits like bash instead of overflowing: +, -, * and **
+// are done unsigned, shift counts are taken modulo 64 and LLONG_MIN / -1 is
+// LLONG_MIN.
+
+#define ARITH_WRAP(u) ((long long)(unsigned long long)(u))
+
+typedef struct {
+    const char *pos;
+    bool failed;
+    char error[64];
+} ArithParser;
+
+// Return the first ')' of the "))" closing a $(( that started just before `start`
+const char *find_arithmetic_end(const char *start) {
+    int depth = 0;
+    for (const char *p = start; *p != '\0'; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            if (depth == 0) return p[1] == ')' ? p : NULL;
+            depth--;
+        }
+    }
+    return NULL;
+}
+
+void arith_fail(ArithParser *ap, const char *message) {
+    if (ap->failed) return;
+    ap->failed = true;
+    snprintf(ap->error, sizeof(ap->error), "%s", message);
+}
+
+void arith_skip_spaces(ArithParser *ap) {
+    while (isspace((unsigned char)*ap->pos)) ap->pos++;
+}
+
+// Value of a variable used in an expression; unset or empty counts as 0
+long long arith_variable_value(ArithParser *ap, const char *name) {
+    const char *value = get_shell_variable(name);
+    if (value == NULL) value = getenv(name);
+    if (value == NULL || *value == '\0') return 0;
+    char *end;
+    long long number = strtoll(value, &end, 0);
+    while (isspace((unsigned char)*end)) end++;
+    if (*end != '\0') {
+        char message[64];
+        snprintf(message, sizeof(message), "%s: not a number: %.20s", name, value);
+        arith_fail(ap, message);
+        return 0;
+    }
+    return number;
+}
+
+// Read a variable reference (name, $name, ${name}, $1) into name; returns false if there is none
+bool arith_read_name(ArithParser *ap, char *name, size_t size) {
+    const char *p = ap->pos;
+    bool dollar = *p == '$';
+    if (dollar) p++;
+    bool braced = dollar && *p == '{';
+    if (braced) p++;
+    size_t len = 0;
+    if (dollar && (isdigit((unsigned char)*p) || *p == '?' || *p == '#')) {
+        name[len++] = *p++;
+        while (isdigit((unsigned char)name[0]) && isdigit((unsigned char)*p) && len < size - 1) name[len++] = *p++;
+    } else if (isalpha((unsigned char)*p) || *p == '_') {
+        while (is_valid_identifier_char(*p) && len < size - 1) name[len++] = *p++;
+    } else {
+        return false;
+    }
+    name[len] = '\0';
+    if (braced) {
+        if (*p != '}') return false;
+        p++;
+    }
+    ap->pos = p;
+    return true;
+}
+
+long long arith_expression(ArithParser *ap);
+
+long long arith_unary(ArithParser *ap) {
+    arith_skip_spaces(ap);
+    char c = *ap->pos;
+    if (c == '-' || c == '+' || c == '!' || c == '~') {
+        ap->pos++;
+        long long operand = arith_unary(ap);
+        if (c == '-') return ARITH_WRAP(0ULL - (unsigned long long)operand);
+        if (c == '!') return !operand;
+        if (c == '~') return ~operand;
+        return operand;
+    }
+    if (c == '(') {
+        ap->pos++;
+        long long value = arith_expression(ap);
+        arith_skip_spaces(ap);
+        if (*ap->pos != ')') {
+            arith_fail(ap, "missing `)'");
+            return 0;
+        }
+        ap->pos++;
+        return value;
+    }
+    if (isdigit((unsigned char)c)) {
+        char *end;
+        long long value = strtoll(ap->pos, &end, 0);
+        ap->pos = end;
+        return value;
+    }
+    char name[MAX_VAR_NAME_LEN];
+    if (arith_read_name(ap, name, sizeof(name))) {
+        return arith_variable_value(ap, name);
+    }
+    arith_fail(ap, *ap->pos ? "syntax error: operand expected" : "syntax error: unexpected end of expression");
+    return 0;
+}
+
+// Binary operators, longest spelling first so "<=" wins over "<"
+typedef struct {
+    const char *spelling;
+    int precedence; // Higher binds tighter
+} ArithOperator;
+
+static const ArithOperator arith_operators[] = {
+    {"||", 1}, {"&&", 2}, {"==", 6}, {"!=", 6}, {"<=", 7}, {">=", 7}, {"<<", 8}, {">>", 8},
+    {"**", 11}, {"|", 3}, {"^", 4}, {"&", 5}, {"<", 7}, {">", 7}, {"+", 9}, {"-", 9}, {"*", 10}, {"/", 10}, {"%", 10},
+};
+
+const ArithOperator *arith_peek_operator(ArithParser *ap) {
+    arith_skip_spaces(ap);
+    if (*ap->pos == '\0' || !strchr("|&^=!<>+-*/%", *ap->pos)) return NULL;
+    for (size_t i = 0; i < sizeof(arith_operators) / sizeof(arith_operators[0]); i++) {
+        size_t len = strlen(arith_operators[i].spelling);
+        if (strncmp(ap->pos, arith_operators[i].spelling, len) == 0) {
+            if (ap->pos[len] == '=' && len == 1 && strchr("|&^<>+-*/%", ap->pos[0])) return NULL; // "+=" etc.
+            return &arith_operators[i];
+        }
+    }
+    return NULL;
+}
+
+long long arith_apply(ArithParser *ap, const char *op, long long lhs, long long rhs) {
+    unsigned long long ulhs = (unsigned long long)lhs, urhs = (unsigned long long)rhs;
+    switch (op[0]) {
+        case '|': return op[1] == '|' ? (lhs || rhs) : (lhs | rhs);
+        case '&': return op[1] == '&' ? (lhs && rhs) : (lhs & rhs);
+        case '^': return lhs ^ rhs;
+        case '=': return lhs == rhs;
+        case '!': return lhs != rhs;
+        case '<': return op[1] == '=' ? lhs <= rhs : op[1] == '<' ? ARITH_WRAP(ulhs << (urhs & 63)) : lhs < rhs;
+        case '>': return op[1] == '=' ? lhs >= rhs : op[1] == '>' ? lhs >> (urhs & 63) : lhs > rhs;
+        case '+': return ARITH_WRAP(ulhs + urhs);
+        case '-': return ARITH_WRAP(ulhs - urhs);
+        case '*':
+            if (op[1] == '*') {
+                if (rhs < 0) {
+                    arith_fail(ap, "exponent less than 0");
+                    return 0;
+                }
+                unsigned long long power = 1;
+                for (; urhs; urhs >>= 1, ulhs *= ulhs) { // Square and multiply
+                    if (urhs & 1) power *= ulhs;
+                }
+                return ARITH_WRAP(power);
+            }
+            return ARITH_WRAP(ulhs * urhs);
+        case '/':
+        case '%':
+            if (rhs == 0) {
+                arith_fail(ap, "division by zero");
+                return 0;
+            }
+            if (rhs == -1) return op[0] == '/' ? ARITH_WRAP(0ULL - ulhs) : 0; // LLONG_MIN / -1 traps
+            return op[0] == '/' ? lhs / rhs : lhs % rhs;
+    }
+    return 0;
+}
+
+// Precedence climbing over arith_operators
+long long arith_binary(ArithParser *ap, int min_precedence) {
+    long long lhs = arith_unary(ap);
+    const ArithOperator *op;
+    while (!ap->failed && (op = arith_peek_operator(ap)) != NULL && op->precedence >= min_precedence) {
+        ap->pos += strlen(op->spelling);
+        // ** is right-associative; everything else groups left to right
+        long long rhs = arith_binary(ap, op->spelling[1] == '*' ? op->precedence : op->precedence + 1);
+        lhs = arith_apply(ap, op->spelling, lhs, rhs);
+    }
+    return lhs;
+}
+
+// expression := name ('=' | op'=') expression | binary [ '?' expression ':' expression ]
+long long arith_expression(ArithParser *ap) {
+    arith_skip_spaces(ap);
+    const char *saved = ap->pos;
+    char name[MAX_VAR_NAME_LEN];
+    if (*ap->pos != '$' && arith_read_name(ap, name, sizeof(name))) {
+        arith_skip_spaces(ap);
+        char op[3] = {0};
+        if (ap->pos[0] == '=' && ap->pos[1] != '=') {
+            ap->pos++;
+        } else if (ap->pos[0] && strchr("+-*/%", ap->pos[0]) && ap->pos[1] == '=') {
+            op[0] = ap->pos[0];
+            ap->pos += 2;
+        } else {
+            ap->pos = saved;
+            name[0] = '\0';
+        }
+        if (name[0]) {
+            long long value = arith_expression(ap);
+            if (op[0]) value = arith_apply(ap, op, arith_variable_value(ap, name), value);
+            if (!ap->failed) {
+                char text[24];
+                snprintf(text, sizeof(text), "%lld", value);
+                set_shell_variable(name, text);
+            }
+            return value;
+        }
+    }
+
+    long long condition = arith_binary(ap, 1);
+    arith_skip_spaces(ap);
+    if (*ap->pos != '?' || ap->failed) return condition;
+    ap->pos++;
+    long long if_true = arith_expression(ap);
+    arith_skip_spaces(ap);
+    if (*ap->pos != ':') {
+        arith_fail(ap, "expected `:' in conditional expression");
+        return 0;
+    }
+    ap->pos++;
+    long long if_false = arith_expression(ap);
+    return condition ? if_true : if_false;
+}
+
+// Evaluate an arithmetic expression. Returns -1 after reporting an error.
+int evaluate_arithmetic(const char *expression, long long *result) {
+    ArithParser ap = {expression, false, ""};
+    *result = 0;
+    arith_skip_spaces(&ap);
+    if (*ap.pos != '\0') *result = arith_expression(&ap);
+    arith_skip_spaces(&ap);
+    if (!ap.failed && *ap.pos != '\0') arith_fail(&ap, "syntax error in expression");
+    if (ap.failed) {
+        fprintf(stderr, "sdn: %s: %s\n", expression, ap.error);
+        return -1;
+    }
+    return 0;
+}
+
+// Growable string used while expanding a word. Short results stay in the
+// inline storage, so expanding an ordinary word does not touch the heap.
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    char inline_storage[256];
+} StringBuffer;
+
+void string_buffer_init(StringBuffer *sb) {
+    sb->data = sb->inline_storage;
+    sb->length = 0;
+    sb->capacity = sizeof(sb->inline_storage);
+    sb->data[0] = '\0';
+}
+
+void string_buffer_free(StringBuffer *sb) {
+    if (sb->data != sb->inline_storage) free(sb->data);
+    string_buffer_init(sb);
+}
+
+int string_buffer_append(StringBuffer *sb, const char *text, size_t len) {
+    if (sb->length + len + 1 > sb->capacity) {
+        size_t new_capacity = sb->capacity * 2;
+        while (new_capacity < sb->length + len + 1) new_capacity *= 2;
+        char *grown = sb->data == sb->inline_storage ? malloc(new_capacity) : realloc(sb->data, new_capacity);
+        if (!grown) return -1;
+        if (sb->data == sb->inline_storage) memcpy(grown, sb->data, sb->length);
+        sb->data = grown;
+        sb->capacity = new_capacity;
+    }
+    memcpy(sb->data + sb->length, text, len);
+    sb->length += len;
+    sb->data[sb->length] = '\0';
+    return 0;
+}
+
+// Output of a command substitution. Small outputs live in a malloc'd buffer;
+// large ones are spliced into a memfd and mapped, so they are never copied
+// through user space. data is always NUL-terminated.
+typedef struct CaptureBuffer {
+    char *data;
+    size_t length;
+    size_t mapped_size;         // Non-zero when data is an mmap of a memfd
+    struct CaptureBuffer *next; // Chained on a CommandSegment whose argv points into data
+} CaptureBuffer;
+
+int capture_command_output(const char *command_text, CaptureBuffer *out);
+
+void release_capture(CaptureBuffer *capture) {
+    if (capture->mapped_size) {
+        munmap(capture->data, capture->mapped_size);
+    } else {
+        free(capture->data);
+    }
+    capture->data = NULL;
+    capture->length = 0;
+    capture->mapped_size = 0;
+}
+
+// Drop the trailing newlines of a substitution's output, as other shells do
+void trim_capture(CaptureBuffer *capture) {
+    while (capture->length > 0 && capture->data[capture->length - 1] == '\n') capture->length--;
+    capture->data[capture->length] = '\0';
+}
+
+// Find the ')' closing the '(' at open, skipping quoted text and nested parentheses
+const char *find_substitution_end(const char *open) {
+    int depth = 0;
+    for (const char *p = open; *p != '\0'; p++) {
+        if (*p == '\'' || *p == '"') {
+            const char *close = strchr(p + 1, *p);
+            if (!close) return NULL;
+            p = close;
+        } else if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            if (--depth == 0) return p;
+        }
+    }
+    return NULL;
+}
+
+// Run the command text of a $(...) or `...` and append its output to sb
+int append_command_substitution(StringBuffer *sb, const char *text, size_t len) {
+    char *command_text = strndup(text, len);
+    if (!command_text) {
+        perror("sdn: strndup");
+        return -1;
+    }
+    CaptureBuffer capture;
+    int ret = capture_command_output(command_text, &capture);
+    free(command_text);
+    if (ret == -1) return -1;
+    trim_capture(&capture);
+    ret = string_buffer_append(sb, capture.data, capture.length);
+    release_capture(&capture);
+    return ret;
+}
+
+// True for an unquoted word that is exactly one $(...) or `...`. Its output is
+// split into fields that go straight into argv.
+bool word_is_command_substitution(const char *word) {
+    size_t len = strlen(word);
+    if (len >= 2 && word[0] == '`') {
+        return strchr(word + 1, '`') == word + len - 1;
+    }
+    if (len >= 3 && word[0] == '$' && word[1] == '(' && word[2] != '(') {
+        return find_substitution_end(word + 1) == word + len - 1;
+    }
+    return false;
+}
+
+// True if a whole word is a process substitution, <(...) or >(...)
+bool word_is_process_substitution(const char *word) {
+    if ((word[0] != '<' && word[0] != '>') || word[1] != '(') return false;
+    return find_substitution_end(word + 1) == word + strlen(word) - 1;
+}
+
+// Expand one argument string. Returns a new heap-allocated string with
+// variables, $(( )) arithmetic and command substitutions expanded and outer
+// quotes removed, or NULL if the word expands to itself. The caller frees the
+// result. Nothing is expanded inside single quotes. On failure, sets
+// expansion_failed and returns NULL.
 char* expand_single_argument(const char *arg_str) {
     if (arg_str == NULL) return NULL;
 
-    char expanded_arg_buffer[MAX_LINE * 2]; // Buffer for the new argument
-    char *write_ptr = expanded_arg_buffer;
     const char *read_ptr = arg_str;
-    
-    int original_len = strlen(arg_str);
-    if (original_len == 0) { // No change for an empty string that was already empty
-        // If arg_str was "" and it becomes "", no change.
-        // If arg_str was '' or "" (len 2) and becomes "", it's a change.
-        // This case is handled by strcmp at the end if original_len was 0.
-        // Let's be explicit: if original is empty, result is empty, no change.
-         return NULL;
+    size_t original_len = strlen(arg_str);
+    if (original_len == 0) { // An empty word stays empty
+        return NULL;
+    }
+    if (!strpbrk(arg_str, "$`'\"")) { // Nothing to expand or unquote: the common case in loops
+        return NULL;
     }
 
     bool outer_double_quoted = false;
@@ -900,73 +3473,129 @@ char* expand_single_argument(const char *arg_str) {
         scan_end_ptr--; // Adjust for the trailing quote
     }
 
-    while (read_ptr < scan_end_ptr && *read_ptr != '\0') {
-        if (write_ptr >= expanded_arg_buffer + sizeof(expanded_arg_buffer) - 1) {
-            fprintf(stderr, "sdn: warning: argument too long during expansion, truncated: %s\n", arg_str);
-            break; 
+    StringBuffer out;
+    string_buffer_init(&out);
+    int failed = 0;
+
+    while (read_ptr < scan_end_ptr && !failed) {
+        if (*read_ptr == '`' && !outer_single_quoted) { // `command`
+            const char *close = memchr(read_ptr + 1, '`', scan_end_ptr - read_ptr - 1);
+            if (close) {
+                failed = append_command_substitution(&out, read_ptr + 1, close - read_ptr - 1);
+                read_ptr = close + 1;
+                continue;
+            }
+        }
+        if (*read_ptr != '$' || outer_single_quoted) { // Not a variable for expansion (or inside single quotes), copy literally
+            const char *literal_end = read_ptr + 1;
+            while (literal_end < scan_end_ptr && *literal_end != '$' && *literal_end != '`') literal_end++;
+            if (outer_single_quoted) literal_end = scan_end_ptr;
+            failed = string_buffer_append(&out, read_ptr, literal_end - read_ptr);
+            read_ptr = literal_end;
+            continue;
         }
 
-        if (*read_ptr == '$' && !outer_single_quoted) { // Expand if not single-quoted content
-            const char *var_name_parse_start = read_ptr + 1; // Point after '$'
-            char var_name[MAX_VAR_NAME_LEN];
-            int var_name_len = 0; 
-            const char *next_read_ptr = var_name_parse_start; // Will point after the var syntax
+        const char *var_name_parse_start = read_ptr + 1; // Point after '$'
+        char var_name[MAX_VAR_NAME_LEN];
+        int var_name_len = 0;
+        const char *next_read_ptr = var_name_parse_start; // Will point after the var syntax
 
-            if (*var_name_parse_start == '{') { // ${VAR}
-                next_read_ptr++; // Skip '{'
-                while (*next_read_ptr != '\0' && *next_read_ptr != '}' && var_name_len < MAX_VAR_NAME_LEN - 1) {
-                    if (!is_valid_identifier_char(*next_read_ptr)) break; 
-                    var_name[var_name_len++] = *next_read_ptr++;
-                }
-                var_name[var_name_len] = '\0';
-                if (*next_read_ptr == '}') { // Found closing brace
-                    next_read_ptr++; // Skip '}'
-                } else { // Mismatched brace, invalid char, or end of string
-                    var_name_len = 0; // Signal failure to parse a valid ${VAR}
-                    next_read_ptr = var_name_parse_start; // Reset to only consume '$'
+        if (*var_name_parse_start == '(' && var_name_parse_start[1] == '(') { // $(( expression ))
+            const char *expr_start = var_name_parse_start + 2;
+            const char *close = find_arithmetic_end(expr_start);
+            if (close == NULL) {
+                fprintf(stderr, "sdn: unterminated `$((' in %s\n", arg_str);
+                failed = -1;
+                break;
+            }
+            char *expression = strndup(expr_start, close - expr_start);
+            if (expression && strpbrk(expression, "$`")) { // $((n + $(cmd))): substitute before evaluating
+                char *substituted = expand_single_argument(expression);
+                if (expansion_failed) {
+                    free(expression);
+                    failed = -1;
+                    break;
                 }
-            } else { // $VAR
-                while (*next_read_ptr != '\0' && is_valid_identifier_char(*next_read_ptr) && var_name_len < MAX_VAR_NAME_LEN - 1) {
-                    var_name[var_name_len++] = *next_read_ptr++;
+                if (substituted) {
+                    free(expression);
+                    expression = substituted;
                 }
-                var_name[var_name_len] = '\0';
-                // If var_name_len is 0, it means '$' was followed by non-identifier or EOS.
-                // next_read_ptr is already at the char after the potential var name.
             }
-
-            if (var_name_len > 0) { // Successfully parsed a variable name
-                const char *value = get_shell_variable(var_name);
-                if (value == NULL) value = getenv(var_name);
-
-                if (value != NULL) {
-                    size_t value_len_to_copy = strlen(value);
-                    if ((write_ptr - expanded_arg_buffer + value_len_to_copy) < sizeof(expanded_arg_buffer) - 1) {
-                        strcpy(write_ptr, value);
-                        write_ptr += value_len_to_copy;
-                    } else {
-                        size_t space_left = sizeof(expanded_arg_buffer) - (write_ptr - expanded_arg_buffer) - 1;
-                        strncpy(write_ptr, value, space_left);
-                        write_ptr += space_left;
-                        // Buffer became full during copy, next iteration of outer loop will break.
-                    }
-                }
-                // If value is NULL (undefined variable), it's treated as an empty string (nothing is copied).
-                read_ptr = next_read_ptr; // Update main read pointer past the variable syntax
-            } else { // '$' not followed by a valid variable name structure
-                *write_ptr++ = *read_ptr++; // Copy '$' literally, advance main read_ptr by 1
+            long long result;
+            if (!expression || evaluate_arithmetic(expression, &result) == -1) {
+                free(expression);
+                failed = -1;
+                break;
             }
-        } else { // Not a variable for expansion (or inside single quotes), copy literally
-            *write_ptr++ = *read_ptr++;
+            free(expression);
+            char number[24];
+            int written = snprintf(number, sizeof(number), "%lld", result);
+            failed = string_buffer_append(&out, number, written);
+            read_ptr = close + 2; // Past the closing "))"
+            continue;
+        } else if (*var_name_parse_start == '(') { // $( command )
+            const char *close = find_substitution_end(var_name_parse_start);
+            if (close == NULL) {
+                fprintf(stderr, "sdn: unterminated `$(' in %s\n", arg_str);
+                failed = -1;
+                break;
+            }
+            failed = append_command_substitution(&out, var_name_parse_start + 1, close - var_name_parse_start - 1);
+            read_ptr = close + 1;
+            continue;
+        } else if (*var_name_parse_start == '{') { // ${VAR}
+            next_read_ptr++; // Skip '{'
+            while (*next_read_ptr != '\0' && *next_read_ptr != '}' && var_name_len < MAX_VAR_NAME_LEN - 1) {
+                if (!is_valid_identifier_char(*next_read_ptr)) break;
+                var_name[var_name_len++] = *next_read_ptr++;
+            }
+            var_name[var_name_len] = '\0';
+            if (*next_read_ptr == '}') { // Found closing brace
+                next_read_ptr++; // Skip '}'
+            } else { // Mismatched brace, invalid char, or end of string
+                var_name_len = 0; // Signal failure to parse a valid ${VAR}
+                next_read_ptr = var_name_parse_start; // Reset to only consume '$'
+            }
+        } else if (*var_name_parse_start == '?' || *var_name_parse_start == '#' ||
+                   *var_name_parse_start == '@' || *var_name_parse_start == '*') { // $?, $#, $@ and $*
+            var_name[var_name_len++] = *var_name_parse_start;
+            var_name[var_name_len] = '\0';
+            next_read_ptr++;
+        } else { // $VAR
+            while (next_read_ptr < scan_end_ptr && is_valid_identifier_char(*next_read_ptr) && var_name_len < MAX_VAR_NAME_LEN - 1) {
+                var_name[var_name_len++] = *next_read_ptr++;
+            }
+            var_name[var_name_len] = '\0';
+            // If var_name_len is 0, it means '$' was followed by non-identifier or EOS.
+        }
+
+        if (var_name_len > 0) { // Successfully parsed a variable name
+            const char *value = get_shell_variable(var_name);
+            if (value == NULL) value = getenv(var_name);
+            // An undefined variable is treated as an empty string
+            if (value != NULL) failed = string_buffer_append(&out, value, strlen(value));
+            read_ptr = next_read_ptr; // Update main read pointer past the variable syntax
+        } else { // '$' not followed by a valid variable name structure
+            failed = string_buffer_append(&out, "$", 1);
+            read_ptr++;
         }
     }
-    *write_ptr = '\0'; // Null-terminate the expanded string
 
-    // If expanded_arg_buffer is different from original arg_str, return new string. Otherwise NULL.
-    if (strcmp(arg_str, expanded_arg_buffer) != 0) {
-        return strdup(expanded_arg_buffer);
-    } else {
+    if (failed) {
+        if (failed == -1 && errno == ENOMEM) perror("sdn: expansion");
+        expansion_failed = true;
+        string_buffer_free(&out);
         return NULL;
     }
+
+    // If the expansion differs from the original arg_str, return a new string. Otherwise NULL.
+    char *result = NULL;
+    if (out.length != original_len || memcmp(arg_str, out.data, original_len) != 0) {
+        result = out.data != out.inline_storage ? out.data : strndup(out.data, out.length);
+        if (out.data != out.inline_storage) out.data = out.inline_storage; // Ownership moved to result
+    }
+    string_buffer_free(&out);
+    return result;
 }
 
 
@@ -983,7 +3612,7 @@ void expand_variables_in_args(char **args) {
 }
 
 // NEW built-in handler for echo
-void handle_echo_builtin(char **args) {
+int handle_echo_builtin(char **args) {
     // args[0] is "echo". Start printing from args[1].
     for (int i = 1; args[i] != NULL; i++) {
         printf("%s", args[i]);
@@ -993,359 +3622,4749 @@ void handle_echo_builtin(char **args) {
     }
     printf("\n");
     // fflush(stdout); // Usually not needed for printf with \n
+    return 0;
 }
 
-void free_command_segment_internals(CommandSegment *segment) {
-    for (int i = 0; segment->args[i] != NULL; i++) {
-        free(segment->args[i]);
-        segment->args[i] = NULL;
-    }
-    if (segment->inputFile) {
-        free(segment->inputFile);
-        segment->inputFile = NULL;
-    }
-    if (segment->outputFile) {
-        free(segment->outputFile);
-        segment->outputFile = NULL;
-    }
+// --- Lexer and parser ---
+// Input is parsed once into a tree of Nodes, which is then executed. Words are
+// kept raw (quotes included) and expanded only at execution time, so a parsed
+// script can run any number of times without being re-read.
+
+typedef enum {
+    TOK_WORD,
+    TOK_PIPE,      // |
+    TOK_AND_IF,    // &&
+    TOK_OR_IF,     // ||
+    TOK_SEMI,      // ;
+    TOK_AMP,       // &
+    TOK_NEWLINE,
+    TOK_LESS,      // <
+    TOK_GREAT,     // >
+    TOK_DGREAT,    // >>
+    TOK_DLESS,     // << (here-document)
+    TOK_DLESSDASH, // <<- (here-document with leading tabs stripped)
+    TOK_TLESS,     // <<< (here-string)
+    TOK_EOF
+} TokenType;
+
+typedef struct {
+    TokenType type;
+    char *text; // Raw word for TOK_WORD, operator spelling otherwise
+    int line;
+    size_t start; // Offset of the token in the input
+    size_t end;
+} Token;
+
+typedef enum {
+    PARSE_OK,
+    PARSE_ERROR,
+    PARSE_INCOMPLETE // Input ended inside a construct; more lines would complete it
+} ParseStatus;
+
+typedef struct {
+    const char *input;
+    size_t pos;
+    int line;
+    Token current;
+    bool has_current;
+    ParseStatus status;
+    char error[128];
+    size_t heredoc_resume; // Where scanning continues after this line's here-document bodies (0 = none)
+    int heredoc_lines;     // Lines those bodies span
+} Lexer;
+
+void lexer_init(Lexer *lexer, const char *input) {
+    memset(lexer, 0, sizeof(*lexer));
+    lexer->input = input;
+    lexer->line = 1;
+    lexer->status = PARSE_OK;
 }
 
-int parse_single_command_segment(char *segment_str, CommandSegment *cmd_segment) {
-    // Initialize segment
-    cmd_segment->inputFile = NULL;
-    cmd_segment->outputFile = NULL;
-    cmd_segment->appendMode = 0;
-    for(int i=0; i<MAX_ARGS; ++i) cmd_segment->args[i] = NULL;
+void lexer_fail(Lexer *lexer, ParseStatus status, const char *message) {
+    if (lexer->status != PARSE_OK) return; // Keep the first error
+    lexer->status = status;
+    snprintf(lexer->error, sizeof(lexer->error), "%s", message);
+}
 
-    char segment_str_copy[MAX_LINE];
-    strncpy(segment_str_copy, segment_str, MAX_LINE - 1);
-    segment_str_copy[MAX_LINE - 1] = '\0';
+bool is_operator_char(char c) {
+    return c == '|' || c == ';' || c == '&' || c == '<' || c == '>' || c == '\n';
+}
 
-    char *raw_tokens[MAX_ARGS];
-    int raw_token_count = 0;
-    char *token = strtok(segment_str_copy, " \n\t\r");
-    while (token != NULL && raw_token_count < MAX_ARGS) {
-        raw_tokens[raw_token_count++] = token;
-        token = strtok(NULL, " \n\t\r");
+// Step over a $( ... ) or $(( ... )) group starting at the '$', honouring
+// nested parentheses and quotes. Returns -1 if the input ends inside it.
+int lexer_skip_parens(Lexer *lexer) {
+    const char *in = lexer->input;
+    int depth = 0;
+    lexer->pos++; // The '$'
+    while (in[lexer->pos] != '\0') {
+        char c = in[lexer->pos];
+        if (c == '\'' || c == '"') {
+            lexer->pos++;
+            while (in[lexer->pos] != '\0' && in[lexer->pos] != c) {
+                if (in[lexer->pos] == '\n') lexer->line++;
+                lexer->pos++;
+            }
+            if (in[lexer->pos] == '\0') return -1;
+        } else if (c == '\\' && in[lexer->pos + 1] != '\0') {
+            lexer->pos++;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            if (--depth == 0) {
+                lexer->pos++;
+                return 0;
+            }
+        } else if (c == '\n') {
+            lexer->line++;
+        }
+        lexer->pos++;
     }
+    return -1;
+}
 
-    if (raw_token_count == 0) {
-        return 0; 
+// Scan one token starting at lexer->pos
+Token lexer_scan(Lexer *lexer) {
+    const char *in = lexer->input;
+    Token tok = {TOK_EOF, NULL, lexer->line, 0, 0};
+
+    while (1) {
+        char c = in[lexer->pos];
+        if (c == ' ' || c == '\t' || c == '\r') {
+            lexer->pos++;
+        } else if (c == '\\' && in[lexer->pos + 1] == '\n') { // Line continuation
+            lexer->pos += 2;
+            lexer->line++;
+        } else if (c == '#') { // Comment runs to end of line
+            while (in[lexer->pos] != '\0' && in[lexer->pos] != '\n') lexer->pos++;
+        } else {
+            break;
+        }
     }
 
-    int current_arg_idx = 0;
-    for (int i = 0; i < raw_token_count; ) {
-        char *current_raw_token = raw_tokens[i];
+    tok.start = lexer->pos;
+    tok.line = lexer->line;
+    char c = in[lexer->pos];
+    if (c == '\0') {
+        tok.end = lexer->pos;
+        return tok;
+    }
 
-        if (strcmp(current_raw_token, "<") == 0) {
-            if (i + 1 < raw_token_count) {
-                if (cmd_segment->inputFile) free(cmd_segment->inputFile);
-                cmd_segment->inputFile = strdup(raw_tokens[i + 1]);
-                if (!cmd_segment->inputFile) { perror("sdn: strdup error"); free_command_segment_internals(cmd_segment); return -1; }
-                i += 2;
-            } else {
-                fprintf(stderr, "sdn: syntax error near `<'\n");
-                free_command_segment_internals(cmd_segment); return -1;
+    // <(cmd) and >(cmd) at the start of a word are process substitutions, not redirections
+    bool process_substitution = (c == '<' || c == '>') && in[lexer->pos + 1] == '(';
+    if (is_operator_char(c) && !process_substitution) {
+        const char *spelling;
+        if (c == '>' && in[lexer->pos + 1] == '>') {
+            tok.type = TOK_DGREAT; spelling = ">>"; lexer->pos += 2;
+        } else if (c == '<' && in[lexer->pos + 1] == '<' && in[lexer->pos + 2] == '<') {
+            tok.type = TOK_TLESS; spelling = "<<<"; lexer->pos += 3;
+        } else if (c == '<' && in[lexer->pos + 1] == '<' && in[lexer->pos + 2] == '-') {
+            tok.type = TOK_DLESSDASH; spelling = "<<-"; lexer->pos += 3;
+        } else if (c == '<' && in[lexer->pos + 1] == '<') {
+            tok.type = TOK_DLESS; spelling = "<<"; lexer->pos += 2;
+        } else if (c == '&' && in[lexer->pos + 1] == '&') {
+            tok.type = TOK_AND_IF; spelling = "&&"; lexer->pos += 2;
+        } else if (c == '|' && in[lexer->pos + 1] == '|') {
+            tok.type = TOK_OR_IF; spelling = "||"; lexer->pos += 2;
+        } else {
+            lexer->pos++;
+            switch (c) {
+                case '|': tok.type = TOK_PIPE; spelling = "|"; break;
+                case ';': tok.type = TOK_SEMI; spelling = ";"; break;
+                case '&': tok.type = TOK_AMP; spelling = "&"; break;
+                case '<': tok.type = TOK_LESS; spelling = "<"; break;
+                case '>': tok.type = TOK_GREAT; spelling = ">"; break;
+                default:
+                    tok.type = TOK_NEWLINE; spelling = "newline"; lexer->line++;
+                    if (lexer->heredoc_resume) { // Step over the bodies read for this line's here-documents
+                        lexer->pos = lexer->heredoc_resume;
+                        lexer->line += lexer->heredoc_lines;
+                        lexer->heredoc_resume = 0;
+                        lexer->heredoc_lines = 0;
+                    }
+                    break;
             }
-        } else if (strcmp(current_raw_token, ">") == 0) {
-            if (i + 1 < raw_token_count) {
-                if (cmd_segment->outputFile) free(cmd_segment->outputFile);
-                cmd_segment->outputFile = strdup(raw_tokens[i + 1]);
-                if (!cmd_segment->outputFile) { perror("sdn: strdup error"); free_command_segment_internals(cmd_segment); return -1; }
-                cmd_segment->appendMode = 0;
-                i += 2;
-            } else {
-                fprintf(stderr, "sdn: syntax error near `>'\n");
-                free_command_segment_internals(cmd_segment); return -1;
+        }
+        tok.text = strdup(spelling);
+        tok.end = lexer->pos;
+        return tok;
+    }
+
+    // A word: everything up to unquoted whitespace or an operator
+    size_t start = lexer->pos;
+    char quote = 0;
+    while (in[lexer->pos] != '\0') {
+        c = in[lexer->pos];
+        if (quote == '\'') {
+            if (c == quote) quote = 0;
+            else if (c == '\n') lexer->line++;
+            lexer->pos++;
+            continue;
+        }
+        if (quote == '"' && c == '"') {
+            quote = 0;
+        } else if (c == '\'' && !quote) {
+            quote = c;
+        } else if (c == '"') {
+            quote = c;
+        } else if (c == '\\' && in[lexer->pos + 1] != '\0') {
+            lexer->pos++; // Keep the escaped character in the word
+        } else if (c == '$' && in[lexer->pos + 1] == '(') {
+            // $( ... ) and $(( ... )) may hold spaces, quotes and operators; keep them in this word
+            if (lexer_skip_parens(lexer) == -1) {
+                lexer_fail(lexer, PARSE_INCOMPLETE, "unterminated `$('");
+                break;
             }
-        } else if (strcmp(current_raw_token, ">>") == 0) {
-            if (i + 1 < raw_token_count) {
-                if (cmd_segment->outputFile) free(cmd_segment->outputFile);
-                cmd_segment->outputFile = strdup(raw_tokens[i + 1]);
-                if (!cmd_segment->outputFile) { perror("sdn: strdup error"); free_command_segment_internals(cmd_segment); return -1; }
-                cmd_segment->appendMode = 1;
-                i += 2;
-            } else {
-                fprintf(stderr, "sdn: syntax error near `>>'\n");
+            continue;
+        } else if ((c == '<' || c == '>') && in[lexer->pos + 1] == '(' && lexer->pos == start) {
+            if (lexer_skip_parens(lexer) == -1) { // Skips the '<' or '>' like a '$'
+                lexer_fail(lexer, PARSE_INCOMPLETE, c == '<' ? "unterminated `<('" : "unterminated `>('");
+                break;
+            }
+            continue;
+        } else if (c == '`') {
+            const char *close = strchr(in + lexer->pos + 1, '`');
+            if (!close) {
+                lexer_fail(lexer, PARSE_INCOMPLETE, "unterminated ``'");
+                lexer->pos += strlen(in + lexer->pos);
+                break;
+            }
+            for (const char *p = in + lexer->pos; p < close; p++) {
+                if (*p == '\n') lexer->line++;
+            }
+            lexer->pos = close - in;
+        } else if (quote == '"') {
+            if (c == '\n') lexer->line++;
+        } else if (c == '(' && in[lexer->pos + 1] == ')') {
+            lexer->pos += 2; // `()' ends the word, so `f(){' reads as `f()' and `{'
+            break;
+        } else if (c == ' ' || c == '\t' || c == '\r' || is_operator_char(c)) {
+            break;
+        }
+        lexer->pos++;
+    }
+    if (quote) {
+        lexer_fail(lexer, PARSE_INCOMPLETE, "unterminated quote");
+    }
+    tok.type = TOK_WORD;
+    tok.text = strndup(in + start, lexer->pos - start);
+    tok.end = lexer->pos;
+    return tok;
+}
+
+Token *lexer_peek(Lexer *lexer) {
+    if (!lexer->has_current) {
+        lexer->current = lexer_scan(lexer);
+        lexer->has_current = true;
+    }
+    return &lexer->current;
+}
+
+// Take ownership of the current token
+Token lexer_next(Lexer *lexer) {
+    lexer_peek(lexer);
+    lexer->has_current = false;
+    return lexer->current;
+}
+
+void lexer_skip(Lexer *lexer) {
+    Token tok = lexer_next(lexer);
+    free(tok.text);
+}
+
+struct Node;
+void free_node(struct Node *node);
+
+typedef struct {
+    char **words; // Raw words, with redirection operators as their own entries
+    int word_count;
+    int word_capacity;
+    int assignment_count; // Leading NAME=value words
+    struct Node *compound; // Set when this stage is a compound command; words then hold only redirections
+} SimpleCommand;
+
+typedef enum {
+    NODE_LIST,     // Statements run in order; also a { ...; } group
+    NODE_PIPELINE,
+    NODE_AND,      // children[0] && children[1]
+    NODE_OR,       // children[0] || children[1]
+    NODE_NOT,      // ! children[0]
+    NODE_IF,       // children: condition, then-part, optional else-part (an elif is a nested NODE_IF)
+    NODE_WHILE,    // children: condition, body
+    NODE_UNTIL,
+    NODE_FOR,      // name, optional word list in commands[0], children[0] is the body
+    NODE_FUNCTION  // name, children[0] is the body
+} NodeType;
+
+typedef struct Node {
+    NodeType type;
+    int refs; // Extra owners besides the parent, e.g. the function table
+    // NODE_LIST and compound commands
+    struct Node **children;
+    int child_count;
+    char *name; // NODE_FOR variable or NODE_FUNCTION name
+    // NODE_PIPELINE
+    SimpleCommand *commands;
+    int command_count;
+    bool background;
+    bool timed;
+    char *source_text; // Shown in job notices
+} Node;
+
+int add_command_word(SimpleCommand *cmd, const char *word) {
+    if (cmd->word_count + 1 >= cmd->word_capacity) {
+        int new_capacity = cmd->word_capacity ? cmd->word_capacity * 2 : 8;
+        char **grown = realloc(cmd->words, new_capacity * sizeof(char*));
+        if (!grown) return -1;
+        cmd->words = grown;
+        cmd->word_capacity = new_capacity;
+    }
+    cmd->words[cmd->word_count] = strdup(word);
+    if (!cmd->words[cmd->word_count]) return -1;
+    cmd->word_count++;
+    cmd->words[cmd->word_count] = NULL;
+    return 0;
+}
+
+void free_simple_command(SimpleCommand *cmd) {
+    for (int i = 0; i < cmd->word_count; i++) free(cmd->words[i]);
+    free(cmd->words);
+    free_node(cmd->compound);
+    cmd->words = NULL;
+    cmd->word_count = 0;
+    cmd->word_capacity = 0;
+    cmd->assignment_count = 0;
+    cmd->compound = NULL;
+}
+
+void free_node(Node *node) {
+    if (!node) return;
+    if (node->refs > 0) { // Still referenced elsewhere
+        node->refs--;
+        return;
+    }
+    for (int i = 0; i < node->child_count; i++) free_node(node->children[i]);
+    free(node->children);
+    for (int i = 0; i < node->command_count; i++) free_simple_command(&node->commands[i]);
+    free(node->commands);
+    free(node->name);
+    free(node->source_text);
+    free(node);
+}
+
+Node *new_node(NodeType type) {
+    Node *node = calloc(1, sizeof(Node));
+    if (node) node->type = type;
+    return node;
+}
+
+int add_child_node(Node *parent, Node *child) {
+    Node **grown = realloc(parent->children, (parent->child_count + 1) * sizeof(Node*));
+    if (!grown) return -1;
+    parent->children = grown;
+    parent->children[parent->child_count++] = child;
+    return 0;
+}
+
+bool token_ends_command(const Token *tok) {
+    return tok->type == TOK_PIPE || tok->type == TOK_SEMI || tok->type == TOK_AMP ||
+           tok->type == TOK_AND_IF || tok->type == TOK_OR_IF ||
+           tok->type == TOK_NEWLINE || tok->type == TOK_EOF;
+}
+
+bool token_is_redirection(const Token *tok) {
+    return tok->type == TOK_LESS || tok->type == TOK_GREAT || tok->type == TOK_DGREAT ||
+           tok->type == TOK_DLESS || tok->type == TOK_DLESSDASH || tok->type == TOK_TLESS;
+}
+
+bool token_is_word(const Token *tok, const char *word) {
+    return tok->type == TOK_WORD && strcmp(tok->text, word) == 0;
+}
+
+// Reserved words that close a construct; they are only special as a command's first word
+bool is_closing_reserved_word(const char *word) {
+    static const char *const closers[] = {"then", "elif", "else", "fi", "do", "done", "}", NULL};
+    for (int i = 0; closers[i]; i++) {
+        if (strcmp(word, closers[i]) == 0) return true;
+    }
+    return false;
+}
+
+bool is_compound_start(const Token *tok) {
+    return token_is_word(tok, "if") || token_is_word(tok, "while") || token_is_word(tok, "until") ||
+           token_is_word(tok, "for") || token_is_word(tok, "{");
+}
+
+// NAME=value, with an unquoted valid name
+bool is_assignment_word(const char *word) {
+    const char *eq = strchr(word, '=');
+    if (!eq || eq == word || isdigit((unsigned char)word[0])) return false;
+    for (const char *p = word; p < eq; p++) {
+        if (!is_valid_identifier_char(*p)) return false;
+    }
+    return true;
+}
+
+void fail_near_token(Lexer *lexer, const Token *tok, const char *fallback) {
+    char message[64];
+    if (tok->type == TOK_EOF) {
+        if (fallback) {
+            snprintf(message, sizeof(message), "syntax error near `%s'", fallback);
+            lexer_fail(lexer, PARSE_ERROR, message);
+        } else {
+            lexer_fail(lexer, PARSE_INCOMPLETE, "unexpected end of input");
+        }
+        return;
+    }
+    snprintf(message, sizeof(message), "syntax error near `%s'", tok->text);
+    lexer_fail(lexer, PARSE_ERROR, message);
+}
+
+// Consume the reserved word `word`, or fail. Running out of input is reported
+// as incomplete so the interactive shell keeps reading lines.
+bool expect_word(Lexer *lexer, const char *word) {
+    if (lexer->status != PARSE_OK) return false;
+    Token *tok = lexer_peek(lexer);
+    if (token_is_word(tok, word)) {
+        lexer_skip(lexer);
+        return true;
+    }
+    fail_near_token(lexer, tok, NULL);
+    return false;
+}
+
+void skip_newlines(Lexer *lexer) {
+    while (lexer_peek(lexer)->type == TOK_NEWLINE) lexer_skip(lexer);
+}
+
+// Read the body of a here-document from the lines after the current one (or
+// after the previous here-document on this line). The body is stored as the
+// redirection's target word, in double quotes so it is expanded like "...",
+// or in single quotes when the delimiter was quoted.
+int read_heredoc_body(Lexer *lexer, const char *raw_delimiter, bool strip_tabs, SimpleCommand *cmd) {
+    char delimiter[256];
+    size_t delimiter_len = 0;
+    bool quoted = false;
+    for (const char *p = raw_delimiter; *p != '\0' && delimiter_len < sizeof(delimiter) - 1; p++) {
+        if (*p == '\'' || *p == '"' || *p == '\\') {
+            quoted = true;
+            continue;
+        }
+        delimiter[delimiter_len++] = *p;
+    }
+    delimiter[delimiter_len] = '\0';
+
+    const char *in = lexer->input;
+    const char *line = lexer->heredoc_resume ? in + lexer->heredoc_resume : strchr(in + lexer->pos, '\n');
+    if (line == NULL) {
+        lexer_fail(lexer, PARSE_INCOMPLETE, "unterminated here-document");
+        return -1;
+    }
+    if (!lexer->heredoc_resume) line++; // Past the newline ending the command line
+
+    StringBuffer body;
+    string_buffer_init(&body);
+    int failed = string_buffer_append(&body, quoted ? "'" : "\"", 1);
+    int lines = 0;
+    while (!failed) {
+        if (*line == '\0') {
+            string_buffer_free(&body);
+            lexer_fail(lexer, PARSE_INCOMPLETE, "unterminated here-document");
+            return -1;
+        }
+        const char *line_end = strchrnul(line, '\n');
+        lines++;
+        if (strip_tabs) {
+            while (*line == '\t') line++;
+        }
+        if ((size_t)(line_end - line) == delimiter_len && strncmp(line, delimiter, delimiter_len) == 0) {
+            line = *line_end ? line_end + 1 : line_end;
+            break;
+        }
+        failed = string_buffer_append(&body, line, line_end - line);
+        if (!failed) failed = string_buffer_append(&body, "\n", 1);
+        line = *line_end ? line_end + 1 : line_end;
+    }
+    if (!failed) failed = string_buffer_append(&body, quoted ? "'" : "\"", 1);
+    if (!failed) failed = string_buffer_append(&body, "", 1); // NUL-terminate for add_command_word
+    if (!failed) failed = add_command_word(cmd, body.data);
+    string_buffer_free(&body);
+    if (failed) return -1;
+
+    lexer->heredoc_resume = line - in;
+    lexer->heredoc_lines += lines;
+    return 0;
+}
+
+// Read a redirection operator and its target into cmd
+int parse_redirection(Lexer *lexer, SimpleCommand *cmd) {
+    Token tok = lexer_next(lexer);
+    TokenType type = tok.type;
+    // Both here-document forms are stored as "<<"; tabs are stripped while reading the body
+    int ret = add_command_word(cmd, type == TOK_DLESSDASH ? "<<" : tok.text);
+    char spelling[4];
+    snprintf(spelling, sizeof(spelling), "%s", tok.text);
+    free(tok.text);
+    if (ret == -1) return -1;
+    if (lexer_peek(lexer)->type != TOK_WORD) {
+        fail_near_token(lexer, lexer_peek(lexer), spelling);
+        return -1;
+    }
+    Token target = lexer_next(lexer);
+    if (type == TOK_DLESS || type == TOK_DLESSDASH) {
+        ret = read_heredoc_body(lexer, target.text, type == TOK_DLESSDASH, cmd);
+    } else {
+        ret = add_command_word(cmd, target.text);
+    }
+    free(target.text);
+    return ret;
+}
+
+// simple_command := (word | redirection)+
+// Returns 1 when the words so far turn out to start a function definition, `name()`.
+int parse_simple_command(Lexer *lexer, SimpleCommand *cmd) {
+    while (!token_ends_command(lexer_peek(lexer)) && lexer->status == PARSE_OK) {
+        if (token_is_redirection(lexer_peek(lexer))) {
+            if (parse_redirection(lexer, cmd) == -1) return -1;
+            continue;
+        }
+        Token tok = lexer_next(lexer);
+        int ret = add_command_word(cmd, tok.text);
+        free(tok.text);
+        if (ret == -1) return -1;
+        if (cmd->word_count == cmd->assignment_count + 1 && is_assignment_word(cmd->words[cmd->word_count - 1])) {
+            cmd->assignment_count++;
+        }
+        if (cmd->word_count == 1 && cmd->assignment_count == 0) {
+            size_t len = strlen(cmd->words[0]);
+            if ((len > 2 && strcmp(cmd->words[0] + len - 2, "()") == 0) || token_is_word(lexer_peek(lexer), "()")) {
+                return 1;
+            }
+        }
+    }
+    return lexer->status == PARSE_OK ? 0 : -1;
+}
+
+Node *parse_list(Lexer *lexer, const char *const *terminators);
+Node *parse_compound_command(Lexer *lexer);
+
+// Parse a list that must end at one of `terminators` and hold at least one command
+Node *parse_required_list(Lexer *lexer, const char *const *terminators, const char *after) {
+    Node *list = parse_list(lexer, terminators);
+    if (list && list->child_count == 0) {
+        Token *tok = lexer_peek(lexer);
+        if (tok->type == TOK_EOF) {
+            lexer_fail(lexer, PARSE_INCOMPLETE, "unexpected end of input");
+        } else {
+            char message[64];
+            snprintf(message, sizeof(message), "syntax error near `%s' after `%s'", tok->text, after);
+            lexer_fail(lexer, PARSE_ERROR, message);
+        }
+        free_node(list);
+        return NULL;
+    }
+    return list;
+}
+
+// if_clause := 'if' list 'then' list { 'elif' list 'then' list } [ 'else' list ] 'fi'
+Node *parse_if_clause(Lexer *lexer) {
+    static const char *const then_terminators[] = {"then", NULL};
+    static const char *const branch_terminators[] = {"elif", "else", "fi", NULL};
+    static const char *const else_terminators[] = {"fi", NULL};
+
+    lexer_skip(lexer); // 'if' or 'elif'
+    Node *node = new_node(NODE_IF);
+    if (!node) return NULL;
+    Node *condition = parse_required_list(lexer, then_terminators, "if");
+    if (!condition || add_child_node(node, condition) == -1 || !expect_word(lexer, "then")) goto fail;
+    Node *then_part = parse_required_list(lexer, branch_terminators, "then");
+    if (!then_part || add_child_node(node, then_part) == -1) goto fail;
+
+    if (token_is_word(lexer_peek(lexer), "elif")) {
+        Node *elif_part = parse_if_clause(lexer); // Consumes the shared 'fi'
+        if (!elif_part || add_child_node(node, elif_part) == -1) goto fail;
+        return node;
+    }
+    if (token_is_word(lexer_peek(lexer), "else")) {
+        lexer_skip(lexer);
+        Node *else_part = parse_required_list(lexer, else_terminators, "else");
+        if (!else_part || add_child_node(node, else_part) == -1) goto fail;
+    }
+    if (!expect_word(lexer, "fi")) goto fail;
+    return node;
+
+fail:
+    free_node(node);
+    return NULL;
+}
+
+// do_group := 'do' list 'done'
+Node *parse_do_group(Lexer *lexer) {
+    static const char *const done_terminators[] = {"done", NULL};
+    if (!expect_word(lexer, "do")) return NULL;
+    Node *body = parse_required_list(lexer, done_terminators, "do");
+    if (body && !expect_word(lexer, "done")) {
+        free_node(body);
+        return NULL;
+    }
+    return body;
+}
+
+// while_clause := ('while' | 'until') list do_group
+Node *parse_while_clause(Lexer *lexer) {
+    static const char *const do_terminators[] = {"do", NULL};
+    Node *node = new_node(token_is_word(lexer_peek(lexer), "while") ? NODE_WHILE : NODE_UNTIL);
+    if (!node) return NULL;
+    lexer_skip(lexer);
+    Node *condition = parse_required_list(lexer, do_terminators, node->type == NODE_WHILE ? "while" : "until");
+    if (!condition || add_child_node(node, condition) == -1) goto fail;
+    Node *body = parse_do_group(lexer);
+    if (!body || add_child_node(node, body) == -1) goto fail;
+    return node;
+
+fail:
+    free_node(node);
+    return NULL;
+}
+
+// for_clause := 'for' name [ linebreak 'in' word* ] separator do_group
+// Without `in`, the loop runs over the positional parameters.
+Node *parse_for_clause(Lexer *lexer) {
+    Node *node = new_node(NODE_FOR);
+    if (!node) return NULL;
+    lexer_skip(lexer); // 'for'
+    Token *tok = lexer_peek(lexer);
+    if (tok->type != TOK_WORD || !is_valid_variable_name(tok->text)) {
+        fail_near_token(lexer, tok, "for");
+        goto fail;
+    }
+    Token name = lexer_next(lexer);
+    node->name = name.text;
+
+    skip_newlines(lexer);
+    if (token_is_word(lexer_peek(lexer), "in")) {
+        lexer_skip(lexer);
+        node->commands = calloc(1, sizeof(SimpleCommand));
+        if (!node->commands) goto fail;
+        node->command_count = 1;
+        while (lexer_peek(lexer)->type == TOK_WORD && lexer->status == PARSE_OK) {
+            Token word = lexer_next(lexer);
+            int ret = add_command_word(&node->commands[0], word.text);
+            free(word.text);
+            if (ret == -1) goto fail;
+        }
+        tok = lexer_peek(lexer);
+        if (tok->type != TOK_SEMI && tok->type != TOK_NEWLINE) {
+            fail_near_token(lexer, tok, NULL);
+            goto fail;
+        }
+        lexer_skip(lexer);
+    } else if (lexer_peek(lexer)->type == TOK_SEMI) {
+        lexer_skip(lexer);
+    }
+    skip_newlines(lexer);
+
+    Node *body = parse_do_group(lexer);
+    if (!body || add_child_node(node, body) == -1) goto fail;
+    return node;
+
+fail:
+    free_node(node);
+    return NULL;
+}
+
+// brace_group := '{' list '}'
+Node *parse_brace_group(Lexer *lexer) {
+    static const char *const brace_terminators[] = {"}", NULL};
+    lexer_skip(lexer); // '{'
+    Node *body = parse_required_list(lexer, brace_terminators, "{");
+    if (body && !expect_word(lexer, "}")) {
+        free_node(body);
+        return NULL;
+    }
+    return body;
+}
+
+Node *parse_compound_command(Lexer *lexer) {
+    Token *tok = lexer_peek(lexer);
+    if (token_is_word(tok, "if")) return parse_if_clause(lexer);
+    if (token_is_word(tok, "while") || token_is_word(tok, "until")) return parse_while_clause(lexer);
+    if (token_is_word(tok, "for")) return parse_for_clause(lexer);
+    return parse_brace_group(lexer);
+}
+
+// command := compound_command redirection* | function_definition | simple_command
+// function_definition := name '(' ')' linebreak compound_command
+int parse_command(Lexer *lexer, SimpleCommand *cmd) {
+    if (is_compound_start(lexer_peek(lexer))) {
+        cmd->compound = parse_compound_command(lexer);
+        if (!cmd->compound) return -1;
+        while (token_is_redirection(lexer_peek(lexer))) {
+            if (parse_redirection(lexer, cmd) == -1) return -1;
+        }
+        if (!token_ends_command(lexer_peek(lexer))) {
+            fail_near_token(lexer, lexer_peek(lexer), NULL);
+            return -1;
+        }
+        return 0;
+    }
+
+    int ret = parse_simple_command(lexer, cmd);
+    if (ret != 1) return ret;
+
+    // name() { ...; }
+    char *name = cmd->words[0];
+    size_t len = strlen(name);
+    if (len > 2 && strcmp(name + len - 2, "()") == 0) {
+        name[len - 2] = '\0';
+    } else {
+        lexer_skip(lexer); // The separate "()"
+    }
+    if (!is_valid_variable_name(name)) {
+        char message[64];
+        snprintf(message, sizeof(message), "`%s': not a valid function name", name);
+        lexer_fail(lexer, PARSE_ERROR, message);
+        return -1;
+    }
+    skip_newlines(lexer);
+    if (!is_compound_start(lexer_peek(lexer))) {
+        fail_near_token(lexer, lexer_peek(lexer), NULL);
+        return -1;
+    }
+    Node *definition = new_node(NODE_FUNCTION);
+    if (!definition) return -1;
+    definition->name = strdup(name);
+    Node *body = parse_compound_command(lexer);
+    if (!definition->name || !body || add_child_node(definition, body) == -1) {
+        free_node(body);
+        free_node(definition);
+        return -1;
+    }
+    free_simple_command(cmd);
+    cmd->compound = definition;
+    return 0;
+}
+
+// pipeline := ['!'] ['time'] command { '|' linebreak command }
+Node *parse_pipeline(Lexer *lexer) {
+    if (token_is_word(lexer_peek(lexer), "!")) {
+        lexer_skip(lexer);
+        Node *negated = new_node(NODE_NOT);
+        if (!negated) return NULL;
+        if (token_ends_command(lexer_peek(lexer))) {
+            fail_near_token(lexer, lexer_peek(lexer), "!");
+            free_node(negated);
+            return NULL;
+        }
+        Node *inner = parse_pipeline(lexer);
+        if (!inner || add_child_node(negated, inner) == -1) {
+            free_node(inner);
+            free_node(negated);
+            return NULL;
+        }
+        return negated;
+    }
+
+    Node *node = new_node(NODE_PIPELINE);
+    if (!node) return NULL;
+    size_t start = lexer_peek(lexer)->start;
+    size_t end = start;
+
+    Token *first = lexer_peek(lexer);
+    if (first->type == TOK_WORD && strcmp(first->text, "time") == 0) {
+        lexer_skip(lexer);
+        node->timed = true;
+        if (token_ends_command(lexer_peek(lexer))) {
+            lexer_fail(lexer, PARSE_ERROR, "time: a pipeline must follow");
+            free_node(node);
+            return NULL;
+        }
+        start = lexer_peek(lexer)->start;
+    }
+
+    while (1) {
+        SimpleCommand *grown = realloc(node->commands, (node->command_count + 1) * sizeof(SimpleCommand));
+        if (!grown) { free_node(node); return NULL; }
+        node->commands = grown;
+        SimpleCommand *cmd = &node->commands[node->command_count++];
+        memset(cmd, 0, sizeof(*cmd));
+
+        if (parse_command(lexer, cmd) == -1) { free_node(node); return NULL; }
+        end = lexer_peek(lexer)->start;
+        if (cmd->word_count == 0 && !cmd->compound) {
+            fail_near_token(lexer, lexer_peek(lexer), "|");
+            free_node(node);
+            return NULL;
+        }
+        if (lexer_peek(lexer)->type != TOK_PIPE) break;
+        lexer_skip(lexer);
+        skip_newlines(lexer);
+        if (lexer_peek(lexer)->type == TOK_EOF) { // Trailing '|': the pipeline continues on the next line
+            lexer_fail(lexer, PARSE_INCOMPLETE, "unexpected end of input after `|'");
+            free_node(node);
+            return NULL;
+        }
+    }
+
+    while (end > start && isspace((unsigned char)lexer->input[end - 1])) end--;
+    node->source_text = strndup(lexer->input + start, end - start);
+    return node;
+}
+
+// and_or := pipeline { ('&&' | '||') linebreak pipeline }
+Node *parse_and_or(Lexer *lexer) {
+    Node *left = parse_pipeline(lexer);
+    while (left && (lexer_peek(lexer)->type == TOK_AND_IF || lexer_peek(lexer)->type == TOK_OR_IF)) {
+        Node *node = new_node(lexer_peek(lexer)->type == TOK_AND_IF ? NODE_AND : NODE_OR);
+        lexer_skip(lexer);
+        skip_newlines(lexer);
+        if (lexer_peek(lexer)->type == TOK_EOF) {
+            lexer_fail(lexer, PARSE_INCOMPLETE, "unexpected end of input");
+        }
+        Node *right = lexer->status == PARSE_OK ? parse_pipeline(lexer) : NULL;
+        if (!node || !right || add_child_node(node, left) == -1) {
+            free_node(node);
+            free_node(left);
+            free_node(right);
+            return NULL;
+        }
+        if (add_child_node(node, right) == -1) {
+            free_node(node);
+            free_node(right);
+            return NULL;
+        }
+        left = node;
+    }
+    return left;
+}
+
+// list := { separator } [ and_or { separator and_or } ]
+// where a '&' separator also puts the preceding and_or list in the background.
+// Inside a compound command the list stops, unconsumed, at one of `terminators`.
+Node *parse_list(Lexer *lexer, const char *const *terminators) {
+    Node *list = new_node(NODE_LIST);
+    if (!list) return NULL;
+
+    while (lexer->status == PARSE_OK) {
+        Token *tok = lexer_peek(lexer);
+        if (tok->type == TOK_EOF) break;
+        if (tok->type == TOK_SEMI || tok->type == TOK_NEWLINE) {
+            lexer_skip(lexer);
+            continue;
+        }
+        if (tok->type == TOK_WORD && is_closing_reserved_word(tok->text)) {
+            bool expected = false;
+            for (int i = 0; terminators && terminators[i]; i++) {
+                if (strcmp(tok->text, terminators[i]) == 0) expected = true;
+            }
+            if (expected) break;
+            fail_near_token(lexer, tok, NULL);
+            break;
+        }
+        if (tok->type != TOK_WORD && !token_is_redirection(tok)) {
+            fail_near_token(lexer, tok, NULL);
+            break;
+        }
+
+        size_t start = tok->start;
+        Node *item = parse_and_or(lexer);
+        if (!item) break;
+        if (add_child_node(list, item) == -1) {
+            free_node(item);
+            break;
+        }
+        tok = lexer_peek(lexer);
+        if (tok->type == TOK_AMP) {
+            item->background = true;
+            if (!item->source_text) { // Job notices for a backgrounded && list or loop
+                size_t end = tok->start;
+                while (end > start && isspace((unsigned char)lexer->input[end - 1])) end--;
+                item->source_text = strndup(lexer->input + start, end - start);
+            }
+            lexer_skip(lexer);
+        } else if (tok->type == TOK_SEMI || tok->type == TOK_NEWLINE) {
+            lexer_skip(lexer);
+        } else if (tok->type != TOK_EOF && !(tok->type == TOK_WORD && is_closing_reserved_word(tok->text))) {
+            fail_near_token(lexer, tok, NULL);
+        }
+    }
+
+    if (lexer->status != PARSE_OK) {
+        free_node(list);
+        return NULL;
+    }
+    return list;
+}
+
+// Parse a whole script or command line. On failure returns NULL, with *status
+// telling a syntax error from input that merely stops early; the message and
+// line go to error_out/error_line when they are non-NULL.
+Node *parse_script(const char *text, ParseStatus *status, char *error_out, size_t error_size, int *error_line) {
+    Lexer lexer;
+    lexer_init(&lexer, text);
+    Node *root = parse_list(&lexer, NULL);
+    if (lexer.has_current) free(lexer.current.text);
+    if (!root && lexer.status == PARSE_OK) lexer_fail(&lexer, PARSE_ERROR, "out of memory");
+    *status = lexer.status;
+    if (error_out) snprintf(error_out, error_size, "%s", lexer.error);
+    if (error_line) *error_line = lexer.line;
+    return root;
+}
+
+void free_string_vector(char **vector) {
+    if (!vector) return;
+    for (int i = 0; vector[i] != NULL; i++) free(vector[i]);
+    free(vector);
+}
+
+// True if arg points into one of the segment's command substitution buffers
+bool arg_in_capture_storage(const CommandSegment *segment, const char *arg) {
+    for (const CaptureBuffer *capture = segment->arg_storage; capture; capture = capture->next) {
+        if (arg >= capture->data && arg <= capture->data + capture->length) return true;
+    }
+    return false;
+}
+
+void free_command_segment_internals(CommandSegment *segment) {
+    if (segment->args) {
+        for (int i = 0; segment->args[i] != NULL; i++) {
+            if (!arg_in_capture_storage(segment, segment->args[i])) free(segment->args[i]);
+        }
+        free(segment->args);
+        segment->args = NULL;
+    }
+    while (segment->arg_storage) {
+        CaptureBuffer *next = segment->arg_storage->next;
+        release_capture(segment->arg_storage);
+        free(segment->arg_storage);
+        segment->arg_storage = next;
+    }
+    segment->arg_count = 0;
+    segment->arg_capacity = 0;
+    if (segment->inputFile) {
+        free(segment->inputFile);
+        segment->inputFile = NULL;
+    }
+    free(segment->inputText);
+    segment->inputText = NULL;
+    if (segment->outputFile) {
+        free(segment->outputFile);
+        segment->outputFile = NULL;
+    }
+    free_string_vector(segment->assignments);
+    segment->assignments = NULL;
+    free(segment->spawn);
+    segment->spawn = NULL;
+}
+
+// Append arg itself (no copy) to the segment's argv, growing it as needed.
+// Returns 0 on success, -1 on allocation failure.
+int add_segment_arg_pointer(CommandSegment *segment, char *arg) {
+    if (segment->arg_count + 1 >= segment->arg_capacity) {
+        int new_capacity = segment->arg_capacity * 2;
+        char **grown = realloc(segment->args, new_capacity * sizeof(char*));
+        if (!grown) return -1;
+        segment->args = grown;
+        segment->arg_capacity = new_capacity;
+    }
+    segment->args[segment->arg_count++] = arg;
+    segment->args[segment->arg_count] = NULL;
+    return 0;
+}
+
+// Append a copy of arg to the segment's argv.
+// Returns 0 on success, -1 on allocation failure.
+int add_segment_arg(CommandSegment *segment, const char *arg) {
+    char *copy = strdup(arg);
+    if (!copy) return -1;
+    if (add_segment_arg_pointer(segment, copy) == -1) {
+        free(copy);
+        return -1;
+    }
+    return 0;
+}
+
+// True if a raw command word is a redirection operator stored by the parser
+bool is_redirection_word(const char *word) {
+    return strcmp(word, "<") == 0 || strcmp(word, ">") == 0 || strcmp(word, ">>") == 0 ||
+           strcmp(word, "<<") == 0 || strcmp(word, "<<<") == 0;
+}
+
+// True if a word needs glob(): '*', '?' or a [...] bracket expression.
+// A lone '[' or ']' (as in `[ $a = b ]`) is an ordinary word.
+bool has_glob_pattern(const char *word) {
+    if ((word[0] == '<' || word[0] == '>') && word[1] == '(') return false; // Process substitution
+    if (strstr(word, "$(") != NULL || strchr(word, '`') != NULL) return false; // Expanded later, not a pattern
+    if (strpbrk(word, "*?") != NULL) return true;
+    const char *open = strchr(word, '[');
+    return open != NULL && strchr(open + 1, ']') != NULL;
+}
+
+// Expand a here-document body (stored quoted by the parser) or a here-string
+// word into the segment's stdin text. A here-string gets a trailing newline.
+int set_segment_input_text(CommandSegment *segment, const char *word, bool here_string) {
+    expansion_failed = false;
+    char *expanded = expand_single_argument(word);
+    if (expansion_failed) return -1;
+    const char *text = expanded ? expanded : word;
+    size_t len = strlen(text);
+    char *copy = malloc(len + 2);
+    if (!copy) {
+        perror("sdn: malloc");
+        free(expanded);
+        return -1;
+    }
+    memcpy(copy, text, len);
+    if (here_string) copy[len++] = '\n';
+    copy[len] = '\0';
+    free(expanded);
+    free(segment->inputText);
+    segment->inputText = copy;
+    if (segment->inputFile) { // The last input redirection wins
+        free(segment->inputFile);
+        segment->inputFile = NULL;
+    }
+    return 0;
+}
+
+int start_process_substitution(const char *word);
+
+// The file a redirection opens: the word itself, or /dev/fd/N for `< <(cmd)`
+// and `> >(cmd)`. Returns a heap string, or NULL after reporting an error.
+char *redirection_target(const char *word) {
+    char path[32];
+    if (word_is_process_substitution(word)) {
+        int fd = start_process_substitution(word);
+        if (fd == -1) return NULL;
+        snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+        word = path;
+    }
+    char *target = strdup(word);
+    if (!target) perror("sdn: strdup error");
+    return target;
+}
+
+// Turn one command's raw words into a CommandSegment: pick out redirections
+// and expand wildcards. Variables are expanded afterwards by expand_variables_in_args().
+int build_segment_from_tokens(char **raw_tokens, int raw_token_count, CommandSegment *cmd_segment) {
+    // Initialize segment
+    cmd_segment->inputFile = NULL;
+    cmd_segment->inputText = NULL;
+    cmd_segment->outputFile = NULL;
+    cmd_segment->appendMode = 0;
+    cmd_segment->arg_count = 0;
+    cmd_segment->arg_capacity = MAX_ARGS;
+    cmd_segment->batch_start = -1;
+    cmd_segment->batch_end = -1;
+    cmd_segment->assignments = NULL;
+    cmd_segment->compound = NULL;
+    cmd_segment->arg_storage = NULL;
+    cmd_segment->spawn = NULL;
+    cmd_segment->args = calloc(cmd_segment->arg_capacity, sizeof(char*));
+    if (!cmd_segment->args) { perror("sdn: calloc error"); return -1; }
+
+    if (raw_token_count == 0) {
+        return 0; 
+    }
+
+    for (int i = 0; i < raw_token_count; ) {
+        char *current_raw_token = raw_tokens[i];
+
+        if (strcmp(current_raw_token, "<<") == 0 || strcmp(current_raw_token, "<<<") == 0) {
+            if (i + 1 < raw_token_count) {
+                if (set_segment_input_text(cmd_segment, raw_tokens[i + 1], current_raw_token[2] == '<') == -1) {
+                    free_command_segment_internals(cmd_segment); return -1;
+                }
+                i += 2;
+            } else {
+                fprintf(stderr, "sdn: syntax error near `%s'\n", current_raw_token);
                 free_command_segment_internals(cmd_segment); return -1;
             }
-        } else { // Command or argument
-            if (strpbrk(current_raw_token, "*?[]") != NULL) { // Has wildcards
-                glob_t glob_result;
-                memset(&glob_result, 0, sizeof(glob_result));
-                // GLOB_TILDE: Expands tilde.
-                // GLOB_NOCHECK: If pattern doesn't match, return pattern itself.
-                // GLOB_BRACE: Expands {a,b}
-                int glob_flags = GLOB_TILDE | GLOB_NOCHECK | GLOB_BRACE;
-                int ret = glob(current_raw_token, glob_flags, NULL, &glob_result);
+        } else if (strcmp(current_raw_token, "<") == 0) {
+            if (i + 1 < raw_token_count) {
+                if (cmd_segment->inputFile) free(cmd_segment->inputFile);
+                free(cmd_segment->inputText); // The last input redirection wins
+                cmd_segment->inputText = NULL;
+                cmd_segment->inputFile = redirection_target(raw_tokens[i + 1]);
+                if (!cmd_segment->inputFile) { free_command_segment_internals(cmd_segment); return -1; }
+                i += 2;
+            } else {
+                fprintf(stderr, "sdn: syntax error near `<'\n");
+                free_command_segment_internals(cmd_segment); return -1;
+            }
+        } else if (strcmp(current_raw_token, ">") == 0) {
+            if (i + 1 < raw_token_count) {
+                if (cmd_segment->outputFile) free(cmd_segment->outputFile);
+                cmd_segment->outputFile = redirection_target(raw_tokens[i + 1]);
+                if (!cmd_segment->outputFile) { free_command_segment_internals(cmd_segment); return -1; }
+                cmd_segment->appendMode = 0;
+                i += 2;
+            } else {
+                fprintf(stderr, "sdn: syntax error near `>'\n");
+                free_command_segment_internals(cmd_segment); return -1;
+            }
+        } else if (strcmp(current_raw_token, ">>") == 0) {
+            if (i + 1 < raw_token_count) {
+                if (cmd_segment->outputFile) free(cmd_segment->outputFile);
+                cmd_segment->outputFile = redirection_target(raw_tokens[i + 1]);
+                if (!cmd_segment->outputFile) { free_command_segment_internals(cmd_segment); return -1; }
+                cmd_segment->appendMode = 1;
+                i += 2;
+            } else {
+                fprintf(stderr, "sdn: syntax error near `>>'\n");
+                free_command_segment_internals(cmd_segment); return -1;
+            }
+        } else { // Command or argument
+            if (has_glob_pattern(current_raw_token)) { // Has wildcards
+                glob_t glob_result;
+                memset(&glob_result, 0, sizeof(glob_result));
+                // GLOB_TILDE: Expands tilde.
+                // GLOB_NOCHECK: If pattern doesn't match, return pattern itself.
+                // GLOB_BRACE: Expands {a,b}
+                int glob_flags = GLOB_TILDE | GLOB_NOCHECK | GLOB_BRACE;
+                double trace_start = trace_begin();
+                int ret = glob(current_raw_token, glob_flags, NULL, &glob_result);
+                trace_end("glob", trace_start, current_raw_token);
+
+                if (ret == 0) { // Success
+                    // Expanded words may exceed ARG_MAX; remember their range so argbatch can split it
+                    if (cmd_segment->batch_start == -1) cmd_segment->batch_start = cmd_segment->arg_count;
+                    for (size_t k = 0; k < glob_result.gl_pathc; k++) {
+                        if (add_segment_arg(cmd_segment, glob_result.gl_pathv[k]) == -1) {
+                            perror("sdn: strdup error");
+                            globfree(&glob_result);
+                            free_command_segment_internals(cmd_segment); return -1;
+                        }
+                    }
+                    cmd_segment->batch_end = cmd_segment->arg_count;
+                } else if (ret == GLOB_NOMATCH) { 
+                    // if (current_arg_idx < MAX_ARGS - 1) {
+                    //    cmd_segment->args[current_arg_idx++] = strdup(current_raw_token);
+                    // } else { /* error */ }
+                } else { // Other glob errors (GLOB_NOSPACE, GLOB_ABORTED)
+                    fprintf(stderr, "sdn: glob error for pattern '%s'\n", current_raw_token);
+                    globfree(&glob_result);
+                    free_command_segment_internals(cmd_segment); return -1;
+                }
+                globfree(&glob_result);
+                i++;
+            } else { // No wildcards
+                if (add_segment_arg(cmd_segment, current_raw_token) == -1) {
+                    perror("sdn: strdup error");
+                    free_command_segment_internals(cmd_segment); return -1;
+                }
+                i++;
+            }
+        }
+    }
+    if (cmd_segment->batch_start == -1) { // No expansion: everything after the command name may be split
+        cmd_segment->batch_start = cmd_segment->arg_count > 0 ? 1 : 0;
+        cmd_segment->batch_end = cmd_segment->arg_count;
+    }
+    return 0;
+}
+
+int handle_export_builtin(char **args) {
+    if (args[1] == NULL) {
+        // List all environment variables set by this shell instance (those in variable_table and also in environ)
+        // Or simply list all shell variables that have been exported.
+        // For simplicity now, list all shell variables and mark if they are in environ.
+        printf("Shell Variables (export VAR or VAR=value to set/export):\n");
+        for(int i=0; i<variable_count; ++i) {
+            const char* env_val = getenv(variable_table[i].name);
+            printf("  %s=%s%s\n", variable_table[i].name, variable_table[i].value, env_val ? " (exported)" : "");
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        char *arg_copy = strdup(args[i]);
+        if (!arg_copy) {
+            perror("sdn: strdup failed in export");
+            status = 1;
+            continue;
+        }
+
+        char *eq_ptr = strchr(arg_copy, '=');
+        char *var_name;
+        const char *var_value_str; // This will be the string representation of the value
+
+        if (eq_ptr != NULL) { // Case: export VAR=value
+            *eq_ptr = '\0'; // Split name and value
+            var_name = arg_copy;
+            var_value_str = eq_ptr + 1;
+            
+            // Unquote the value part if it's quoted
+            char temp_value_for_unquoting[MAX_VAR_VALUE_LEN];
+            strncpy(temp_value_for_unquoting, var_value_str, MAX_VAR_VALUE_LEN -1);
+            temp_value_for_unquoting[MAX_VAR_VALUE_LEN-1] = '\0';
+            unquote_string_in_place(temp_value_for_unquoting);
+
+            if (!is_valid_variable_name(var_name)) {
+                 fprintf(stderr, "sdn: export: '%s': not a valid identifier\n", var_name);
+                 status = 1;
+                 free(arg_copy);
+                 continue;
+            }
+            set_shell_variable(var_name, temp_value_for_unquoting); // Set/update in shell's internal table
+            // Use temp_value_for_unquoting for setenv as well
+            if (setenv(var_name, temp_value_for_unquoting, 1) != 0) {
+                perror("sdn: export: setenv failed");
+            }
+        } else { // Case: export VAR
+            var_name = arg_copy;
+            if (!is_valid_variable_name(var_name)) {
+                 fprintf(stderr, "sdn: export: '%s': not a valid identifier\n", var_name);
+                 status = 1;
+                 free(arg_copy);
+                 continue;
+            }
+            var_value_str = get_shell_variable(var_name); // Get from shell's internal table
+            if (var_value_str != NULL) {
+                if (setenv(var_name, var_value_str, 1) != 0) { // Value is already unquoted from table
+                    perror("sdn: export: setenv failed");
+                }
+            } else {
+                 // If not in shell variables, check if it's an environment variable already
+                 // If so, it's effectively "exported". If not, it's an error to export non-existent var.
+                if (getenv(var_name) == NULL) {
+                    fprintf(stderr, "sdn: export: variable '%s' not found in shell or environment\n", var_name);
+                    status = 1;
+                }
+                // If it exists in env but not shell, setenv will effectively re-export it or do nothing if value is same.
+                // No explicit action needed if it's already an env var but not a shell var.
+            }
+        }
+        free(arg_copy);
+    }
+    return status;
+}
+
+int handle_set_builtin(char **args) {
+    if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)) {
+        for (int i = 0; i < OPT_COUNT; i++) {
+            printf("  %-12s %-3s  %s\n", shell_options[i].name,
+                   shell_options[i].enabled ? "on" : "off", shell_options[i].description);
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i += 2) {
+        bool enable;
+        if (strcmp(args[i], "-o") == 0) {
+            enable = true;
+        } else if (strcmp(args[i], "+o") == 0) {
+            enable = false;
+        } else {
+            fprintf(stderr, "sdn: set: usage: set [-o|+o option ...]\n");
+            return 1;
+        }
+        if (args[i + 1] == NULL) {
+            fprintf(stderr, "sdn: set: %s: option name required\n", args[i]);
+            return 1;
+        }
+        int found = 0;
+        for (int j = 0; j < OPT_COUNT; j++) {
+            if (strcmp(shell_options[j].name, args[i + 1]) == 0) {
+                shell_options[j].enabled = enable;
+                if (j == OPT_TRACEPERF) { // Each `set -o trace-perf` starts a fresh trace file
+                    close_trace_file();
+                    if (enable && !open_trace_file()) status = 1;
+                }
+                found = 1;
+                break;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "sdn: set: %s: invalid option name\n", args[i + 1]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+int handle_cd_builtin(char **args) {
+    char target_dir[FILENAME_MAX];
+    if (args[1] == NULL) {
+        char *home_dir = getenv("HOME");
+        if (home_dir) {
+            strncpy(target_dir, home_dir, FILENAME_MAX -1);
+            target_dir[FILENAME_MAX-1] = '\0';
+        } else {
+            fprintf(stderr, "sdn: cd: HOME not set\n");
+            return 1;
+        }
+    } else {
+        strncpy(target_dir, args[1], FILENAME_MAX -1);
+        target_dir[FILENAME_MAX-1] = '\0';
+    }
+
+    // Resolve .. against the logical directory, so `cd link/..` returns to where we were
+    char logical[FILENAME_MAX * 2];
+    const char *pwd = target_dir[0] == '/' ? NULL : current_directory();
+    if (target_dir[0] == '/' || !pwd) snprintf(logical, sizeof(logical), "%s", target_dir);
+    else snprintf(logical, sizeof(logical), "%s/%s", pwd, target_dir);
+    if (logical[0] == '/') normalize_path(logical);
+
+    if (logical[0] == '/' && strlen(logical) < sizeof(shell_pwd) && chdir(logical) == 0) {
+        set_shell_pwd(logical);
+    } else if (chdir(target_dir) == 0) { // The logical path does not exist physically
+        shell_pwd[0] = '\0';
+    } else {
+        perror("sdn: cd failed");
+        return 1;
+    }
+    const char *new_cwd = current_directory();
+    if (new_cwd) {
+        load_local_aliases(new_cwd); // Cached: only stats unless an alias file changed
+    } else {
+        perror("sdn: getcwd failed after cd");
+        forget_local_aliases(); // Those of the old directory no longer apply
+    }
+    return 0;
+}
+
+// Resolve a job spec: %N, %+/%% (most recent), or no argument (most recent)
+Job *resolve_job_spec(const char *spec, const char *builtin_name) {
+    Job *latest = NULL;
+    for (Job *j = job_list; j; j = j->next) latest = j;
+
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        if (!latest) fprintf(stderr, "sdn: %s: no current job\n", builtin_name);
+        return latest;
+    }
+    const char *number = spec[0] == '%' ? spec + 1 : spec;
+    Job *job = find_job_by_id(atoi(number));
+    if (!job) fprintf(stderr, "sdn: %s: %s: no such job\n", builtin_name, spec);
+    return job;
+}
+
+int handle_jobs_builtin(char **args) {
+    (void)args;
+    reap_children();
+    for (Job *j = job_list; j; j = j->next) {
+        char state[64];
+        format_job_state(j, state, sizeof(state));
+        printf("[%d]  %-8d %-24s %s\n", j->id, (int)j->pgid, state, j->command);
+        if (job_is_completed(j)) j->notified = false; // Still announced once at the prompt
+    }
+    return 0;
+}
+
+int handle_fg_builtin(char **args) {
+    Job *job = resolve_job_spec(args[1], "fg");
+    if (!job) return 1;
+    printf("%s\n", job->command);
+    fflush(stdout);
+    return run_job_in_foreground(job, true);
+}
+
+int handle_bg_builtin(char **args) {
+    Job *job = resolve_job_spec(args[1], "bg");
+    if (!job) return 1;
+    for (int i = 0; i < job->num_procs; i++) job->procs[i].stopped = false;
+    job->background = true;
+    job->notified = false;
+    kill(-job->pgid, SIGCONT);
+    printf("[%d]  %s &\n", job->id, job->command);
+    return 0;
+}
+
+// wait [%N|pid ...]: without arguments, wait for every running background job
+int handle_wait_builtin(char **args) {
+    int status = 0;
+    if (args[1] == NULL) {
+        for (Job *j = job_list; j; j = j->next) {
+            if (job_is_stopped(j) && !job_is_completed(j)) continue;
+            wait_for_job(j);
+            status = job_exit_status(j);
+        }
+        return status;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        Job *job;
+        if (args[i][0] == '%') {
+            job = resolve_job_spec(args[i], "wait");
+        } else {
+            job = find_job_by_pid((pid_t)atoi(args[i]));
+            if (!job) fprintf(stderr, "sdn: wait: pid %s is not a child of this shell\n", args[i]);
+        }
+        if (!job) {
+            status = 127;
+            continue;
+        }
+        wait_for_job(job);
+        status = job_exit_status(job);
+    }
+    return status;
+}
+
+int handle_exit_builtin(char **args) {
+    exit_requested = true;
+    return args[1] ? atoi(args[1]) : last_exit_status;
+}
+
+// history                         list everything, as before
+// history [options] [text...]     lines whose command contains text
+//   -e regex   match an extended regular expression instead
+//   -i         ignore case        -f  only commands that failed
+//   -d dir     run in dir or below it
+//   --since time, --until time    "2h", "7d", "1w" ago or "YYYY-MM-DD[ HH:MM[:SS]]"
+//   -n N       only the last N matches     -l  show status, duration and directory
+// history --compact [--since time]  drop repeated commands, and lines before time
+int handle_history_builtin(char **args) {
+    if (args[1] == NULL) return display_history();
+
+    HistoryQuery query;
+    memset(&query, 0, sizeof(query));
+    query.since = query.until = -1;
+    const char *pattern = NULL;
+    bool compact = false;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *arg = args[i];
+        if (strcmp(arg, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(arg, "--compact") == 0) {
+            compact = true;
+            continue;
+        }
+        if (strcmp(arg, "--since") == 0 || strcmp(arg, "--until") == 0) {
+            time_t *bound = arg[2] == 's' ? &query.since : &query.until;
+            if (!args[i + 1] || !parse_history_time_arg(args[i + 1], bound)) {
+                fprintf(stderr, "sdn: history: %s: expected a time like `2h', `7d' or `2024-01-31 09:00'\n", arg);
+                return 2;
+            }
+            i++;
+            continue;
+        }
+        for (const char *flag = arg + 1; *flag; flag++) {
+            if (*flag == 'i') query.ignore_case = true;
+            else if (*flag == 'f') query.failed_only = true;
+            else if (*flag == 'l') query.long_format = true;
+            else if (strchr("end", *flag)) {
+                const char *value = flag[1] ? flag + 1 : args[++i];
+                if (!value) {
+                    fprintf(stderr, "sdn: history: -%c needs an argument\n", *flag);
+                    return 2;
+                }
+                if (*flag == 'e') {
+                    pattern = value;
+                } else if (*flag == 'n') {
+                    query.limit = atoi(value);
+                    if (query.limit <= 0) {
+                        fprintf(stderr, "sdn: history: -n needs a positive number\n");
+                        return 2;
+                    }
+                } else {
+                    const char *cwd = value[0] == '/' ? NULL : current_directory();
+                    snprintf(query.directory, sizeof(query.directory), "%s%s%s", cwd ? cwd : "", cwd ? "/" : "", value);
+                    normalize_path(query.directory);
+                }
+                break;
+            } else {
+                fprintf(stderr, "sdn: history: usage: history [-fil] [-n N] [-d dir] [-e regex] "
+                                "[--since time] [--until time] [text ...]\n"
+                                "       history --compact [--since time]\n");
+                return 2;
+            }
+        }
+    }
+
+    // The remaining words are one substring, so `history git push` works unquoted
+    char text[MAX_LINE] = "";
+    size_t length = 0;
+    for (; args[i] && length < sizeof(text) - 1; i++) {
+        length += snprintf(text + length, sizeof(text) - length, "%s%s", length ? " " : "", args[i]);
+    }
+    if (text[0]) query.text = text;
+    if (compact) {
+        if (query.text || pattern || query.directory[0] || query.until != -1 || query.failed_only || query.limit) {
+            fprintf(stderr, "sdn: history: --compact only takes --since\n");
+            return 2;
+        }
+        return compact_history(query.since, true) == -1;
+    }
+
+    regex_t regex;
+    if (pattern) {
+        int error = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB | (query.ignore_case ? REG_ICASE : 0));
+        if (error != 0) {
+            char message[128];
+            regerror(error, &regex, message, sizeof(message));
+            fprintf(stderr, "sdn: history: %s: %s\n", pattern, message);
+            return 2;
+        }
+        query.regex = &regex;
+        regex_required_literal(pattern, query.regex_literal, sizeof(query.regex_literal));
+    }
+    int found = query_history(&query, stdout);
+    if (pattern) regfree(&regex);
+    return found > 0 ? 0 : 1;
+}
+
+int handle_true_builtin(char **args) {
+    (void)args;
+    return 0;
+}
+
+int handle_false_builtin(char **args) {
+    (void)args;
+    return 1;
+}
+
+// break [n] and continue [n]: unwind n enclosing loops
+int request_loop_jump(char **args, int *levels) {
+    if (loop_depth == 0) {
+        fprintf(stderr, "sdn: %s: only meaningful in a loop\n", args[0]);
+        return 0;
+    }
+    int count = 1;
+    if (args[1] != NULL) {
+        char *end;
+        count = (int)strtol(args[1], &end, 10);
+        if (*end != '\0' || count < 1) {
+            fprintf(stderr, "sdn: %s: %s: loop count out of range\n", args[0], args[1]);
+            return 1;
+        }
+    }
+    *levels = count < loop_depth ? count : loop_depth;
+    return 0;
+}
+
+int handle_break_builtin(char **args) {
+    return request_loop_jump(args, &break_levels);
+}
+
+int handle_continue_builtin(char **args) {
+    return request_loop_jump(args, &continue_levels);
+}
+
+int handle_return_builtin(char **args) {
+    if (function_depth == 0) {
+        fprintf(stderr, "sdn: return: can only `return' from a function\n");
+        return 1;
+    }
+    return_requested = true;
+    return args[1] ? atoi(args[1]) : last_exit_status;
+}
+
+// --- test / [ ---
+// Recursive descent over the argument vector:
+//   or := and { '-o' and }   and := not { '-a' not }   not := '!' not | primary
+//   primary := '(' or ')' | unary-op arg | arg binary-op arg | arg
+
+typedef struct {
+    char **args;
+    int count;
+    int pos;
+    bool failed;
+} TestParser;
+
+bool test_or(TestParser *tp);
+
+bool test_integer(TestParser *tp, const char *text, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || errno == ERANGE) {
+        fprintf(stderr, "sdn: test: %s: integer expression expected\n", text);
+        tp->failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool test_unary(const char *op, const char *operand) {
+    struct stat st;
+    switch (op[1]) {
+        case 'n': return operand[0] != '\0';
+        case 'z': return operand[0] == '\0';
+        case 'e': return stat(operand, &st) == 0;
+        case 'f': return stat(operand, &st) == 0 && S_ISREG(st.st_mode);
+        case 'd': return stat(operand, &st) == 0 && S_ISDIR(st.st_mode);
+        case 's': return stat(operand, &st) == 0 && st.st_size > 0;
+        case 'h':
+        case 'L': return lstat(operand, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(operand, R_OK) == 0;
+        case 'w': return access(operand, W_OK) == 0;
+        case 'x': return access(operand, X_OK) == 0;
+    }
+    return false;
+}
+
+bool is_test_unary_op(const char *word) {
+    return word[0] == '-' && word[1] != '\0' && word[2] == '\0' && strchr("nzefdshLrwx", word[1]);
+}
+
+bool is_test_binary_op(const char *word) {
+    static const char *const ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL};
+    for (int i = 0; ops[i]; i++) {
+        if (strcmp(word, ops[i]) == 0) return true;
+    }
+    return false;
+}
+
+bool test_binary(TestParser *tp, const char *lhs, const char *op, const char *rhs) {
+    if (op[0] != '-') {
+        int cmp = strcmp(lhs, rhs);
+        if (op[0] == '!') return cmp != 0;
+        if (op[0] == '<') return cmp < 0;
+        if (op[0] == '>') return cmp > 0;
+        return cmp == 0;
+    }
+    long long a, b;
+    if (!test_integer(tp, lhs, &a) || !test_integer(tp, rhs, &b)) return false;
+    if (strcmp(op, "-eq") == 0) return a == b;
+    if (strcmp(op, "-ne") == 0) return a != b;
+    if (strcmp(op, "-lt") == 0) return a < b;
+    if (strcmp(op, "-le") == 0) return a <= b;
+    if (strcmp(op, "-gt") == 0) return a > b;
+    return a >= b;
+}
+
+bool test_primary(TestParser *tp) {
+    if (tp->pos >= tp->count) {
+        tp->failed = true;
+        return false;
+    }
+    char **args = tp->args;
+    int left = tp->count - tp->pos;
+    if (left >= 3 && is_test_binary_op(args[tp->pos + 1])) {
+        bool result = test_binary(tp, args[tp->pos], args[tp->pos + 1], args[tp->pos + 2]);
+        tp->pos += 3;
+        return result;
+    }
+    if (strcmp(args[tp->pos], "(") == 0 && left >= 2) {
+        tp->pos++;
+        bool result = test_or(tp);
+        if (tp->pos >= tp->count || strcmp(args[tp->pos], ")") != 0) {
+            tp->failed = true;
+            return false;
+        }
+        tp->pos++;
+        return result;
+    }
+    if (left >= 2 && is_test_unary_op(args[tp->pos])) {
+        bool result = test_unary(args[tp->pos], args[tp->pos + 1]);
+        tp->pos += 2;
+        return result;
+    }
+    return args[tp->pos++][0] != '\0'; // A lone string is true when non-empty
+}
+
+bool test_not(TestParser *tp) {
+    // "!" followed by nothing is just the non-empty string "!"
+    int left = tp->count - tp->pos;
+    if (left >= 2 && strcmp(tp->args[tp->pos], "!") == 0 &&
+        !(left >= 3 && is_test_binary_op(tp->args[tp->pos + 1]))) {
+        tp->pos++;
+        return !test_not(tp);
+    }
+    return test_primary(tp);
+}
+
+bool test_and(TestParser *tp) {
+    bool result = test_not(tp);
+    while (!tp->failed && tp->pos < tp->count && strcmp(tp->args[tp->pos], "-a") == 0) {
+        tp->pos++;
+        bool rhs = test_not(tp);
+        result = result && rhs;
+    }
+    return result;
+}
+
+bool test_or(TestParser *tp) {
+    bool result = test_and(tp);
+    while (!tp->failed && tp->pos < tp->count && strcmp(tp->args[tp->pos], "-o") == 0) {
+        tp->pos++;
+        bool rhs = test_and(tp);
+        result = result || rhs;
+    }
+    return result;
+}
+
+// test EXPR and [ EXPR ]: status 0 if true, 1 if false, 2 on a malformed expression
+int handle_test_builtin(char **args) {
+    int count = 0;
+    while (args[count] != NULL) count++;
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[count - 1], "]") != 0) {
+            fprintf(stderr, "sdn: [: missing `]'\n");
+            return 2;
+        }
+        count--;
+    }
+    TestParser tp = {args + 1, count - 1, 0, false};
+    if (tp.count == 0) return 1;
+    bool result = test_or(&tp);
+    if (!tp.failed && tp.pos != tp.count) {
+        fprintf(stderr, "sdn: %s: %s: unexpected argument\n", args[0], tp.args[tp.pos]);
+        return 2;
+    }
+    if (tp.failed) {
+        if (tp.pos >= tp.count) fprintf(stderr, "sdn: %s: argument expected\n", args[0]);
+        return 2;
+    }
+    return result ? 0 : 1;
+}
+
+// --- Functions ---
+// A function keeps a reference to its body in the parse tree, so the tree
+// that defined it may be freed (e.g. after an interactive line) while it lives on.
+// A running call holds one too, so a function that redefines itself
+// (`f() { f() { ...; }; echo old; }`) finishes on the body it started with.
+
+#define MAX_FUNCTION_DEPTH 1000
+
+typedef struct {
+    char *name;
+    Node *body;
+} FunctionEntry;
+
+FunctionEntry *function_table = NULL;
+int function_count = 0;
+
+Node *find_function(const char *name) {
+    for (int i = 0; i < function_count; i++) {
+        if (strcmp(function_table[i].name, name) == 0) {
+            return function_table[i].body;
+        }
+    }
+    return NULL;
+}
+
+int define_function(const char *name, Node *body) {
+    body->refs++;
+    for (int i = 0; i < function_count; i++) {
+        if (strcmp(function_table[i].name, name) == 0) {
+            free_node(function_table[i].body);
+            function_table[i].body = body;
+            return 0;
+        }
+    }
+    FunctionEntry *grown = realloc(function_table, (function_count + 1) * sizeof(FunctionEntry));
+    char *name_copy = strdup(name);
+    if (!grown || !name_copy) {
+        if (grown) function_table = grown;
+        free(name_copy);
+        free_node(body);
+        perror("sdn: define function");
+        return 1;
+    }
+    function_table = grown;
+    function_table[function_count].name = name_copy;
+    function_table[function_count].body = body;
+    function_count++;
+    return 0;
+}
+
+int execute_node(Node *node);
+
+// Run a function with args[1..] as its positional parameters; $0 is unchanged
+int call_function(Node *body, char **args) {
+    if (function_depth >= MAX_FUNCTION_DEPTH) {
+        fprintf(stderr, "sdn: %s: maximum function nesting depth exceeded\n", args[0]);
+        return 1;
+    }
+    int argc = 0;
+    while (args[argc] != NULL) argc++;
+    char **params = malloc((argc + 1) * sizeof(char*));
+    if (!params) {
+        perror("sdn: malloc");
+        return 1;
+    }
+    params[0] = positional_count > 0 ? positional_params[0] : args[0];
+    for (int i = 1; i <= argc; i++) params[i] = args[i];
+
+    char **saved_params = positional_params;
+    int saved_count = positional_count;
+    int saved_loop_depth = loop_depth;
+    positional_params = params;
+    positional_count = argc;
+    loop_depth = 0; // break and continue do not reach the caller's loops
+    function_depth++;
+    body->refs++;
+
+    int status = execute_node(body);
+    if (return_requested) {
+        return_requested = false;
+        status = last_exit_status;
+    }
+
+    free_node(body);
+    function_depth--;
+    loop_depth = saved_loop_depth;
+    positional_params = saved_params;
+    positional_count = saved_count;
+    free(params);
+    return last_exit_status = status;
+}
+
+// --- File copying builtins ---
+// cat and tee run without exec, and move data with copy_file_range(),
+// splice() or sendfile() so it does not pass through user space. Each
+// falls back to read()/write() where the kernel refuses a pairing.
+
+#define COPY_CHUNK_SIZE (1 << 20) // Bytes per zero-copy call; Ctrl+C is checked between calls
+
+// Write all of buffer to fd. Returns 0 on success, -1 on error.
+int write_all(int fd, const char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buffer, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copy everything readable from in_fd to out_fd, picking the cheapest
+// mechanism for the two file types. Returns 0 on success, -1 with errno set.
+int copy_fd_contents(int in_fd, int out_fd) {
+    struct stat in_stat, out_stat;
+    if (fstat(in_fd, &in_stat) == -1 || fstat(out_fd, &out_stat) == -1) return -1;
+
+    enum { COPY_RANGE, COPY_SPLICE, COPY_SENDFILE, COPY_READ_WRITE } method = COPY_READ_WRITE;
+    if (S_ISREG(in_stat.st_mode) && S_ISREG(out_stat.st_mode)) {
+        method = COPY_RANGE;
+    } else if (S_ISFIFO(in_stat.st_mode) || S_ISFIFO(out_stat.st_mode)) {
+        method = COPY_SPLICE;
+    } else if (S_ISREG(in_stat.st_mode)) {
+        method = COPY_SENDFILE;
+    }
+
+    char *buffer = NULL;
+    while (!interrupt_pending) {
+        ssize_t n;
+        switch (method) {
+            case COPY_RANGE: n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0); break;
+            case COPY_SPLICE: n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE); break;
+            case COPY_SENDFILE: n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE); break;
+            default:
+                if (!buffer && !(buffer = malloc(65536))) return -1;
+                n = read(in_fd, buffer, 65536);
+                if (n > 0 && write_all(out_fd, buffer, n) == -1) n = -1;
+                break;
+        }
+        if (n == 0) break;
+        if (n > 0) continue;
+        if (errno == EINTR) continue;
+        // Cross-device, O_APPEND, unsupported file system or old kernel: copy by hand from where this stopped
+        if (method != COPY_READ_WRITE && (errno == EXDEV || errno == EINVAL || errno == EBADF ||
+                                          errno == ENOSYS || errno == EOPNOTSUPP)) {
+            method = COPY_READ_WRITE;
+            continue;
+        }
+        free(buffer);
+        return -1;
+    }
+    free(buffer);
+    if (interrupt_pending) {
+        errno = EINTR;
+        return -1;
+    }
+    return 0;
+}
+
+// True if path is a regular file, so opening and reading it cannot block
+bool is_regular_path(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Only plain `cat [file|-]...` of regular files is built in; options, or a
+// FIFO, socket, device or the terminal (which must stay interruptible), go
+// to the real cat. So do missing files, which the real cat reports.
+bool cat_builtin_handles(char **args) {
+    bool reads_stdin = args[1] == NULL;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-") == 0) reads_stdin = true;
+        else if (args[i][0] == '-' || !is_regular_path(args[i])) return false;
+    }
+    return !(reads_stdin && isatty(STDIN_FILENO));
+}
+
+int handle_cat_builtin(char **args) {
+    fflush(stdout); // Output goes straight to fd 1
+    int status = 0;
+    char *stdin_only[] = {"-", NULL};
+    char **files = args[1] ? args + 1 : stdin_only;
+    for (int i = 0; files[i] != NULL && !interrupt_pending; i++) {
+        bool from_stdin = strcmp(files[i], "-") == 0;
+        int fd = from_stdin ? STDIN_FILENO : open(files[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "sdn: cat: %s: %s\n", files[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (copy_fd_contents(fd, STDOUT_FILENO) == -1 && errno != EINTR) {
+            fprintf(stderr, "sdn: cat: %s: %s\n", files[i], strerror(errno));
+            status = 1;
+        }
+        if (!from_stdin) close(fd);
+    }
+    return interrupt_pending ? 130 : status;
+}
+
+// Built in for `tee [-a] [file...]` when stdin is not the terminal
+bool tee_builtin_handles(char **args) {
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-' && strcmp(args[i], "-a") != 0) return false;
+    }
+    return !isatty(STDIN_FILENO);
+}
+
+// With stdin and stdout both pipes and at most one file, tee(2) duplicates
+// each chunk into stdout and splice() then moves the same bytes into the file.
+// Returns 0 on success, 1 if the kernel refused before anything was copied
+// (the caller then falls back), -1 on error.
+int tee_with_splice(int file_fd) {
+    bool started = false;
+    bool use_splice = true;
+    while (!interrupt_pending) {
+        ssize_t n = file_fd == -1 ? splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE)
+                                  : tee(STDIN_FILENO, STDOUT_FILENO, COPY_CHUNK_SIZE, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return started || errno != EINVAL ? -1 : 1;
+        if (n == 0) break;
+        started = true;
+        // Consume exactly what was duplicated, moving it into the file
+        for (ssize_t left = n; left > 0 && file_fd != -1; ) {
+            ssize_t moved = use_splice ? splice(STDIN_FILENO, NULL, file_fd, NULL, left, SPLICE_F_MOVE) : -1;
+            if (use_splice && moved == -1 && errno == EINTR) continue;
+            if (moved == -1 && (!use_splice || errno == EINVAL)) { // O_APPEND files refuse splice(); copy the rest
+                use_splice = false;
+                char buffer[65536];
+                moved = read(STDIN_FILENO, buffer, left < (ssize_t)sizeof(buffer) ? left : (ssize_t)sizeof(buffer));
+                if (moved > 0 && write_all(file_fd, buffer, moved) == -1) return -1;
+            }
+            if (moved <= 0) return -1;
+            left -= moved;
+        }
+    }
+    return 0;
+}
+
+int handle_tee_builtin(char **args) {
+    fflush(stdout);
+    bool append = false;
+    int file_count = 0;
+    int argc = 0;
+    while (args[argc] != NULL) argc++;
+    int *fds = calloc(argc, sizeof(int)); // At most one per operand
+    if (!fds) {
+        perror("sdn: tee");
+        return 1;
+    }
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-a") == 0) {
+            append = true;
+            continue;
+        }
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-a") == 0) continue;
+        int fd = open(args[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+        if (fd == -1) {
+            fprintf(stderr, "sdn: tee: %s: %s\n", args[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        fds[file_count++] = fd;
+    }
+
+    struct stat in_stat, out_stat;
+    int ret = 1;
+    if (file_count <= 1 && fstat(STDIN_FILENO, &in_stat) == 0 && fstat(STDOUT_FILENO, &out_stat) == 0 &&
+        S_ISFIFO(in_stat.st_mode) && S_ISFIFO(out_stat.st_mode)) {
+        ret = tee_with_splice(file_count == 1 ? fds[0] : -1);
+    }
+    if (ret == 1) { // One read, then a write to every output
+        char *buffer = malloc(65536);
+        ret = buffer ? 0 : -1;
+        while (buffer && !interrupt_pending) {
+            ssize_t n = read(STDIN_FILENO, buffer, 65536);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n == -1) ret = -1;
+                break;
+            }
+            if (write_all(STDOUT_FILENO, buffer, n) == -1) {
+                ret = -1;
+                break;
+            }
+            for (int i = 0; i < file_count; i++) {
+                if (fds[i] != -1 && write_all(fds[i], buffer, n) == -1) {
+                    perror("sdn: tee");
+                    close(fds[i]);
+                    fds[i] = -1;
+                    status = 1;
+                }
+            }
+        }
+        free(buffer);
+    }
+    if (ret == -1 && errno != EPIPE) {
+        perror("sdn: tee");
+        status = 1;
+    }
+    for (int i = 0; i < file_count; i++) {
+        if (fds[i] != -1) close(fds[i]);
+    }
+    free(fds);
+    return interrupt_pending ? 130 : status;
+}
+
+// --- Spawn attributes: ulimit, nice, ionice, taskset ---
+// Followed by a command, each of these is a prefix modifier: the parent
+// strips it from argv into the segment's SpawnAttrs and the child applies
+// them between fork and exec, so `nice -n 10 ionice -c 3 make` costs one
+// exec, not three. On its own it applies to the shell itself, and so to
+// everything started afterwards in the session.
+
+#define MAX_SPAWN_LIMITS 16
+
+typedef struct SpawnAttrs {
+    bool set_nice;
+    int nice_increment;
+    bool set_ioprio;
+    int ioprio_class; // 1 realtime, 2 best-effort, 3 idle
+    int ioprio_level;
+    bool set_affinity;
+    cpu_set_t cpus;
+    int limit_count;
+    struct {
+        int resource;
+        rlim_t value;
+        bool soft;
+        bool hard;
+    } limits[MAX_SPAWN_LIMITS];
+} SpawnAttrs;
+
+// Returned by a modifier parser for an option form it does not implement
+// (`taskset -p PID`); the real program runs instead.
+#define SPAWN_UNSUPPORTED -2
+
+typedef enum {
+    SPAWN_PARSE_QUIET,    // Only find where the command starts
+    SPAWN_PARSE_MODIFIER, // Prefixing a command: report errors
+    SPAWN_PARSE_SHELL,    // Run on its own: report errors and print queried values
+} SpawnParseMode;
+
+typedef struct {
+    char option;
+    int resource;
+    rlim_t unit; // Bytes per unit of the value, as in bash
+    const char *description;
+} LimitOption;
+
+const LimitOption limit_options[] = {
+    {'c', RLIMIT_CORE, 512, "core file size (blocks)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (kbytes)"},
+    {'f', RLIMIT_FSIZE, 512, "file size (blocks)"},
+    {'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)"},
+    {'m', RLIMIT_RSS, 1024, "max memory size (kbytes)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (kbytes)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (kbytes)"},
+};
+#define LIMIT_OPTION_COUNT (int)(sizeof(limit_options) / sizeof(limit_options[0]))
+
+// Parse a CPU list such as "0,4" or "2-3" (sysfs and taskset -c syntax) into a set
+void parse_cpu_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list) {
+        char *end;
+        long first = strtol(list, &end, 10);
+        if (end == list) break;
+        long last = first;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, set);
+        list = *end == ',' ? end + 1 : end;
+        if (*list == '\n') break;
+    }
+}
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+// Apply attrs to the calling process. Returns 0, or -1 after reporting the first failure.
+int apply_spawn_attrs(const SpawnAttrs *attrs) {
+    for (int i = 0; i < attrs->limit_count; i++) {
+        struct rlimit limit;
+        getrlimit(attrs->limits[i].resource, &limit);
+        if (attrs->limits[i].soft) limit.rlim_cur = attrs->limits[i].value;
+        if (attrs->limits[i].hard) limit.rlim_max = attrs->limits[i].value;
+        if (setrlimit(attrs->limits[i].resource, &limit) == -1) {
+            perror("sdn: ulimit");
+            return -1;
+        }
+    }
+    if (attrs->set_nice) {
+        errno = 0;
+        if (nice(attrs->nice_increment) == -1 && errno != 0) {
+            perror("sdn: nice");
+            return -1;
+        }
+    }
+    if (attrs->set_ioprio &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                (attrs->ioprio_class << IOPRIO_CLASS_SHIFT) | attrs->ioprio_level) == -1) {
+        perror("sdn: ionice");
+        return -1;
+    }
+    if (attrs->set_affinity && sched_setaffinity(0, sizeof(attrs->cpus), &attrs->cpus) == -1) {
+        perror("sdn: taskset");
+        return -1;
+    }
+    return 0;
+}
+
+void spawn_error(SpawnParseMode mode, const char *format, ...) {
+    if (mode == SPAWN_PARSE_QUIET) return;
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+}
+
+void print_limit(rlim_t value, rlim_t unit) {
+    if (value == RLIM_INFINITY) printf("unlimited\n");
+    else printf("%llu\n", (unsigned long long)(value / unit));
+}
+
+// Record a limit to set; value is a count of `unit`s or "unlimited"
+int add_spawn_limit(SpawnAttrs *attrs, int resource, const char *value, rlim_t unit, bool soft, bool hard,
+                    SpawnParseMode mode) {
+    if (attrs->limit_count == MAX_SPAWN_LIMITS) {
+        spawn_error(mode, "sdn: ulimit: too many limits\n");
+        return -1;
+    }
+    attrs->limits[attrs->limit_count].resource = resource;
+    attrs->limits[attrs->limit_count].value = strcmp(value, "unlimited") == 0 ? RLIM_INFINITY :
+                                              strtoull(value, NULL, 10) * unit;
+    attrs->limits[attrs->limit_count].soft = soft;
+    attrs->limits[attrs->limit_count].hard = hard;
+    attrs->limit_count++;
+    return 0;
+}
+
+bool is_limit_value(const char *word) {
+    if (strcmp(word, "unlimited") == 0) return true;
+    if (!isdigit((unsigned char)word[0])) return false;
+    while (isdigit((unsigned char)*word)) word++;
+    return *word == '\0';
+}
+
+// ulimit [-SH] [-a] [-cdflmnstuv [value]]... [value] [command...]
+// Limits with values go into attrs; queried ones are printed in shell mode.
+// Each parser returns the index of the command word (NULL if none), or -1.
+int parse_ulimit_modifier(char **args, SpawnAttrs *attrs, SpawnParseMode mode) {
+    bool soft_only = false, hard_only = false;
+    bool print = mode == SPAWN_PARSE_SHELL;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        for (const char *flag = args[i] + 1; *flag; flag++) {
+            if (*flag == 'S' || *flag == 'H') {
+                soft_only = *flag == 'S';
+                hard_only = *flag == 'H';
+                continue;
+            }
+            if (*flag == 'a') {
+                for (int k = 0; k < LIMIT_OPTION_COUNT && print; k++) {
+                    struct rlimit limit;
+                    getrlimit(limit_options[k].resource, &limit);
+                    printf("%-28s(-%c) ", limit_options[k].description, limit_options[k].option);
+                    print_limit(hard_only ? limit.rlim_max : limit.rlim_cur, limit_options[k].unit);
+                }
+                continue;
+            }
+            int k = 0;
+            while (k < LIMIT_OPTION_COUNT && limit_options[k].option != *flag) k++;
+            if (k == LIMIT_OPTION_COUNT) {
+                spawn_error(mode, "sdn: ulimit: -%c: invalid option\n", *flag);
+                return -1;
+            }
+            if (flag[1] == '\0' && args[i + 1] && is_limit_value(args[i + 1])) {
+                if (add_spawn_limit(attrs, limit_options[k].resource, args[++i], limit_options[k].unit,
+                                    !hard_only, !soft_only, mode) == -1) return -1;
+                break;
+            }
+            if (mode != SPAWN_PARSE_SHELL && args[i + 1]) {
+                spawn_error(mode, "sdn: ulimit: -%c needs a value before a command\n", *flag);
+                return -1;
+            }
+            if (print) {
+                struct rlimit limit;
+                getrlimit(limit_options[k].resource, &limit);
+                print_limit(hard_only ? limit.rlim_max : limit.rlim_cur, limit_options[k].unit);
+            }
+        }
+    }
+    if (args[i] && is_limit_value(args[i])) { // A bare value sets the file size limit, like sh
+        if (add_spawn_limit(attrs, RLIMIT_FSIZE, args[i], 512, !hard_only, !soft_only, mode) == -1) return -1;
+        i++;
+    } else if (i == 1 && !args[1] && print) {
+        struct rlimit limit;
+        getrlimit(RLIMIT_FSIZE, &limit);
+        print_limit(limit.rlim_cur, 512);
+    }
+    return i;
+}
+
+// Parse a whole decimal integer, as the real nice and ionice require
+bool parse_spawn_number(const char *text, int *value) {
+    char *end;
+    errno = 0;
+    long number = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || number < INT_MIN || number > INT_MAX) return false;
+    *value = (int)number;
+    return true;
+}
+
+// Match args[*i] against -X VALUE, -XVALUE, --long VALUE or --long=VALUE.
+// Returns the value and moves *i past it, or NULL if the option is not there.
+const char *spawn_option_value(char **args, int *i, char short_name, const char *long_name) {
+    const char *arg = args[*i];
+    size_t long_length = strlen(long_name);
+    const char *value = NULL;
+    if (arg[0] == '-' && arg[1] == short_name) {
+        value = arg[2] ? arg + 2 : args[*i + 1];
+        *i += arg[2] ? 1 : 2;
+    } else if (strncmp(arg, long_name, long_length) == 0 && (arg[long_length] == '=' || !arg[long_length])) {
+        value = arg[long_length] ? arg + long_length + 1 : args[*i + 1];
+        *i += arg[long_length] ? 1 : 2;
+    }
+    return value;
+}
+
+// nice [-n N | -N | --adjustment=N] [command...]
+// Stacked modifiers add up, as nested nice(1) calls do.
+int parse_nice_modifier(char **args, SpawnAttrs *attrs, SpawnParseMode mode) {
+    int i = 1;
+    int increment = 10; // Like nice(1): a command with no adjustment gets +10
+    const char *value = NULL;
+    if (args[i] && args[i][0] == '-' && strcmp(args[i], "--") != 0) {
+        value = spawn_option_value(args, &i, 'n', "--adjustment");
+        if (!value && (isdigit((unsigned char)args[i][1]) || args[i][1] == '-')) value = args[i++] + 1;
+        if (!value || !parse_spawn_number(value, &increment)) return SPAWN_UNSUPPORTED;
+    }
+    if (args[i] && strcmp(args[i], "--") == 0) i++;
+    if (args[i] || value) {
+        attrs->nice_increment += increment;
+        attrs->set_nice = true;
+    } else if (mode == SPAWN_PARSE_SHELL) {
+        errno = 0;
+        int niceness = getpriority(PRIO_PROCESS, 0);
+        if (errno == 0) printf("%d\n", niceness);
+    }
+    return i;
+}
+
+// ionice [-c class] [-n level] [command...]
+int parse_ionice_modifier(char **args, SpawnAttrs *attrs, SpawnParseMode mode) {
+    int i = 1;
+    int ioprio_class = 2;
+    int ioprio_level = 4;
+    bool set_ioprio = false;
+    while (args[i] && args[i][0] == '-') {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        const char *value;
+        if ((value = spawn_option_value(args, &i, 'c', "--class")) != NULL) {
+            if (strcmp(value, "realtime") == 0) ioprio_class = 1;
+            else if (strcmp(value, "best-effort") == 0) ioprio_class = 2;
+            else if (strcmp(value, "idle") == 0) ioprio_class = 3;
+            else if (!parse_spawn_number(value, &ioprio_class)) return SPAWN_UNSUPPORTED;
+        } else if ((value = spawn_option_value(args, &i, 'n', "--classdata")) != NULL) {
+            if (!parse_spawn_number(value, &ioprio_level)) return SPAWN_UNSUPPORTED;
+        } else {
+            return SPAWN_UNSUPPORTED;
+        }
+        set_ioprio = true;
+    }
+    if (ioprio_class < 1 || ioprio_class > 3 || ioprio_level < 0 || ioprio_level > 7) {
+        spawn_error(mode, "sdn: ionice: class must be 1-3 (realtime, best-effort, idle) and level 0-7\n");
+        return -1;
+    }
+    if (set_ioprio) {
+        attrs->set_ioprio = true;
+        attrs->ioprio_class = ioprio_class;
+        attrs->ioprio_level = ioprio_class == 3 ? 0 : ioprio_level;
+    } else if (!args[i] && mode == SPAWN_PARSE_SHELL) {
+        static const char *class_names[] = {"none", "realtime", "best-effort", "idle"};
+        long prio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+        if (prio >= 0) printf("%s: prio %ld\n", class_names[(prio >> IOPRIO_CLASS_SHIFT) & 3], prio & 7);
+    }
+    return i;
+}
+
+// taskset -c cpulist [command...] or taskset hexmask [command...]
+int parse_taskset_modifier(char **args, SpawnAttrs *attrs, SpawnParseMode mode) {
+    int i = 1;
+    if (!args[i]) {
+        cpu_set_t current;
+        if (mode == SPAWN_PARSE_SHELL && sched_getaffinity(0, sizeof(current), &current) == 0) {
+            const char *separator = "";
+            printf("current affinity list: ");
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (!CPU_ISSET(cpu, &current)) continue;
+                printf("%s%d", separator, cpu);
+                separator = ",";
+            }
+            printf("\n");
+        }
+        return i;
+    }
+    cpu_set_t cpus;
+    if ((strcmp(args[i], "-c") == 0 || strcmp(args[i], "--cpu-list") == 0) && args[i + 1]) {
+        parse_cpu_list(args[i + 1], &cpus);
+        i += 2;
+    } else if (args[i][0] != '-') {
+        char *end;
+        unsigned long long mask = strtoull(args[i], &end, 16);
+        if (end == args[i] || *end != '\0') return SPAWN_UNSUPPORTED;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; cpu++) {
+            if (mask & (1ULL << cpu)) CPU_SET(cpu, &cpus);
+        }
+        i++;
+    } else {
+        return SPAWN_UNSUPPORTED;
+    }
+    if (CPU_COUNT(&cpus) == 0) {
+        spawn_error(mode, "sdn: taskset: empty CPU list\n");
+        return -1;
+    }
+    attrs->cpus = cpus;
+    attrs->set_affinity = true;
+    return i;
+}
+
+typedef int (*SpawnModifierParser)(char **args, SpawnAttrs *attrs, SpawnParseMode mode);
+
+SpawnModifierParser find_spawn_modifier(const char *name) {
+    if (strcmp(name, "ulimit") == 0) return parse_ulimit_modifier;
+    if (strcmp(name, "nice") == 0) return parse_nice_modifier;
+    if (strcmp(name, "ionice") == 0) return parse_ionice_modifier;
+    if (strcmp(name, "taskset") == 0) return parse_taskset_modifier;
+    return NULL;
+}
+
+// The builtins handle only the forms without a command, which change the
+// shell itself, and leave option forms they do not implement to the real program
+bool spawn_modifier_handles(char **args) {
+    SpawnAttrs attrs;
+    memset(&attrs, 0, sizeof(attrs));
+    int command_index = find_spawn_modifier(args[0])(args, &attrs, SPAWN_PARSE_QUIET);
+    if (command_index == SPAWN_UNSUPPORTED) return false;
+    return command_index == -1 || args[command_index] == NULL;
+}
+
+int handle_spawn_modifier_builtin(char **args) {
+    SpawnAttrs attrs;
+    memset(&attrs, 0, sizeof(attrs));
+    int command_index = find_spawn_modifier(args[0])(args, &attrs, SPAWN_PARSE_SHELL);
+    if (command_index < 0) return 2;
+    return apply_spawn_attrs(&attrs) == -1 ? 1 : 0;
+}
+
+// Strip leading modifiers (`nice -n 5 ionice -c 3 cmd`) from a segment into
+// its SpawnAttrs. Returns 0, or -1 after reporting a bad modifier.
+int extract_spawn_modifiers(CommandSegment *segment) {
+    int removed = 0;
+    while (segment->args[removed]) {
+        SpawnModifierParser parse = find_spawn_modifier(segment->args[removed]);
+        if (!parse || find_function(segment->args[removed])) break;
+        if (!segment->spawn && !(segment->spawn = calloc(1, sizeof(SpawnAttrs)))) {
+            perror("sdn: calloc");
+            return -1;
+        }
+        SpawnAttrs attrs = *segment->spawn;
+        int command_index = parse(segment->args + removed, &attrs, SPAWN_PARSE_MODIFIER);
+        if (command_index == SPAWN_UNSUPPORTED) break; // The real program runs with the rest
+        if (command_index == -1) return -1;
+        if (segment->args[removed + command_index] == NULL) break; // No command: the builtin changes the shell
+        *segment->spawn = attrs;
+        removed += command_index;
+    }
+    if (removed == 0) {
+        free(segment->spawn);
+        segment->spawn = NULL;
+        return 0;
+    }
+    for (int i = 0; i < removed; i++) {
+        if (!arg_in_capture_storage(segment, segment->args[i])) free(segment->args[i]);
+    }
+    memmove(segment->args, segment->args + removed, (segment->arg_count - removed + 1) * sizeof(char*));
+    segment->arg_count -= removed;
+    segment->batch_start = segment->batch_start - removed < 1 ? 1 : segment->batch_start - removed;
+    segment->batch_end = segment->batch_end - removed < segment->batch_start ? segment->batch_start :
+                         segment->batch_end - removed;
+    return 0;
+}
+
+typedef int (*BuiltinHandler)(char **args);
+
+typedef struct {
+    const char *name;
+    BuiltinHandler handler;
+    bool substitution_safe; // Only prints, so $(...) may run it in-process
+    bool (*handles)(char **args); // NULL, or whether these args are handled here rather than by the real program
+} BuiltinEntry;
+
+// Builtins run inside the shell when they are the whole command line, and in a
+// forked child without exec when they are a pipeline stage, so their output
+// can be piped like any other command's.
+int handle_parallel_builtin(char **args);
+
+const BuiltinEntry builtin_table[] = {
+    {"cd", handle_cd_builtin, false, NULL},
+    {"echo", handle_echo_builtin, true, NULL},
+    {"history", handle_history_builtin, true, NULL},
+    {"alias", handle_alias_builtin, false, NULL},
+    {"unalias", handle_unalias_builtin, false, NULL},
+    {"export", handle_export_builtin, false, NULL},
+    {"set", handle_set_builtin, false, NULL},
+    {"jobs", handle_jobs_builtin, true, NULL},
+    {"fg", handle_fg_builtin, false, NULL},
+    {"bg", handle_bg_builtin, false, NULL},
+    {"wait", handle_wait_builtin, false, NULL},
+    {"exit", handle_exit_builtin, false, NULL},
+    {"true", handle_true_builtin, true, NULL},
+    {"false", handle_false_builtin, true, NULL},
+    {":", handle_true_builtin, true, NULL},
+    {"test", handle_test_builtin, true, NULL},
+    {"[", handle_test_builtin, true, NULL},
+    {"break", handle_break_builtin, false, NULL},
+    {"continue", handle_continue_builtin, false, NULL},
+    {"return", handle_return_builtin, false, NULL},
+    {"cat", handle_cat_builtin, false, cat_builtin_handles},
+    {"tee", handle_tee_builtin, false, tee_builtin_handles},
+    {"parallel", handle_parallel_builtin, false, NULL},
+    {"ulimit", handle_spawn_modifier_builtin, false, spawn_modifier_handles},
+    {"nice", handle_spawn_modifier_builtin, false, spawn_modifier_handles},
+    {"ionice", handle_spawn_modifier_builtin, false, spawn_modifier_handles},
+    {"taskset", handle_spawn_modifier_builtin, false, spawn_modifier_handles},
+};
+
+const BuiltinEntry *find_builtin(const char *name) {
+    for (size_t i = 0; i < sizeof(builtin_table) / sizeof(builtin_table[0]); i++) {
+        if (strcmp(builtin_table[i].name, name) == 0) {
+            return &builtin_table[i];
+        }
+    }
+    return NULL;
+}
+
+// The builtin that runs this expanded argv, if any
+const BuiltinEntry *find_builtin_for_args(char **args) {
+    const BuiltinEntry *builtin = find_builtin(args[0]);
+    if (builtin && builtin->handles && !builtin->handles(args)) return NULL;
+    return builtin;
+}
+
+// --- parallel builtin ---
+// `parallel [-j N] command [args] [::: item...]` runs the command once per
+// item (or per line of stdin when there is no `:::`), with at most N jobs at
+// a time (default: the CPUs the shell may use). `{}` in the command is
+// replaced by the item, `{.}` by the item without its extension and `{/}` by
+// its basename; with none of them the item is appended. Each job writes into
+// its own memfds, which are copied out whole when it finishes, so output is
+// never interleaved. A signalfd for SIGCHLD wakes the scheduler as soon as a
+// job exits so the slot is refilled at once.
+
+#define MAX_PARALLEL_JOBS 4096 // Each running job holds two memfds
+
+typedef struct {
+    pid_t pid;  // 0 when the slot is free
+    int out_fd; // memfd holding the job's stdout
+    int err_fd; // and its stderr
+} ParallelSlot;
+
+// Replace {}, {.} and {/} in word with forms of item. *used is set if any occurred.
+char *substitute_parallel_item(const char *word, const char *item, bool *used) {
+    StringBuffer out;
+    string_buffer_init(&out);
+    const char *base = strrchr(item, '/') ? strrchr(item, '/') + 1 : item;
+    const char *dot = strrchr(base, '.');
+    size_t stem_len = dot && dot != base ? (size_t)(dot - item) : strlen(item);
+    int failed = 0;
+    for (const char *p = word; *p && !failed; ) {
+        if (strncmp(p, "{}", 2) == 0) {
+            failed = string_buffer_append(&out, item, strlen(item));
+            p += 2;
+        } else if (strncmp(p, "{.}", 3) == 0) {
+            failed = string_buffer_append(&out, item, stem_len);
+            p += 3;
+        } else if (strncmp(p, "{/}", 3) == 0) {
+            failed = string_buffer_append(&out, base, strlen(base));
+            p += 3;
+        } else {
+            failed = string_buffer_append(&out, p++, 1);
+            continue;
+        }
+        *used = true;
+    }
+    char *result = failed ? NULL : strndup(out.data, out.length);
+    string_buffer_free(&out);
+    return result;
+}
+
+// Read all of stdin and split it into lines, in place. Returns the line count, or -1.
+int read_parallel_items(char **buffer_out, char ***items_out) {
+    size_t length = 0, capacity = 4096;
+    char *buffer = malloc(capacity);
+    while (buffer) {
+        if (length + 1 >= capacity) {
+            char *grown = realloc(buffer, capacity *= 2);
+            if (!grown) break;
+            buffer = grown;
+        }
+        ssize_t n = read(STDIN_FILENO, buffer + length, capacity - length - 1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == -1) break;
+            buffer[length] = '\0';
+            int count = 0, item_capacity = 64;
+            char **items = malloc(item_capacity * sizeof(char*));
+            char *save_ptr;
+            for (char *line = strtok_r(buffer, "\n", &save_ptr); line && items; line = strtok_r(NULL, "\n", &save_ptr)) {
+                if (count == item_capacity) {
+                    char **grown = realloc(items, (item_capacity *= 2) * sizeof(char*));
+                    if (!grown) { free(items); items = NULL; break; }
+                    items = grown;
+                }
+                items[count++] = line;
+            }
+            if (!items) break;
+            *buffer_out = buffer;
+            *items_out = items;
+            return count;
+        }
+        length += n;
+    }
+    free(buffer);
+    perror("sdn: parallel: reading stdin");
+    return -1;
+}
+
+// Fork one job for item into slot. Returns 0, or -1 after reporting an error.
+int start_parallel_job(ParallelSlot *slot, char **template, const char *item, bool items_from_stdin,
+                       const sigset_t *child_mask) {
+    int words = 0;
+    while (template[words]) words++;
+    char **argv = calloc(words + 2, sizeof(char*));
+    if (!argv) {
+        perror("sdn: parallel");
+        return -1;
+    }
+    bool used = false;
+    int argc = 0;
+    for (; argc < words; argc++) {
+        if (!(argv[argc] = substitute_parallel_item(template[argc], item, &used))) break;
+    }
+    if (argc == words && !used) argv[argc++] = strdup(item);
+    if (argc < words || !argv[argc - 1]) { // Out of memory part way: run nothing rather than a cut-down command
+        perror("sdn: parallel");
+        for (int i = 0; i < argc; i++) free(argv[i]);
+        free(argv);
+        return -1;
+    }
+
+    int ret = -1;
+    slot->out_fd = memfd_create("sdn-parallel-out", MFD_CLOEXEC);
+    slot->err_fd = memfd_create("sdn-parallel-err", MFD_CLOEXEC);
+    pid_t pid = -1;
+    if (slot->out_fd != -1 && slot->err_fd != -1) pid = fork();
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, child_mask, NULL);
+        reset_child_signals();
+        job_control_enabled = false;
+        interactive_shell = false;
+        dup2(slot->out_fd, STDOUT_FILENO);
+        dup2(slot->err_fd, STDERR_FILENO);
+        if (items_from_stdin) { // The items came from stdin; jobs must not eat it
+            int null_fd = open("/dev/null", O_RDONLY);
+            if (null_fd != -1) dup2(null_fd, STDIN_FILENO);
+        }
+        Node *function_body = find_function(argv[0]);
+        if (function_body) {
+            int status = call_function(function_body, argv);
+            fflush(stdout);
+            exit(status);
+        }
+        const BuiltinEntry *builtin = find_builtin_for_args(argv);
+        if (builtin) {
+            int status = builtin->handler(argv);
+            fflush(stdout);
+            exit(status);
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "sdn: parallel: %s: %s\n", argv[0], strerror(errno));
+        exit(127);
+    }
+    if (pid > 0) {
+        slot->pid = pid;
+        ret = 0;
+    } else {
+        perror("sdn: parallel");
+        if (slot->out_fd != -1) close(slot->out_fd);
+        if (slot->err_fd != -1) close(slot->err_fd);
+    }
+    for (int i = 0; i < argc; i++) free(argv[i]);
+    free(argv);
+    return ret;
+}
+
+// Copy a finished job's buffered output to the shell's stdout and stderr
+void flush_parallel_slot(ParallelSlot *slot) {
+    lseek(slot->out_fd, 0, SEEK_SET);
+    lseek(slot->err_fd, 0, SEEK_SET);
+    copy_fd_contents(slot->out_fd, STDOUT_FILENO);
+    copy_fd_contents(slot->err_fd, STDERR_FILENO);
+    close(slot->out_fd);
+    close(slot->err_fd);
+    slot->pid = 0;
+}
+
+int handle_parallel_builtin(char **args) {
+    cpu_set_t cpus;
+    int max_jobs = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : 1;
+    int i = 1;
+    if (args[i] && strncmp(args[i], "-j", 2) == 0) {
+        const char *value = args[i][2] ? args[i] + 2 : args[++i];
+        char *end = NULL;
+        long jobs = value ? strtol(value, &end, 10) : 0;
+        if (!value || *value == '\0' || *end != '\0' || jobs < 1 || jobs > MAX_PARALLEL_JOBS) {
+            fprintf(stderr, "sdn: parallel: -j needs a number from 1 to %d\n", MAX_PARALLEL_JOBS);
+            return 2;
+        }
+        max_jobs = (int)jobs;
+        i++;
+    }
+    char **template = &args[i];
+    int template_words = 0;
+    while (template[template_words] && strcmp(template[template_words], ":::") != 0) template_words++;
+    if (template_words == 0) {
+        fprintf(stderr, "usage: parallel [-j N] command [args...] [::: item...]\n");
+        return 2;
+    }
+
+    char **items;
+    char *stdin_buffer = NULL;
+    int item_count = 0;
+    bool items_from_stdin = template[template_words] == NULL;
+    if (items_from_stdin) {
+        item_count = read_parallel_items(&stdin_buffer, &items);
+        if (item_count == -1) return 1;
+    } else {
+        items = &template[template_words + 1];
+        while (items[item_count]) item_count++;
+    }
+    char *separator = template[template_words];
+    template[template_words] = NULL; // Cut the template at ":::"; restored below
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    ParallelSlot *slots = calloc(max_jobs, sizeof(ParallelSlot));
+    bool setup_failed = signal_fd == -1 || !slots;
+    if (setup_failed) perror("sdn: parallel");
+
+    fflush(stdout);
+    int next = 0, running = 0, failed = 0, started = 0;
+    bool interrupted = false;
+    while (signal_fd != -1 && slots && (next < item_count || running > 0)) {
+        for (int s = 0; s < max_jobs && running < max_jobs && next < item_count && !interrupted; s++) {
+            if (slots[s].pid != 0) continue;
+            if (start_parallel_job(&slots[s], template, items[next++], items_from_stdin, &old_mask) == 0) {
+                running++;
+                started++;
+            } else {
+                failed++;
+            }
+        }
+        if (running == 0) break;
+
+        struct signalfd_siginfo info;
+        if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) continue;
+        if (info.ssi_signo == SIGINT) { // The jobs share the terminal's process group and got it too
+            interrupted = true;
+            continue;
+        }
+        int status;
+        struct rusage usage;
+        pid_t pid;
+        while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+            int s = 0;
+            while (s < max_jobs && slots[s].pid != pid) s++;
+            if (s == max_jobs) { // Some other job of the shell's
+                mark_process_status(pid, status, &usage);
+                continue;
+            }
+            // parallel runs in the shell, which cannot be suspended, so Ctrl+Z
+            // would leave the jobs stopped and this loop waiting on them forever
+            if (WIFSTOPPED(status) && WSTOPSIG(status) != SIGSTOP) kill(pid, SIGCONT);
+            if (!WIFEXITED(status) && !WIFSIGNALED(status)) continue;
+            flush_parallel_slot(&slots[s]);
+            running--;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+        }
+    }
+
+    if (signal_fd != -1) close(signal_fd);
+    free(slots);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    template[template_words] = separator;
+    free(stdin_buffer);
+    if (items_from_stdin) free(items);
+    if (setup_failed) return 1;
+    if (interrupted) {
+        if (!interactive_shell) kill(getpid(), SIGINT); // A script dies of it as usual
+        interrupt_pending = 1;
+        return 130;
+    }
+    if (failed > 0) {
+        fprintf(stderr, "sdn: parallel: %d of %d jobs failed\n", failed, item_count);
+    }
+    return failed > 125 ? 125 : failed;
+}
+
+// A command substitution runs in-process when every command in it is a
+// builtin that only prints; anything else gets a forked child, since a
+// substitution must not change the shell's own state.
+bool node_runs_in_substitution_process(Node *node) {
+    switch (node->type) {
+        case NODE_LIST:
+        case NODE_AND:
+        case NODE_OR:
+        case NODE_NOT:
+        case NODE_IF:
+            for (int i = 0; i < node->child_count; i++) {
+                if (!node_runs_in_substitution_process(node->children[i])) return false;
+            }
+            return true;
+        case NODE_PIPELINE: {
+            if (node->command_count != 1 || node->background) return false;
+            SimpleCommand *cmd = &node->commands[0];
+            if (cmd->compound) return cmd->word_count == 0 && node_runs_in_substitution_process(cmd->compound);
+            if (cmd->assignment_count > 0 || strpbrk(cmd->words[0], "$`'\"\\")) return false;
+            for (int i = 1; i < cmd->word_count; i++) {
+                const char *word = cmd->words[i];
+                if (is_redirection_word(word)) return false;
+            }
+            const BuiltinEntry *builtin = find_builtin(cmd->words[0]);
+            return builtin && builtin->substitution_safe && !find_function(cmd->words[0]);
+        }
+        default:
+            return false;
+    }
+}
+
+#define CAPTURE_SPLICE_THRESHOLD (1 << 20) // Past this many bytes, output is spliced into a memfd
+
+// Move everything still in the pipe into a memfd with splice() and map it.
+// `prefix` holds what was already read. Returns 0 on success.
+int capture_into_memfd(int pipe_fd, char *prefix, size_t prefix_length, CaptureBuffer *out) {
+    int memfd = memfd_create("sdn-capture", MFD_CLOEXEC);
+    if (memfd == -1) return -1;
+    size_t total = 0;
+    while (total < prefix_length) {
+        ssize_t n = write(memfd, prefix + total, prefix_length - total);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) { close(memfd); return -1; }
+        total += n;
+    }
+    while (1) {
+        ssize_t n = splice(pipe_fd, NULL, memfd, NULL, CAPTURE_SPLICE_THRESHOLD, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EINVAL) { // No splice support for this pair: copy instead
+            char chunk[65536];
+            n = read(pipe_fd, chunk, sizeof(chunk));
+            if (n == -1 && errno == EINTR) continue;
+            if (n > 0 && write(memfd, chunk, n) != n) n = -1;
+        }
+        if (n == -1) { close(memfd); return -1; }
+        if (n == 0) break;
+        total += n;
+    }
+    // One spare zero byte past the end keeps the mapping NUL-terminated
+    if (ftruncate(memfd, total + 1) == -1) { close(memfd); return -1; }
+    char *map = mmap(NULL, total + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, memfd, 0);
+    close(memfd);
+    if (map == MAP_FAILED) return -1;
+    out->data = map;
+    out->length = total;
+    out->mapped_size = total + 1;
+    return 0;
+}
+
+// Read a substitution child's output: into a growable buffer while it is
+// small, then straight from the pipe into a memfd. Returns 0 on success.
+int capture_pipe_output(int pipe_fd, CaptureBuffer *out) {
+    size_t capacity = 4096, length = 0;
+    char *data = malloc(capacity);
+    if (!data) return -1;
+    while (1) {
+        if (length + 1 >= capacity) {
+            if (capacity >= CAPTURE_SPLICE_THRESHOLD) {
+                int ret = capture_into_memfd(pipe_fd, data, length, out);
+                free(data);
+                return ret;
+            }
+            char *grown = realloc(data, capacity * 2);
+            if (!grown) { free(data); return -1; }
+            data = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(pipe_fd, data + length, capacity - length - 1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) { free(data); return -1; }
+        if (n == 0) break;
+        length += n;
+    }
+    data[length] = '\0';
+    out->data = data;
+    out->length = length;
+    out->mapped_size = 0;
+    return 0;
+}
+
+int last_substitution_status = 0; // Exit status of the most recent $(...), for assignment-only commands
+
+// Run a command substitution and collect its standard output.
+// Returns 0 on success, -1 after reporting an error.
+int capture_command_output(const char *command_text, CaptureBuffer *out) {
+    memset(out, 0, sizeof(*out));
+    ParseStatus parse_status;
+    char error[128];
+    Node *root = parse_script(command_text, &parse_status, error, sizeof(error), NULL);
+    if (!root) {
+        fprintf(stderr, "sdn: command substitution: %s\n", error);
+        return -1;
+    }
+
+    int status = 0;
+    int ret = 0;
+    fflush(stdout);
+    if (node_runs_in_substitution_process(root)) {
+        // Builtins write through stdio, so swapping stdout for a memory stream captures them with no syscalls
+        char *data = NULL;
+        size_t length = 0;
+        FILE *capture_stream = open_memstream(&data, &length);
+        if (!capture_stream) {
+            perror("sdn: open_memstream");
+            free_node(root);
+            return -1;
+        }
+        FILE *saved_stdout = stdout;
+        stdout = capture_stream;
+        status = execute_node(root);
+        fclose(capture_stream);
+        stdout = saved_stdout;
+        out->data = data;
+        out->length = length;
+    } else {
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            perror("sdn: pipe");
+            free_node(root);
+            return -1;
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("sdn: fork");
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            free_node(root);
+            return -1;
+        }
+        if (pid == 0) { // Like a subshell: no job control, output into the pipe
+            reset_child_signals();
+            job_control_enabled = false;
+            interactive_shell = false;
+            dup2(pipe_fds[1], STDOUT_FILENO);
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            int child_status = execute_node(root);
+            fflush(stdout);
+            exit(child_status);
+        }
+        close(pipe_fds[1]);
+        ret = capture_pipe_output(pipe_fds[0], out);
+        if (ret == -1) perror("sdn: command substitution");
+        close(pipe_fds[0]);
+
+        int wait_status;
+        while (waitpid(pid, &wait_status, 0) == -1 && errno == EINTR) {}
+        status = WIFSIGNALED(wait_status) ? 128 + WTERMSIG(wait_status) : WEXITSTATUS(wait_status);
+    }
+    free_node(root);
+    last_substitution_status = status;
+    return ret;
+}
+
+// Process substitutions started for the commands being run. The shell keeps
+// its end of each pipe open (and inheritable) until the pipeline finishes.
+typedef struct {
+    int fd;    // Shell's end of the pipe, passed on as /dev/fd/N
+    pid_t pid; // Process running the inner command
+} ProcessSubstitution;
+
+ProcessSubstitution *process_substitutions = NULL;
+int process_substitution_count = 0;
+int process_substitution_capacity = 0;
+
+// Start <(cmd) or >(cmd): run cmd in a child connected to a pipe and return
+// the shell's end of it, or -1 after reporting an error.
+int start_process_substitution(const char *word) {
+    bool reads_output = word[0] == '<'; // <(cmd): the command reads what cmd prints
+    size_t len = strlen(word);
+    char *command_text = strndup(word + 2, len - 3);
+    if (!command_text) {
+        perror("sdn: strndup");
+        return -1;
+    }
+    ParseStatus parse_status;
+    char error[128];
+    Node *root = parse_script(command_text, &parse_status, error, sizeof(error), NULL);
+    free(command_text);
+    if (!root) {
+        fprintf(stderr, "sdn: process substitution: %s\n", error);
+        return -1;
+    }
+    if (process_substitution_count == process_substitution_capacity) {
+        int new_capacity = process_substitution_capacity ? process_substitution_capacity * 2 : 4;
+        ProcessSubstitution *grown = realloc(process_substitutions, new_capacity * sizeof(ProcessSubstitution));
+        if (!grown) {
+            perror("sdn: realloc");
+            free_node(root);
+            return -1;
+        }
+        process_substitutions = grown;
+        process_substitution_capacity = new_capacity;
+    }
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("sdn: pipe");
+        free_node(root);
+        return -1;
+    }
+    int shell_end = reads_output ? pipe_fds[0] : pipe_fds[1];
+    int child_end = reads_output ? pipe_fds[1] : pipe_fds[0];
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("sdn: fork");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        free_node(root);
+        return -1;
+    }
+    if (pid == 0) {
+        reset_child_signals();
+        job_control_enabled = false;
+        interactive_shell = false;
+        // Other substitutions' pipe ends would keep their readers from seeing EOF
+        for (int i = 0; i < process_substitution_count; i++) close(process_substitutions[i].fd);
+        dup2(child_end, reads_output ? STDOUT_FILENO : STDIN_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        int child_status = execute_node(root);
+        fflush(stdout);
+        exit(child_status);
+    }
+    close(child_end);
+    free_node(root);
+    fcntl(shell_end, F_SETFD, 0); // The command it is named for must inherit it
+    process_substitutions[process_substitution_count].fd = shell_end;
+    process_substitutions[process_substitution_count].pid = pid;
+    process_substitution_count++;
+    return shell_end;
+}
+
+// Close the pipes of substitutions started since `mark` and, unless the
+// command went to the background, wait for their processes. Closing first
+// lets a >(cmd) reader see EOF and a <(cmd) writer stop on SIGPIPE.
+void finish_process_substitutions(int mark, bool wait_for_them) {
+    for (int i = mark; i < process_substitution_count; i++) close(process_substitutions[i].fd);
+    for (int i = mark; i < process_substitution_count && wait_for_them; i++) {
+        // wait_for_job() may already have reaped it, which gives ECHILD
+        while (waitpid(process_substitutions[i].pid, NULL, 0) == -1 && errno == EINTR) {}
+    }
+    process_substitution_count = mark;
+}
+
+// Expand the words of a built segment. An unquoted word that is one whole
+// $(...) is split into fields in place inside its capture buffer, and argv
+// points at them directly; the buffer is kept on the segment until it is freed.
+int expand_segment_args(CommandSegment *segment) {
+    int count = segment->arg_count;
+    bool has_substitution_word = false;
+    for (int i = 0; i < count; i++) {
+        if (word_is_command_substitution(segment->args[i]) || word_is_process_substitution(segment->args[i])) {
+            has_substitution_word = true;
+        }
+    }
+    if (!has_substitution_word) {
+        expand_variables_in_args(segment->args);
+        return expansion_failed ? -1 : 0;
+    }
+
+    char **words = segment->args;
+    segment->args = calloc(segment->arg_capacity, sizeof(char*));
+    if (!segment->args) {
+        segment->args = words;
+        perror("sdn: calloc");
+        return -1;
+    }
+    segment->arg_count = 0;
+    int ret = 0;
+    for (int i = 0; i < count; i++) {
+        char *word = words[i];
+        if (ret == -1) {
+            free(word);
+            continue;
+        }
+        if (word_is_process_substitution(word)) {
+            char path[32];
+            int fd = start_process_substitution(word);
+            free(word);
+            if (fd == -1) {
+                ret = -1;
+                continue;
+            }
+            snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+            if (add_segment_arg(segment, path) == -1) ret = -1;
+            continue;
+        }
+        if (!word_is_command_substitution(word)) {
+            char *expanded = expand_single_argument(word);
+            if (expansion_failed) ret = -1;
+            if (expanded) {
+                free(word);
+                word = expanded;
+            }
+            if (ret == 0 && add_segment_arg_pointer(segment, word) == -1) ret = -1;
+            if (ret == -1) free(word);
+            continue;
+        }
+
+        size_t len = strlen(word);
+        char *command_text = word[0] == '`' ? strndup(word + 1, len - 2) : strndup(word + 2, len - 3);
+        free(word);
+        CaptureBuffer *capture = calloc(1, sizeof(CaptureBuffer));
+        if (!command_text || !capture || capture_command_output(command_text, capture) == -1) {
+            free(command_text);
+            free(capture);
+            ret = -1;
+            continue;
+        }
+        free(command_text);
+        capture->next = segment->arg_storage;
+        segment->arg_storage = capture;
+
+        // Fields are terminated in place and go into argv without being copied
+        char *cursor = capture->data;
+        char *end = capture->data + capture->length;
+        while (cursor < end && ret == 0) {
+            while (cursor < end && isspace((unsigned char)*cursor)) cursor++;
+            if (cursor >= end) break;
+            char *field = cursor;
+            while (cursor < end && !isspace((unsigned char)*cursor)) cursor++;
+            *cursor++ = '\0';
+            if (add_segment_arg_pointer(segment, field) == -1) ret = -1;
+        }
+    }
+    free(words);
+    // Fields may now be anywhere in argv; let argbatch split all but the command name
+    segment->batch_start = segment->arg_count > 0 ? 1 : 0;
+    segment->batch_end = segment->arg_count;
+    if (ret == -1) expansion_failed = true;
+    return ret;
+}
+
+// Make a readable fd holding text. Text that fits in a pipe's atomic write
+// goes through a pipe; anything larger goes into a memfd, so writing it can
+// never block on a full pipe and nothing touches the filesystem.
+int open_input_text(const char *text, size_t len) {
+    int fds[2];
+    if (len <= PIPE_BUF) {
+        if (pipe2(fds, O_CLOEXEC) == -1) return -1;
+        if (len > 0 && write(fds[1], text, len) != (ssize_t)len) {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+
+    int memfd = memfd_create("sdn-heredoc", MFD_CLOEXEC);
+    if (memfd == -1) return -1;
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(memfd, text + written, len - written);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            close(memfd);
+            return -1;
+        }
+        written += n;
+    }
+    if (lseek(memfd, 0, SEEK_SET) == -1) {
+        close(memfd);
+        return -1;
+    }
+    return memfd;
+}
+
+// Point stdin/stdout at the segment's redirection targets.
+// Returns 0 on success, -1 (after reporting the error) on failure.
+int apply_segment_redirections(CommandSegment *segment) {
+    if (segment->inputText) {
+        int fd_in = open_input_text(segment->inputText, strlen(segment->inputText));
+        if (fd_in == -1) {
+            perror("sdn: here-document");
+            return -1;
+        }
+        if (dup2(fd_in, STDIN_FILENO) == -1) {
+            perror("sdn: dup2 here-document");
+            close(fd_in);
+            return -1;
+        }
+        close(fd_in);
+    }
+    if (segment->inputFile) {
+        int fd_in = open(segment->inputFile, O_RDONLY);
+        if (fd_in == -1) {
+            perror("sdn: open input file");
+            return -1;
+        }
+        if (dup2(fd_in, STDIN_FILENO) == -1) {
+            perror("sdn: dup2 input file");
+            close(fd_in);
+            return -1;
+        }
+        close(fd_in);
+    }
+
+    if (segment->outputFile) {
+        int flags = O_WRONLY | O_CREAT;
+        if (segment->appendMode) {
+            flags |= O_APPEND;
+        } else {
+            flags |= O_TRUNC;
+        }
+        int fd_out = open(segment->outputFile, flags, 0644);
+        if (fd_out == -1) {
+            perror("sdn: open output file");
+            return -1;
+        }
+        if (dup2(fd_out, STDOUT_FILENO) == -1) {
+            perror("sdn: dup2 output file");
+            close(fd_out);
+            return -1;
+        }
+        close(fd_out);
+    }
+    return 0;
+}
+
+typedef struct {
+    int saved_stdin;
+    int saved_stdout;
+    bool active;
+} SavedStdio;
+
+void restore_shell_stdio(SavedStdio *saved) {
+    if (!saved->active) return;
+    fflush(stdout);
+    dup2(saved->saved_stdin, STDIN_FILENO);
+    dup2(saved->saved_stdout, STDOUT_FILENO);
+    close(saved->saved_stdin);
+    close(saved->saved_stdout);
+    saved->active = false;
+}
+
+// Apply a segment's redirections to the shell itself, remembering the old
+// stdin/stdout for restore_shell_stdio(). Returns -1 if a redirection failed.
+int redirect_shell_stdio(CommandSegment *segment, SavedStdio *saved) {
+    saved->active = false;
+    if (!segment->inputFile && !segment->inputText && !segment->outputFile) return 0;
+
+    fflush(stdout);
+    saved->saved_stdin = dup(STDIN_FILENO);
+    saved->saved_stdout = dup(STDOUT_FILENO);
+    saved->active = true;
+    if (apply_segment_redirections(segment) == -1) {
+        restore_shell_stdio(saved);
+        return -1;
+    }
+    return 0;
+}
+
+
+extern char **environ;
+
+// Bytes execve() needs to copy for a NULL-terminated string vector
+size_t argv_footprint(char **vector) {
+    size_t total = sizeof(char*); // Terminating NULL
+    for (int i = 0; vector[i] != NULL; i++) {
+        total += strlen(vector[i]) + 1 + sizeof(char*);
+    }
+    return total;
+}
+
+// ARG_MAX minus what the environment already uses and a safety margin
+long effective_arg_max() {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) arg_max = 128 * 1024;
+    return arg_max - (long)argv_footprint(environ) - ARG_MAX_HEADROOM;
+}
+
+// Number of batches argbatch may run at once, from $SDN_BATCH_JOBS (default 1)
+int get_batch_jobs() {
+    const char *value = get_shell_variable("SDN_BATCH_JOBS");
+    if (value == NULL) value = getenv("SDN_BATCH_JOBS");
+    int jobs = value ? atoi(value) : 1;
+    return jobs > 0 ? jobs : 1;
+}
+
+// Map one batch's wait status to the xargs exit code convention
+int batch_exit_code(int status) {
+    if (WIFSIGNALED(status)) return 125;
+    int code = WEXITSTATUS(status);
+    if (code == 0) return 0;
+    if (code == 126 || code == 127) return code;
+    if (code == 255) return 124;
+    return 123;
+}
+
+// Run a segment whose argv exceeds ARG_MAX as several commands, xargs style.
+// Arguments outside [batch_start, batch_end) are repeated in every batch and the
+// range itself is packed greedily. Up to get_batch_jobs() batches run in parallel.
+// Returns the most severe xargs-style exit code seen across all batches.
+int run_argv_batches(CommandSegment *segment) {
+    long limit = effective_arg_max();
+    int start = segment->batch_start;
+    int end = segment->batch_end;
+    int jobs = get_batch_jobs();
+
+    size_t fixed_size = sizeof(char*);
+    for (int i = 0; i < segment->arg_count; i++) {
+        if (i < start || i >= end) fixed_size += strlen(segment->args[i]) + 1 + sizeof(char*);
+    }
+
+    char **batch_argv = malloc((segment->arg_count + 1) * sizeof(char*));
+    if (!batch_argv) {
+        perror("sdn: argbatch: malloc");
+        return 1;
+    }
+
+    int next = start;
+    int running = 0;
+    int aggregate = 0;
+    while (next < end || running > 0) {
+        if (next < end && running < jobs) {
+            int n = 0;
+            for (int i = 0; i < start; i++) batch_argv[n++] = segment->args[i];
+
+            size_t used = fixed_size;
+            int first = next;
+            while (next < end) {
+                size_t cost = strlen(segment->args[next]) + 1 + sizeof(char*);
+                if ((long)(used + cost) > limit && next > first) break;
+                used += cost;
+                batch_argv[n++] = segment->args[next++];
+            }
+            if ((long)used > limit) {
+                fprintf(stderr, "sdn: argbatch: argument too long for a single command: %.40s...\n", segment->args[first]);
+                if (aggregate < 126) aggregate = 126;
+                continue;
+            }
+
+            for (int i = end; i < segment->arg_count; i++) batch_argv[n++] = segment->args[i];
+            batch_argv[n] = NULL;
+
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("sdn: argbatch: fork");
+                if (aggregate < 126) aggregate = 126;
+                break;
+            }
+            if (pid == 0) {
+                execvp(batch_argv[0], batch_argv);
+                perror("sdn: execvp failed");
+                exit(errno == ENOENT ? 127 : 126);
+            }
+            running++;
+            continue;
+        }
+
+        int status;
+        if (wait(&status) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        running--;
+        int code = batch_exit_code(status);
+        if (code > aggregate) aggregate = code;
+    }
+
+    // Reap anything still running after a fork failure
+    while (running > 0 && wait(NULL) > 0) running--;
+
+    free(batch_argv);
+    return aggregate;
+}
+
+// Expand the values of NAME=value words. Returns a NULL-terminated vector of
+// "NAME=value" strings, or NULL if an expansion failed.
+char **expand_assignments(char **words, int count) {
+    char **assignments = calloc(count + 1, sizeof(char*));
+    if (!assignments) {
+        perror("sdn: calloc");
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        const char *eq = strchr(words[i], '=');
+        char *value = expand_single_argument(eq + 1);
+        if (expansion_failed) {
+            for (int j = 0; j < i; j++) free(assignments[j]);
+            free(assignments);
+            return NULL;
+        }
+        const char *final_value = value ? value : eq + 1;
+        size_t name_len = eq - words[i];
+        size_t size = name_len + strlen(final_value) + 2;
+        assignments[i] = malloc(size);
+        if (assignments[i]) snprintf(assignments[i], size, "%.*s=%s", (int)name_len, words[i], final_value);
+        free(value);
+        if (!assignments[i]) {
+            perror("sdn: malloc");
+            for (int j = 0; j < i; j++) free(assignments[j]);
+            free(assignments);
+            return NULL;
+        }
+    }
+    return assignments;
+}
+
+
+// A statement made only of NAME=value words sets shell variables; exported
+// ones are updated in the environment too.
+int assign_shell_variables(char **words, int count) {
+    last_substitution_status = 0;
+    for (int i = 0; i < count; i++) {
+        const char *eq = strchr(words[i], '=');
+        char name[MAX_VAR_NAME_LEN];
+        size_t name_len = eq - words[i];
+        if (name_len >= sizeof(name)) {
+            fprintf(stderr, "sdn: %.20s...: variable name too long\n", words[i]);
+            return 1;
+        }
+        memcpy(name, words[i], name_len);
+        name[name_len] = '\0';
+        char *expanded = expand_single_argument(eq + 1);
+        if (expansion_failed) return 1;
+        const char *value = expanded ? expanded : eq + 1;
+        set_shell_variable(name, value);
+        if (getenv(name) != NULL) setenv(name, value, 1);
+        free(expanded);
+    }
+    return last_substitution_status; // x=$(false) reports the substitution's status
+}
+
+// Export a command's NAME=value prefixes. When saved_out is non-NULL the old
+// environment entries are returned through it for restore_command_environment().
+void export_command_environment(char **assignments, char ***saved_out) {
+    int count = 0;
+    while (assignments[count] != NULL) count++;
+    char **saved = saved_out ? calloc(count + 1, sizeof(char*)) : NULL;
+    for (int i = 0; i < count; i++) {
+        char *eq = strchr(assignments[i], '=');
+        *eq = '\0';
+        if (saved) {
+            const char *old = getenv(assignments[i]);
+            saved[i] = old ? strdup(old) : NULL;
+        }
+        setenv(assignments[i], eq + 1, 1);
+        *eq = '=';
+    }
+    if (saved_out) *saved_out = saved;
+}
+
+void restore_command_environment(char **assignments, char **saved) {
+    for (int i = 0; assignments[i] != NULL; i++) {
+        char *eq = strchr(assignments[i], '=');
+        *eq = '\0';
+        if (saved && saved[i]) {
+            setenv(assignments[i], saved[i], 1);
+        } else {
+            unsetenv(assignments[i]);
+        }
+        *eq = '=';
+        if (saved) free(saved[i]);
+    }
+    free(saved);
+}
+
+// Short name for a compound command, used where a process name is shown
+const char *node_label(const Node *node) {
+    switch (node->type) {
+        case NODE_LIST: return "{";
+        case NODE_PIPELINE: return node->command_count > 0 && node->commands[0].word_count > 0 ? node->commands[0].words[0] : "";
+        case NODE_AND: return "&&";
+        case NODE_OR: return "||";
+        case NODE_NOT: return "!";
+        case NODE_IF: return "if";
+        case NODE_WHILE: return "while";
+        case NODE_UNTIL: return "until";
+        case NODE_FOR: return "for";
+        case NODE_FUNCTION: return node->name;
+    }
+    return "";
+}
+
+int execute_command_node(Node *node);
+
+// --- Throughput mode ---
+// SDN_PIPE_SIZE=N[K|M] enlarges every pipe between stages with F_SETPIPE_SZ,
+// and SDN_PIPE_AFFINITY=1 pins the stages to CPUs in an order that puts
+// adjacent stages on SMT siblings, so a pipe's pages stay in a shared cache.
+// Both can be set as shell variables or as a prefix on the pipeline, e.g.
+// `SDN_PIPE_SIZE=1M zcat big.gz | grep x | sort`.
+
+// A throughput setting from the first stage's prefix assignments, else the shell
+const char *pipeline_setting(const CommandSegment *segments, const char *name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; segments[0].assignments && segments[0].assignments[i]; i++) {
+        const char *assignment = segments[0].assignments[i];
+        if (strncmp(assignment, name, name_len) == 0 && assignment[name_len] == '=') {
+            return assignment + name_len + 1;
+        }
+    }
+    const char *value = get_shell_variable(name);
+    return value ? value : getenv(name);
+}
+
+// Requested pipe capacity in bytes, or 0 to keep the kernel default
+int pipeline_pipe_size(const CommandSegment *segments) {
+    const char *value = pipeline_setting(segments, "SDN_PIPE_SIZE");
+    if (!value || !*value) return 0;
+    char *end;
+    unsigned long long size = strtoull(value, &end, 10);
+    if (*end == 'k' || *end == 'K') size <<= 10;
+    else if (*end == 'm' || *end == 'M') size <<= 20;
+    return size > INT_MAX ? INT_MAX : (int)size;
+}
+
+int sibling_cpu_order[CPU_SETSIZE];
+int sibling_cpu_count = 0; // 0 until computed
+
+// The CPUs the shell may run on, each followed by its SMT siblings.
+// Topology does not change while the shell runs, so this is built once.
+void compute_sibling_cpu_order() {
+    cpu_set_t allowed, placed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return;
+    CPU_ZERO(&placed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || CPU_ISSET(cpu, &placed)) continue;
+        sibling_cpu_order[sibling_cpu_count++] = cpu;
+        CPU_SET(cpu, &placed);
+
+        char path[96], list[256];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) continue;
+        ssize_t n = read(fd, list, sizeof(list) - 1);
+        close(fd);
+        if (n <= 0) continue;
+        list[n] = '\0';
+        cpu_set_t siblings;
+        parse_cpu_list(list, &siblings);
+        for (int sibling = 0; sibling < CPU_SETSIZE; sibling++) {
+            if (CPU_ISSET(sibling, &siblings) && CPU_ISSET(sibling, &allowed) && !CPU_ISSET(sibling, &placed)) {
+                sibling_cpu_order[sibling_cpu_count++] = sibling;
+                CPU_SET(sibling, &placed);
+            }
+        }
+    }
+}
 
-                if (ret == 0) { // Success
-                    for (size_t k = 0; k < glob_result.gl_pathc; k++) {
-                        if (current_arg_idx < MAX_ARGS - 1) {
-                            cmd_segment->args[current_arg_idx] = strdup(glob_result.gl_pathv[k]);
-                            if (!cmd_segment->args[current_arg_idx]) { perror("sdn: strdup error"); globfree(&glob_result); free_command_segment_internals(cmd_segment); return -1; }
-                            current_arg_idx++;
-                        } else {
-                            fprintf(stderr, "sdn: too many arguments after wildcard expansion for '%s'\n", current_raw_token);
-                            globfree(&glob_result);
-                            free_command_segment_internals(cmd_segment); return -1;
-                        }
-                    }
-                } else if (ret == GLOB_NOMATCH) { 
-                    // if (current_arg_idx < MAX_ARGS - 1) {
-                    //    cmd_segment->args[current_arg_idx++] = strdup(current_raw_token);
-                    // } else { /* error */ }
-                } else { // Other glob errors (GLOB_NOSPACE, GLOB_ABORTED)
-                    fprintf(stderr, "sdn: glob error for pattern '%s'\n", current_raw_token);
-                    globfree(&glob_result);
-                    free_command_segment_internals(cmd_segment); return -1;
+// True if the pipeline asked for its stages to be pinned
+bool pipeline_wants_affinity(const CommandSegment *segments) {
+    const char *value = pipeline_setting(segments, "SDN_PIPE_AFFINITY");
+    if (!value || !*value || strcmp(value, "0") == 0) return false;
+    if (sibling_cpu_count == 0) compute_sibling_cpu_order();
+    return sibling_cpu_count > 1;
+}
+
+// In a stage's child: run only on the CPU assigned to stage `index`
+void pin_stage_to_cpu(int index) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(sibling_cpu_order[index % sibling_cpu_count], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+// --- Pipe monitor ---
+// With `set -o pipemon`, each pipe between two stages is split in two and a
+// relay process owned by the shell moves the data across with splice(), so
+// nothing is copied through user space. The relay counts bytes per edge and
+// how long it waited on each side: starved (the writing stage is slow) or
+// blocked (the reading stage is slow). It prints a live rate line while a
+// terminal is attached and a summary when the pipeline ends.
+
+typedef struct {
+    int in_fd;             // Read end of the pipe the writing stage fills
+    int out_fd;            // Write end of the pipe the reading stage drains
+    bool done;
+    int waiting;           // PIPE_WAIT_* the relay is currently in
+    double wait_started;
+    unsigned long long bytes;
+    unsigned long long bytes_at_report;
+    double starved_seconds;
+    double blocked_seconds;
+    double finished;
+} PipeEdge;
+
+enum { PIPE_WAIT_NONE, PIPE_WAIT_STARVED, PIPE_WAIT_BLOCKED };
+
+double monotonic_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void pipe_edge_set_waiting(PipeEdge *edge, int waiting, double now) {
+    if (edge->waiting == waiting) return;
+    if (edge->waiting == PIPE_WAIT_STARVED) edge->starved_seconds += now - edge->wait_started;
+    if (edge->waiting == PIPE_WAIT_BLOCKED) edge->blocked_seconds += now - edge->wait_started;
+    edge->waiting = waiting;
+    edge->wait_started = now;
+}
+
+// Watch the side the edge is waiting on: its input when starved, its output when blocked
+void pipe_edge_watch(int epoll_fd, PipeEdge *edge, int index) {
+    struct epoll_event in_event = {.events = edge->waiting == PIPE_WAIT_BLOCKED ? 0 : EPOLLIN, .data.u32 = index};
+    struct epoll_event out_event = {.events = edge->waiting == PIPE_WAIT_BLOCKED ? EPOLLOUT : 0, .data.u32 = index};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, edge->in_fd, &in_event);
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, edge->out_fd, &out_event);
+}
+
+void pipe_edge_finish(int epoll_fd, PipeEdge *edge) {
+    double now = monotonic_seconds();
+    pipe_edge_set_waiting(edge, PIPE_WAIT_NONE, now);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, edge->in_fd, NULL);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, edge->out_fd, NULL);
+    close(edge->in_fd); // A writer still running now gets SIGPIPE, as it would without the relay
+    close(edge->out_fd); // The reader sees EOF
+    edge->done = true;
+    edge->finished = now;
+}
+
+// Move whatever can move without blocking. Returns true once the edge is finished.
+bool pipe_edge_pump(int epoll_fd, PipeEdge *edge, int index) {
+    while (1) {
+        ssize_t n = splice(edge->in_fd, NULL, edge->out_fd, NULL, COPY_CHUNK_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            edge->bytes += n;
+            pipe_edge_set_waiting(edge, PIPE_WAIT_NONE, monotonic_seconds());
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) {
+            int pending = 0;
+            ioctl(edge->in_fd, FIONREAD, &pending);
+            pipe_edge_set_waiting(edge, pending > 0 ? PIPE_WAIT_BLOCKED : PIPE_WAIT_STARVED, monotonic_seconds());
+            pipe_edge_watch(epoll_fd, edge, index);
+            return false;
+        }
+        pipe_edge_finish(epoll_fd, edge); // EOF, or the reader went away (EPIPE)
+        return true;
+    }
+}
+
+void print_pipe_rates(PipeEdge *edges, int edge_count, const JobProcess *procs, double interval) {
+    fputs("\r\033[K", stderr);
+    for (int i = 0; i < edge_count; i++) {
+        double rate = (edges[i].bytes - edges[i].bytes_at_report) / interval / (1 << 20);
+        edges[i].bytes_at_report = edges[i].bytes;
+        fprintf(stderr, "%s%s->%s %.1f MiB/s", i ? "  " : "", procs[i].name, procs[i + 1].name, rate);
+    }
+}
+
+void print_pipe_summary(PipeEdge *edges, int edge_count, const JobProcess *procs, double started) {
+    double *waited_for = calloc(edge_count + 1, sizeof(double)); // Per stage: how long the relay waited on it
+    for (int i = 0; i < edge_count; i++) {
+        double elapsed = edges[i].finished - started;
+        fprintf(stderr, "sdn: pipemon: %s -> %s: %.1f MiB in %.2f s (%.1f MiB/s), starved %.2f s, blocked %.2f s\n",
+                procs[i].name, procs[i + 1].name, edges[i].bytes / (double)(1 << 20), elapsed,
+                elapsed > 0 ? edges[i].bytes / elapsed / (1 << 20) : 0.0,
+                edges[i].starved_seconds, edges[i].blocked_seconds);
+        if (waited_for) {
+            waited_for[i] += edges[i].starved_seconds;
+            waited_for[i + 1] += edges[i].blocked_seconds;
+        }
+    }
+    if (waited_for) {
+        int slowest = 0;
+        for (int i = 1; i <= edge_count; i++) {
+            if (waited_for[i] > waited_for[slowest]) slowest = i;
+        }
+        if (waited_for[slowest] > 0) {
+            fprintf(stderr, "sdn: pipemon: slowest stage: %d (%s), waited on for %.2f s\n",
+                    slowest + 1, procs[slowest].name, waited_for[slowest]);
+        }
+        free(waited_for);
+    }
+}
+
+// Body of the relay process: pump every edge until all have reached EOF
+void run_pipe_monitor(PipeEdge *edges, int edge_count, const JobProcess *procs) {
+    signal(SIGPIPE, SIG_IGN); // A reader exiting early shows up as EPIPE
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("sdn: pipemon: epoll_create1");
+        return;
+    }
+    double started = monotonic_seconds();
+    for (int i = 0; i < edge_count; i++) {
+        fcntl(edges[i].in_fd, F_SETFL, O_NONBLOCK);
+        fcntl(edges[i].out_fd, F_SETFL, O_NONBLOCK);
+        struct epoll_event in_event = {.events = EPOLLIN, .data.u32 = i};
+        struct epoll_event out_event = {.events = 0, .data.u32 = i};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, edges[i].in_fd, &in_event);
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, edges[i].out_fd, &out_event);
+        edges[i].waiting = PIPE_WAIT_STARVED;
+        edges[i].wait_started = started;
+    }
+
+    bool live = isatty(STDERR_FILENO);
+    double last_report = started;
+    int remaining = edge_count;
+    while (remaining > 0) {
+        struct epoll_event events[16];
+        int ready = epoll_wait(epoll_fd, events, 16, live ? 1000 : -1);
+        if (ready == -1 && errno != EINTR) break;
+        for (int i = 0; i < ready; i++) {
+            PipeEdge *edge = &edges[events[i].data.u32];
+            if (!edge->done && pipe_edge_pump(epoll_fd, edge, events[i].data.u32)) remaining--;
+        }
+        double now = monotonic_seconds();
+        if (live && now - last_report >= 1.0) {
+            print_pipe_rates(edges, edge_count, procs, now - last_report);
+            last_report = now;
+        }
+    }
+    close(epoll_fd);
+    if (live && last_report > started) fputs("\r\033[K", stderr);
+    print_pipe_summary(edges, edge_count, procs, started);
+}
+
+void execute_pipeline(CommandSegment segments[], int num_segments, int background, const char *command_text) {
+    int pipe_fds[2];
+    int prev_pipe_read_end = STDIN_FILENO;
+    pid_t pgid = 0;
+    int pipe_size = num_segments > 1 ? pipeline_pipe_size(segments) : 0;
+    bool pin_stages = num_segments > 1 && pipeline_wants_affinity(segments);
+    PipeEdge *edges = NULL; // Relay ends of each monitored pipe, with `set -o pipemon`
+    if (shell_options[OPT_PIPEMON].enabled && num_segments > 1) {
+        edges = calloc(num_segments - 1, sizeof(PipeEdge));
+    }
+
+    Job *job = create_job(command_text, num_segments, background);
+    if (!job) {
+        perror("sdn: create_job");
+        free(edges);
+        return;
+    }
+
+    fflush(stdout); // Don't let children inherit and re-emit buffered output
+
+    for (int i = 0; i < num_segments; i++) {
+        if (i < num_segments - 1) {
+            if (pipe(pipe_fds) == -1) {
+                perror("sdn: pipe");
+                exit(EXIT_FAILURE);
+            }
+            if (edges) { // Stage i writes into one pipe, stage i + 1 reads another; the relay joins them
+                int downstream[2];
+                if (pipe2(downstream, O_CLOEXEC) == -1) {
+                    perror("sdn: pipe");
+                    exit(EXIT_FAILURE);
                 }
-                globfree(&glob_result);
-                i++;
-            } else { // No wildcards
-                if (current_arg_idx < MAX_ARGS - 1) {
-                    cmd_segment->args[current_arg_idx] = strdup(current_raw_token);
-                    if (!cmd_segment->args[current_arg_idx]) { perror("sdn: strdup error"); free_command_segment_internals(cmd_segment); return -1; }
-                    current_arg_idx++;
+                fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+                edges[i].in_fd = pipe_fds[0];
+                edges[i].out_fd = downstream[1];
+                pipe_fds[0] = downstream[0];
+                if (pipe_size > 0) fcntl(edges[i].out_fd, F_SETPIPE_SZ, pipe_size);
+            }
+            // Above /proc/sys/fs/pipe-max-size this fails with EPERM; report it once and go on
+            if (pipe_size > 0 && fcntl(pipe_fds[1], F_SETPIPE_SZ, pipe_size) == -1) {
+                fprintf(stderr, "sdn: SDN_PIPE_SIZE=%d: %s\n", pipe_size, strerror(errno));
+                pipe_size = 0;
+            }
+        }
+
+        double trace_start = trace_begin();
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("sdn: fork");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pid == 0) { // Child process
+            if (job_control_enabled) {
+                setpgid(0, pgid); // pgid 0 makes the first stage the group leader
+                if (!background) tcsetpgrp(STDIN_FILENO, pgid ? pgid : getpid());
+            }
+            reset_child_signals();
+            if (pin_stages) pin_stage_to_cpu(i);
+            if (segments[i].spawn && apply_spawn_attrs(segments[i].spawn) == -1) exit(126);
+            // Builtins and compound stages never exec, so drop the relay's ends explicitly
+            for (int e = 0; edges && e <= i && e < num_segments - 1; e++) {
+                close(edges[e].in_fd);
+                close(edges[e].out_fd);
+            }
+
+            if (prev_pipe_read_end != STDIN_FILENO) {
+                if (dup2(prev_pipe_read_end, STDIN_FILENO) == -1) {
+                    perror("sdn: dup2 stdin");
+                    exit(EXIT_FAILURE);
+                }
+                close(prev_pipe_read_end);
+            }
+
+            if (i < num_segments - 1) {
+                close(pipe_fds[0]); // Close read end in child
+                if (dup2(pipe_fds[1], STDOUT_FILENO) == -1) {
+                    perror("sdn: dup2 stdout");
+                    exit(EXIT_FAILURE);
+                }
+                close(pipe_fds[1]);
+            }
+
+            if (apply_segment_redirections(&segments[i]) == -1) {
+                exit(EXIT_FAILURE);
+            }
+            if (segments[i].assignments) export_command_environment(segments[i].assignments, NULL);
+
+            if (segments[i].compound) { // Loops and groups run in this child like a subshell
+                int compound_status = execute_command_node(segments[i].compound);
+                fflush(stdout);
+                exit(compound_status);
+            }
+            if (segments[i].args[0] == NULL) {
+                fprintf(stderr, "sdn: attempt to execute empty command\n");
+                exit(EXIT_FAILURE);
+            }
+            Node *function_body = find_function(segments[i].args[0]);
+            if (function_body) {
+                int function_status = call_function(function_body, segments[i].args);
+                fflush(stdout);
+                exit(function_status);
+            }
+            const BuiltinEntry *builtin = find_builtin_for_args(segments[i].args);
+            if (builtin) { // Run in this child without exec; state changes stay local to it
+                int builtin_status = builtin->handler(segments[i].args);
+                fflush(stdout);
+                exit(builtin_status);
+            }
+            if (shell_options[OPT_ARGBATCH].enabled &&
+                (long)argv_footprint(segments[i].args) > effective_arg_max()) {
+                fflush(stdout);
+                exit(run_argv_batches(&segments[i]));
+            }
+            if (execvp(segments[i].args[0], segments[i].args) == -1) {
+                if (errno == E2BIG) {
+                    fprintf(stderr, "sdn: %s: argument list too long (see `set -o argbatch`)\n", segments[i].args[0]);
                 } else {
-                    fprintf(stderr, "sdn: too many arguments for command\n");
-                    free_command_segment_internals(cmd_segment); return -1;
+                    perror("sdn: execvp failed");
                 }
-                i++;
+                exit(EXIT_FAILURE);
+            }
+        } else { // Parent process
+            // Set the group here too so it exists before either side relies on it
+            if (pgid == 0) pgid = pid;
+            if (job_control_enabled) setpgid(pid, pgid);
+            job->procs[i].pid = pid;
+            clock_gettime(CLOCK_MONOTONIC, &job->procs[i].started);
+            const char *stage_name = segments[i].args[0] ? segments[i].args[0] :
+                                     segments[i].compound ? node_label(segments[i].compound) : "";
+            strncpy(job->procs[i].name, stage_name, sizeof(job->procs[i].name) - 1);
+            job->pgid = pgid;
+            trace_end("fork", trace_start, stage_name);
+
+            if (prev_pipe_read_end != STDIN_FILENO) {
+                close(prev_pipe_read_end);
+            }
+            if (i < num_segments - 1) {
+                close(pipe_fds[1]); // Close write end in parent
+                prev_pipe_read_end = pipe_fds[0];
             }
         }
     }
-    cmd_segment->args[current_arg_idx] = NULL; 
-    return 0;
+
+    pid_t monitor_pid = -1;
+    if (edges) {
+        monitor_pid = fork();
+        if (monitor_pid == 0) {
+            if (job_control_enabled) setpgid(0, pgid); // Ctrl+C and Ctrl+Z reach it with the job
+            reset_child_signals();
+            run_pipe_monitor(edges, num_segments - 1, job->procs);
+            _exit(0);
+        }
+        if (monitor_pid == -1) perror("sdn: pipemon: fork");
+        else if (job_control_enabled) setpgid(monitor_pid, pgid);
+        for (int e = 0; e < num_segments - 1; e++) {
+            close(edges[e].in_fd);
+            close(edges[e].out_fd);
+        }
+        free(edges);
+    }
+
+    if (!background) {
+        // The pipeline's status is that of its last stage
+        int job_id = job->id;
+        last_exit_status = run_job_in_foreground(job, false);
+        // Once the job has finished, let the relay print its summary before the
+        // prompt (wait_for_job() may have reaped it already). A stopped job keeps
+        // its relay, stopped with it in the same group; reap_children() collects it later.
+        if (!find_job_by_id(job_id)) {
+            while (monitor_pid > 0 && waitpid(monitor_pid, NULL, 0) == -1 && errno == EINTR) {}
+        }
+    } else {
+        if (interactive_shell) printf("[%d] %d\n", job->id, (int)job->procs[num_segments - 1].pid);
+        last_exit_status = 0;
+    }
 }
 
-void handle_export_builtin(char **args) {
-    if (args[1] == NULL) {
-        // List all environment variables set by this shell instance (those in variable_table and also in environ)
-        // Or simply list all shell variables that have been exported.
-        // For simplicity now, list all shell variables and mark if they are in environ.
-        printf("Shell Variables (export VAR or VAR=value to set/export):\n");
-        for(int i=0; i<variable_count; ++i) {
-            const char* env_val = getenv(variable_table[i].name);
-            printf("  %s=%s%s\n", variable_table[i].name, variable_table[i].value, env_val ? " (exported)" : "");
+// Run a compound command, function or builtin (whichever is set, in that
+// order) in the shell process itself, honouring the segment's redirections,
+// and record the same stats a forked stage gets.
+int run_stage_in_shell(CommandSegment *segment, Node *function_body, const BuiltinEntry *builtin, bool timed) {
+    // There is no child to wait4() on; measure the shell and whatever it waited for
+    struct rusage self_before, children_before;
+    struct timespec started, finished;
+    if (timed) {
+        getrusage(RUSAGE_SELF, &self_before);
+        getrusage(RUSAGE_CHILDREN, &children_before);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    int status = 1;
+    SavedStdio saved;
+    if (redirect_shell_stdio(segment, &saved) == 0) {
+        char **saved_environment = NULL;
+        if (segment->assignments) export_command_environment(segment->assignments, &saved_environment);
+
+        if (segment->compound) {
+            status = execute_command_node(segment->compound);
+        } else if (function_body) {
+            status = call_function(function_body, segment->args);
+        } else {
+            status = builtin->handler(segment->args);
+        }
+
+        if (segment->assignments) restore_command_environment(segment->assignments, saved_environment);
+        restore_shell_stdio(&saved);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    reset_pipeline_stats(1);
+    if (last_pipeline_stats.count == 1) {
+        struct rusage usage_delta;
+        memset(&usage_delta, 0, sizeof(usage_delta));
+        if (timed) {
+            struct rusage self_after, children_after;
+            getrusage(RUSAGE_SELF, &self_after);
+            getrusage(RUSAGE_CHILDREN, &children_after);
+            struct timeval self_user, self_sys, children_user, children_sys;
+            timersub(&self_after.ru_utime, &self_before.ru_utime, &self_user);
+            timersub(&self_after.ru_stime, &self_before.ru_stime, &self_sys);
+            timersub(&children_after.ru_utime, &children_before.ru_utime, &children_user);
+            timersub(&children_after.ru_stime, &children_before.ru_stime, &children_sys);
+            timeradd(&self_user, &children_user, &usage_delta.ru_utime);
+            timeradd(&self_sys, &children_sys, &usage_delta.ru_stime);
+            usage_delta.ru_maxrss = self_after.ru_maxrss > children_after.ru_maxrss ? self_after.ru_maxrss : children_after.ru_maxrss;
+            usage_delta.ru_nvcsw = (self_after.ru_nvcsw - self_before.ru_nvcsw) + (children_after.ru_nvcsw - children_before.ru_nvcsw);
+            usage_delta.ru_nivcsw = (self_after.ru_nivcsw - self_before.ru_nivcsw) + (children_after.ru_nivcsw - children_before.ru_nivcsw);
+        }
+        double wall = timespec_seconds_between(&started, &finished);
+        const char *name = segment->compound ? node_label(segment->compound) : segment->args[0];
+        fill_stage_stats(&last_pipeline_stats.stages[0], name, wall, &usage_delta);
+        last_pipeline_stats.wall_seconds = wall;
+    }
+    return status;
+}
+
+#define FAST_ARGV_MAX 16
+
+// Fast path for what loop bodies mostly consist of: a lone builtin or function
+// call with no redirections, globs or assignments. Its argv lives on the stack
+// and words that expand to themselves are borrowed from the parse tree, so the
+// only heap traffic is for words that actually change. Returns false without
+// running anything if the command does not qualify.
+bool try_run_simple_in_shell(Node *node, int *status_out) {
+    SimpleCommand *cmd = &node->commands[0];
+    if (node->command_count != 1 || node->background || node->timed || cmd->compound ||
+        cmd->assignment_count > 0 || cmd->word_count > FAST_ARGV_MAX || strpbrk(cmd->words[0], "$`'\"\\")) {
+        return false;
+    }
+    for (int i = 0; i < cmd->word_count; i++) {
+        const char *word = cmd->words[i];
+        if (is_redirection_word(word) || has_glob_pattern(word) ||
+            word_is_command_substitution(word) || word_is_process_substitution(word)) { // These need the segment path
+            return false;
+        }
+    }
+    Node *function_body = find_function(cmd->words[0]);
+    const BuiltinEntry *builtin = function_body ? NULL : find_builtin(cmd->words[0]);
+    if (!function_body && (!builtin || builtin->handles)) return false; // handles() needs the expanded words
+
+    char *argv[FAST_ARGV_MAX + 1];
+    bool owned[FAST_ARGV_MAX];
+    int status = 0;
+    int count = 0;
+    expansion_failed = false;
+    for (; count < cmd->word_count; count++) {
+        char *expanded = expand_single_argument(cmd->words[count]);
+        owned[count] = expanded != NULL;
+        argv[count] = expanded ? expanded : cmd->words[count];
+        if (expansion_failed) {
+            status = 1;
+            break;
+        }
+    }
+    argv[count] = NULL;
+
+    if (status == 0) {
+        CommandSegment segment;
+        memset(&segment, 0, sizeof(segment));
+        segment.args = argv;
+        segment.arg_count = count;
+        double trace_start = trace_begin();
+        status = run_stage_in_shell(&segment, function_body, builtin, false);
+        trace_end(builtin ? "builtin" : "function", trace_start, argv[0]);
+    }
+    for (int i = 0; i < count; i++) {
+        if (owned[i]) free(argv[i]);
+    }
+    *status_out = last_exit_status = status;
+    return true;
+}
+
+// --- Pipeline optimizer ---
+// Runs over the expanded segments before a pipeline starts and removes stages
+// that only copy bytes, so fewer processes and pipe hops are needed. A stage
+// that is removed is always a plain `cat` whose output would be the same
+// bytes: its neighbours still see a pipe, or for `cat FILE | cmd` the file
+// itself, which must be a readable regular file so that no error message or
+// exit status moves from cat to cmd, and cmd must be an external program. A
+// builtin left alone by fusing runs in the shell, so only builtins that just
+// print (substitution_safe) are fused; `cd dir | cat` keeps its own process
+// and cannot change the shell.
+
+// True if a segment is exactly `cat` followed by arg_count - 1 words, with
+// no redirections, assignments or user function shadowing the builtin
+bool segment_is_plain_cat(const CommandSegment *segment, int arg_count) {
+    return !segment->compound && !segment->spawn && !segment->assignments && !segment->inputFile &&
+           !segment->inputText && !segment->outputFile && segment->arg_count == arg_count && segment->args[0] != NULL &&
+           strcmp(segment->args[0], "cat") == 0 && !find_function("cat") &&
+           (arg_count == 1 || segment->args[1][0] != '-');
+}
+
+void trace_pipeline_rewrite(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+void trace_pipeline_rewrite(const char *format, ...) {
+    if (!shell_options[OPT_PIPETRACE].enabled) return;
+    va_list ap;
+    va_start(ap, format);
+    fputs("sdn: pipeline: ", stderr);
+    vfprintf(stderr, format, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+void remove_segment(CommandSegment *segments, int *num_segments, int index) {
+    free_command_segment_internals(&segments[index]);
+    memmove(&segments[index], &segments[index + 1], (*num_segments - index - 1) * sizeof(CommandSegment));
+    (*num_segments)--;
+}
+
+// True if a segment runs a program. A lone builtin, function or compound
+// command runs inside the shell, so one left alone by a rewrite would change
+// the shell's state (`cat f | cd /`); those keep their pipeline.
+bool segment_is_external(const CommandSegment *segment) {
+    return !segment->compound && segment->args[0] && !find_function(segment->args[0]) &&
+           !find_builtin(segment->args[0]);
+}
+
+// True if path opens for reading as a regular file, so `< path` behaves like `cat path`
+bool is_readable_regular_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) return false;
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    close(fd);
+    return regular;
+}
+
+// Rewrite the pipeline in place. Returns the new number of segments.
+int optimize_pipeline(CommandSegment *segments, int num_segments) {
+    int original = num_segments;
+    int removed = 0; // Stages dropped so far, all before i: the trace shows original stage numbers
+    for (int i = 0; i < num_segments && num_segments > 1; ) {
+        CommandSegment *segment = &segments[i];
+        if (!segment_is_plain_cat(segment, 1)) {
+            i++;
+            continue;
+        }
+        if (i > 0 && i < num_segments - 1) { // `a | cat | b`: the pipe from a can go to b directly
+            trace_pipeline_rewrite("stage %d: dropped `cat' between `%s' and `%s'", i + removed + 1,
+                                   segments[i - 1].args[0] ? segments[i - 1].args[0] : "(compound)",
+                                   segments[i + 1].args[0] ? segments[i + 1].args[0] : "(compound)");
+            remove_segment(segments, &num_segments, i);
+            removed++;
+            continue;
+        }
+        CommandSegment *prev = i > 0 ? &segments[i - 1] : NULL;
+        const BuiltinEntry *builtin = prev && !prev->compound && prev->args[0] ? find_builtin(prev->args[0]) : NULL;
+        if (builtin && builtin->substitution_safe && !prev->outputFile && !prev->spawn &&
+            !find_function(prev->args[0])) {
+            // `builtin | cat`: a builtin cannot tell a tty from a pipe, so the two fuse into one stage
+            trace_pipeline_rewrite("stage %d: fused trailing `cat' into builtin `%s'", i + removed + 1, prev->args[0]);
+            remove_segment(segments, &num_segments, i);
+            continue;
+        }
+        i++;
+    }
+
+    if (num_segments > 1 && segment_is_plain_cat(&segments[0], 2) && strcmp(segments[0].args[1], "-") != 0 &&
+        !segments[1].inputFile && !segments[1].inputText && segment_is_external(&segments[1]) &&
+        is_readable_regular_file(segments[0].args[1])) {
+        // `cat FILE | cmd` -> `cmd < FILE`: cmd reads the file itself, with no copy through a pipe
+        char *file = strdup(segments[0].args[1]);
+        if (file) {
+            trace_pipeline_rewrite("`cat %s | %s' -> `%s < %s'", file,
+                                   segments[1].args[0] ? segments[1].args[0] : "(compound)",
+                                   segments[1].args[0] ? segments[1].args[0] : "(compound)", file);
+            segments[1].inputFile = file;
+            remove_segment(segments, &num_segments, 0);
+        }
+    }
+    if (num_segments != original) {
+        trace_pipeline_rewrite("%d stages -> %d", original, num_segments);
+    }
+    return num_segments;
+}
+
+// Expand and run one parsed pipeline. Returns its exit status.
+int execute_pipeline_node(Node *node) {
+    int fast_status;
+    if (try_run_simple_in_shell(node, &fast_status)) return fast_status;
+
+    SimpleCommand *first = &node->commands[0];
+    if (node->command_count == 1 && !node->background && !first->compound &&
+        first->word_count == first->assignment_count) {
+        // Only NAME=value words: set variables without running anything
+        expansion_failed = false;
+        return last_exit_status = assign_shell_variables(first->words, first->assignment_count);
+    }
+
+    int num_segments = node->command_count;
+    CommandSegment *command_segments = calloc(num_segments, sizeof(CommandSegment));
+    if (!command_segments) {
+        perror("sdn: calloc");
+        return last_exit_status = 1;
+    }
+
+    int status = 0;
+    int built = 0;
+    int substitution_mark = process_substitution_count;
+    expansion_failed = false;
+    for (; built < num_segments; built++) {
+        SimpleCommand *cmd = &node->commands[built];
+        CommandSegment *segment = &command_segments[built];
+        double trace_start = trace_begin();
+        if (build_segment_from_tokens(cmd->words + cmd->assignment_count,
+                                      cmd->word_count - cmd->assignment_count, segment) == -1) {
+            status = 1;
+            break;
+        }
+        segment->compound = cmd->compound;
+        if (cmd->assignment_count > 0) {
+            segment->assignments = expand_assignments(cmd->words, cmd->assignment_count);
+            if (!segment->assignments) {
+                status = 1;
+                break;
+            }
+        }
+        if (segment->args[0] != NULL) { // Ensure there are args to expand
+            expand_segment_args(segment);
+        }
+        trace_end("expand", trace_start, segment->args[0]);
+        if (expansion_failed) {
+            status = 1;
+            break;
+        }
+        if (extract_spawn_modifiers(segment) == -1) {
+            status = 2;
+            break;
+        }
+    }
+
+    if (built == num_segments) {
+        double trace_start = trace_begin();
+        num_segments = optimize_pipeline(command_segments, num_segments);
+        trace_end("optimize", trace_start, NULL);
+        CommandSegment *only = &command_segments[0];
+        Node *function_body = NULL;
+        const BuiltinEntry *builtin = NULL;
+        if (num_segments == 1 && !node->background && !only->compound && !only->spawn && only->args[0] != NULL) {
+            function_body = find_function(only->args[0]);
+            if (!function_body) builtin = find_builtin_for_args(only->args);
+            // handles() sees only the words: input redirected from anything but
+            // a regular file (`cat < fifo`) could block the shell, so it forks
+            if (builtin && builtin->handles && only->inputFile && !is_regular_path(only->inputFile)) builtin = NULL;
+        }
+        if (num_segments == 1 && !node->background && (only->compound || function_body || builtin)) {
+            trace_start = trace_begin();
+            status = run_stage_in_shell(only, function_body, builtin, node->timed);
+            trace_end(builtin ? "builtin" : function_body ? "function" : "compound", trace_start, only->args[0]);
+            last_exit_status = status;
+        } else {
+            execute_pipeline(command_segments, num_segments, node->background, node->source_text);
+            status = last_exit_status;
+        }
+        if (node->timed && !node->background) print_pipeline_stats();
+    } else {
+        last_exit_status = status;
+    }
+
+    finish_process_substitutions(substitution_mark, !node->background);
+    for (int k = 0; k < num_segments; k++) {
+        free_command_segment_internals(&command_segments[k]);
+    }
+    free(command_segments);
+    return status;
+}
+
+// Run a compound command or && list as a background job in a forked child
+int run_node_in_background(Node *node) {
+    CommandSegment segment;
+    memset(&segment, 0, sizeof(segment));
+    segment.args = calloc(1, sizeof(char*));
+    if (!segment.args) {
+        perror("sdn: calloc");
+        return last_exit_status = 1;
+    }
+    segment.compound = node;
+    execute_pipeline(&segment, 1, 1, node->source_text);
+    free_command_segment_internals(&segment);
+    return last_exit_status;
+}
+
+// True while a break, continue, return, exit or Ctrl+C is unwinding execution
+bool execution_unwinding() {
+    return exit_requested || return_requested || break_levels > 0 || continue_levels > 0 || interrupt_pending;
+}
+
+// Expand a for loop's word list like command arguments, then split unquoted
+// expansions on whitespace; "$@" gives each positional parameter as one item.
+int expand_for_words(Node *node, CommandSegment *items) {
+    memset(items, 0, sizeof(*items));
+    items->arg_capacity = MAX_ARGS;
+    items->args = calloc(items->arg_capacity, sizeof(char*));
+    if (!items->args) {
+        perror("sdn: calloc");
+        return -1;
+    }
+    if (node->command_count == 0) { // for name; do ...: loop over the positional parameters
+        for (int i = 1; i < positional_count; i++) {
+            if (add_segment_arg(items, positional_params[i]) == -1) return -1;
         }
-        return;
+        return 0;
     }
 
-    for (int i = 1; args[i] != NULL; i++) {
-        char *arg_copy = strdup(args[i]);
-        if (!arg_copy) {
-            perror("sdn: strdup failed in export");
+    SimpleCommand *words = &node->commands[0];
+    expansion_failed = false;
+    for (int w = 0; w < words->word_count; w++) {
+        char *raw = words->words[w];
+        if (strcmp(raw, "\"$@\"") == 0) {
+            for (int i = 1; i < positional_count; i++) {
+                if (add_segment_arg(items, positional_params[i]) == -1) return -1;
+            }
             continue;
         }
 
-        char *eq_ptr = strchr(arg_copy, '=');
-        char *var_name;
-        const char *var_value_str; // This will be the string representation of the value
+        CommandSegment expanded;
+        if (build_segment_from_tokens(&raw, 1, &expanded) == -1) return -1;
+        expand_variables_in_args(expanded.args);
+        bool split = raw[0] != '"' && raw[0] != '\'' && strpbrk(raw, "$`") != NULL;
+        for (int i = 0; expanded.args[i] != NULL && !expansion_failed; i++) {
+            if (!split) {
+                if (add_segment_arg(items, expanded.args[i]) == -1) break;
+                continue;
+            }
+            char *save_ptr;
+            for (char *field = strtok_r(expanded.args[i], " \t\n", &save_ptr); field != NULL;
+                 field = strtok_r(NULL, " \t\n", &save_ptr)) {
+                if (add_segment_arg(items, field) == -1) break;
+            }
+        }
+        free_command_segment_internals(&expanded);
+        if (expansion_failed) return -1;
+    }
+    return 0;
+}
 
-        if (eq_ptr != NULL) { // Case: export VAR=value
-            *eq_ptr = '\0'; // Split name and value
-            var_name = arg_copy;
-            var_value_str = eq_ptr + 1;
-            
-            // Unquote the value part if it's quoted
-            char temp_value_for_unquoting[MAX_VAR_VALUE_LEN];
-            strncpy(temp_value_for_unquoting, var_value_str, MAX_VAR_VALUE_LEN -1);
-            temp_value_for_unquoting[MAX_VAR_VALUE_LEN-1] = '\0';
-            unquote_string_in_place(temp_value_for_unquoting);
+// Consume a pending break/continue at a loop boundary. Returns true if the loop should stop.
+bool loop_should_stop() {
+    if (break_levels > 0) {
+        break_levels--;
+        return true;
+    }
+    if (continue_levels > 0) {
+        continue_levels--;
+        return continue_levels > 0; // continue N targets an outer loop
+    }
+    return exit_requested || return_requested || interrupt_pending;
+}
 
-            if (!is_valid_variable_name(var_name)) {
-                 fprintf(stderr, "sdn: export: '%s': not a valid identifier\n", var_name);
-                 free(arg_copy);
-                 continue;
-            }
-            set_shell_variable(var_name, temp_value_for_unquoting); // Set/update in shell's internal table
-            // Use temp_value_for_unquoting for setenv as well
-            if (setenv(var_name, temp_value_for_unquoting, 1) != 0) {
-                perror("sdn: export: setenv failed");
+// Run a parsed node in the foreground of the current process. Loops, tests
+// and builtin-only bodies never fork; only external commands and pipelines do.
+int execute_command_node(Node *node) {
+    switch (node->type) {
+        case NODE_LIST:
+            for (int i = 0; i < node->child_count && !execution_unwinding(); i++) {
+                execute_node(node->children[i]);
             }
-        } else { // Case: export VAR
-            var_name = arg_copy;
-            if (!is_valid_variable_name(var_name)) {
-                 fprintf(stderr, "sdn: export: '%s': not a valid identifier\n", var_name);
-                 free(arg_copy);
-                 continue;
+            return last_exit_status;
+        case NODE_PIPELINE:
+            return execute_pipeline_node(node);
+        case NODE_AND:
+        case NODE_OR: {
+            int status = execute_node(node->children[0]);
+            if (!execution_unwinding() && (status == 0) == (node->type == NODE_AND)) {
+                execute_node(node->children[1]);
             }
-            var_value_str = get_shell_variable(var_name); // Get from shell's internal table
-            if (var_value_str != NULL) {
-                if (setenv(var_name, var_value_str, 1) != 0) { // Value is already unquoted from table
-                    perror("sdn: export: setenv failed");
-                }
-            } else {
-                 // If not in shell variables, check if it's an environment variable already
-                 // If so, it's effectively "exported". If not, it's an error to export non-existent var.
-                if (getenv(var_name) == NULL) {
-                    fprintf(stderr, "sdn: export: variable '%s' not found in shell or environment\n", var_name);
+            return last_exit_status;
+        }
+        case NODE_NOT:
+            execute_node(node->children[0]);
+            return last_exit_status = !last_exit_status;
+        case NODE_IF: {
+            int condition = execute_node(node->children[0]);
+            if (execution_unwinding()) return last_exit_status;
+            if (condition == 0) return execute_node(node->children[1]);
+            if (node->child_count > 2) return execute_node(node->children[2]);
+            return last_exit_status = 0;
+        }
+        case NODE_WHILE:
+        case NODE_UNTIL: {
+            int status = 0;
+            loop_depth++;
+            while (1) {
+                int condition = execute_node(node->children[0]);
+                if (execution_unwinding()) {
+                    if (loop_should_stop()) break;
+                    continue;
                 }
-                // If it exists in env but not shell, setenv will effectively re-export it or do nothing if value is same.
-                // No explicit action needed if it's already an env var but not a shell var.
+                if ((condition == 0) != (node->type == NODE_WHILE)) break;
+                status = execute_node(node->children[1]);
+                if (execution_unwinding() && loop_should_stop()) break;
             }
+            loop_depth--;
+            return last_exit_status = status;
         }
-        free(arg_copy);
+        case NODE_FOR: {
+            CommandSegment items;
+            if (expand_for_words(node, &items) == -1) {
+                free_command_segment_internals(&items);
+                return last_exit_status = 1;
+            }
+            int status = 0;
+            loop_depth++;
+            for (int i = 0; i < items.arg_count; i++) {
+                set_shell_variable(node->name, items.args[i]);
+                status = execute_node(node->children[0]);
+                if (execution_unwinding() && loop_should_stop()) break;
+            }
+            loop_depth--;
+            free_command_segment_internals(&items);
+            return last_exit_status = status;
+        }
+        case NODE_FUNCTION:
+            return last_exit_status = define_function(node->name, node->children[0]);
     }
+    return last_exit_status;
 }
 
-void execute_pipeline(CommandSegment segments[], int num_segments, int background) {
-    int pipe_fds[2];
-    int prev_pipe_read_end = STDIN_FILENO;
-    pid_t pids[MAX_COMMAND_SEGMENTS];
-    int status;
+// Run a parsed tree. Returns the exit status of the last command run.
+int execute_node(Node *node) {
+    if (node->background && node->type != NODE_PIPELINE) {
+        return run_node_in_background(node);
+    }
+    return execute_command_node(node);
+}
 
-    for (int i = 0; i < num_segments; i++) {
-        if (i < num_segments - 1) {
-            if (pipe(pipe_fds) == -1) {
-                perror("sdn: pipe");
-                exit(EXIT_FAILURE);
-            }
+// Read all of fd into a NUL-terminated heap buffer
+char *read_whole_fd(int fd) {
+    size_t capacity = 4096, length = 0;
+    char *text = malloc(capacity);
+    if (!text) return NULL;
+    while (1) {
+        if (length + 1 >= capacity) {
+            char *grown = realloc(text, capacity * 2);
+            if (!grown) { free(text); return NULL; }
+            text = grown;
+            capacity *= 2;
         }
+        ssize_t n = read(fd, text + length, capacity - length - 1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) { free(text); return NULL; }
+        if (n == 0) break;
+        length += n;
+    }
+    text[length] = '\0';
+    return text;
+}
 
-        pids[i] = fork();
-        if (pids[i] < 0) {
-            perror("sdn: fork");
-            exit(EXIT_FAILURE);
-        }
+// Batch mode: parse the whole script once, then run the tree. No line editor,
+// history or job control. Returns the script's exit status.
+int run_script(const char *text, const char *source_name) {
+    ParseStatus parse_status;
+    char error[128];
+    int error_line;
+    double trace_start = trace_begin();
+    Node *root = parse_script(text, &parse_status, error, sizeof(error), &error_line);
+    trace_end("parse", trace_start, source_name);
+    if (!root) {
+        fprintf(stderr, "sdn: %s: line %d: %s\n", source_name, error_line, error);
+        return 2;
+    }
+    trace_start = trace_begin();
+    int status = execute_node(root);
+    trace_end("execute", trace_start, source_name);
+    free_node(root);
+    reap_children();
+    return status;
+}
 
-        if (pids[i] == 0) { // Child process
-            if (prev_pipe_read_end != STDIN_FILENO) {
-                if (dup2(prev_pipe_read_end, STDIN_FILENO) == -1) {
-                    perror("sdn: dup2 stdin");
-                    exit(EXIT_FAILURE);
-                }
-                close(prev_pipe_read_end);
-            }
+// --- Prompt ---
+// The prompt is built from $SDN_PROMPT (default "%d%g%s%t> "):
+//   %d  current directory
+//   %b  git branch, or the short commit when HEAD is detached
+//   %g  " (branch)" in a git work tree, with a `*` once it is known to be dirty
+//   %s  " [N]" when the last command exited with status N != 0
+//   %t  " 2.5s" when the last command took a second or more
+//   %%  a literal %
+// The branch comes from reading .git/HEAD, never from running git. Whether
+// the work tree is dirty means comparing the stat data of every index entry
+// with the file on disk, which is slow in huge repositories, so a worker
+// thread does it. The prompt is printed at once with the last known state and
+// patched through the event loop when the worker reports back.
 
-            if (i < num_segments - 1) {
-                close(pipe_fds[0]); // Close read end in child
-                if (dup2(pipe_fds[1], STDOUT_FILENO) == -1) {
-                    perror("sdn: dup2 stdout");
-                    exit(EXIT_FAILURE);
-                }
-                close(pipe_fds[1]);
-            }
+#define DEFAULT_PROMPT_FORMAT "%d%g%s%t> "
+#define PROMPT_SIZE (FILENAME_MAX + 256)
 
-            if (segments[i].inputFile) {
-                int fd_in = open(segments[i].inputFile, O_RDONLY);
-                if (fd_in == -1) {
-                    perror("sdn: open input file");
-                    exit(EXIT_FAILURE);
-                }
-                if (dup2(fd_in, STDIN_FILENO) == -1) {
-                    perror("sdn: dup2 input file");
-                    exit(EXIT_FAILURE);
-                }
-                close(fd_in);
-            }
+typedef struct {
+    char cwd[FILENAME_MAX];       // Directory the fields below were found from
+    bool found;
+    char work_tree[FILENAME_MAX];
+    char git_dir[FILENAME_MAX * 2 + 16];
+    int dirty;                    // 1 dirty, 0 clean, -1 not known yet
+} PromptGitState;
 
-            if (segments[i].outputFile) {
-                int flags = O_WRONLY | O_CREAT;
-                if (segments[i].appendMode) {
-                    flags |= O_APPEND;
-                } else {
-                    flags |= O_TRUNC;
-                }
-                int fd_out = open(segments[i].outputFile, flags, 0644);
-                if (fd_out == -1) {
-                    perror("sdn: open output file");
-                    exit(EXIT_FAILURE);
-                }
-                if (dup2(fd_out, STDOUT_FILENO) == -1) {
-                    perror("sdn: dup2 output file");
-                    exit(EXIT_FAILURE);
-                }
-                close(fd_out);
-            }
-            
-            if (segments[i].args[0] == NULL) {
-                fprintf(stderr, "sdn: attempt to execute empty command\n");
-                exit(EXIT_FAILURE);
-            }
-            if (execvp(segments[i].args[0], segments[i].args) == -1) {
-                perror("sdn: execvp failed");
-                exit(EXIT_FAILURE);
-            }
-        } else { // Parent process
-            if (prev_pipe_read_end != STDIN_FILENO) {
-                close(prev_pipe_read_end);
-            }
-            if (i < num_segments - 1) {
-                close(pipe_fds[1]); // Close write end in parent
-                prev_pipe_read_end = pipe_fds[0];
+typedef struct {
+    char work_tree[FILENAME_MAX];
+    char index_path[FILENAME_MAX * 2 + 32];
+    int result;
+} GitStatusJob;
+
+char current_prompt[PROMPT_SIZE];
+bool current_prompt_is_primary = false; // False while a continuation prompt is shown
+double last_command_seconds = 0;
+PromptGitState prompt_git = {.dirty = -1};
+GitStatusJob git_status_job;
+pthread_t git_status_thread;
+bool git_status_running = false;
+bool git_status_rerun = false; // The tree may have changed since the running scan started
+int git_status_event_fd = -1;
+
+uint32_t read_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// 1 if a tracked file differs from its index entry by stat data, else 0.
+// Untracked files are not looked for. Runs on the worker thread, so it
+// touches nothing but its arguments and does not allocate.
+int git_worktree_dirty(const char *work_tree, const char *index_path) {
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0; // No index yet: nothing is tracked
+    struct stat index_stat;
+    if (fstat(fd, &index_stat) == -1 || index_stat.st_size < 12) {
+        close(fd);
+        return 0;
+    }
+    size_t size = index_stat.st_size;
+    const unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+
+    int dirty = 0;
+    uint32_t version = read_be32(data + 4), count = read_be32(data + 8);
+    if (memcmp(data, "DIRC", 4) != 0 || version < 2 || version > 4) count = 0;
+    char path[FILENAME_MAX * 2];
+    size_t work_tree_len = snprintf(path, FILENAME_MAX, "%s/", work_tree);
+    size_t name_len = 0; // Length of the previous name, which version 4 names are relative to
+    size_t offset = 12;
+    for (uint32_t i = 0; i < count && !dirty; i++) {
+        if (offset + 62 > size) break;
+        const unsigned char *entry = data + offset;
+        uint32_t mtime_sec = read_be32(entry + 8), mtime_nsec = read_be32(entry + 12);
+        uint32_t mode = read_be32(entry + 24), file_size = read_be32(entry + 36);
+        uint16_t flags = entry[60] << 8 | entry[61];
+        size_t header = 62;
+        bool skip_worktree = false;
+        if (version >= 3 && (flags & 0x4000)) { // Extended flags
+            skip_worktree = entry[62] & 0x40;
+            header = 64;
+        }
+        const unsigned char *name = entry + header;
+        size_t strip = 0;
+        if (version == 4) { // Name is: strip N bytes from the previous name, then append this suffix
+            strip = *name & 127;
+            while (*name++ & 128) strip = ((strip + 1) << 7) | (*name & 127);
+        }
+        const unsigned char *end = memchr(name, '\0', size - (name - data));
+        if (!end) break;
+        if (version == 4) {
+            if (strip > name_len) break;
+            name_len -= strip;
+            size_t suffix = end - name;
+            if (work_tree_len + name_len + suffix >= sizeof(path)) break;
+            memcpy(path + work_tree_len + name_len, name, suffix + 1);
+            name_len += suffix;
+            offset = end + 1 - data;
+        } else {
+            name_len = end - name;
+            if (work_tree_len + name_len >= sizeof(path)) break;
+            memcpy(path + work_tree_len, name, name_len + 1);
+            offset += (header + name_len + 8) & ~(size_t)7; // NUL padded to a multiple of 8
+        }
+
+        if (flags & 0x3000) { // Unmerged: a conflict is in progress
+            dirty = 1;
+        } else if (!(flags & 0x8000) && !skip_worktree && (mode & S_IFMT) != 0160000) { // Not submodules
+            struct stat st;
+            if (lstat(path, &st) == -1 || (uint32_t)st.st_size != file_size ||
+                (uint32_t)st.st_mtim.tv_sec != mtime_sec || (uint32_t)st.st_mtim.tv_nsec != mtime_nsec ||
+                ((mode & S_IFMT) == S_IFREG && (mode & 0100) != (st.st_mode & 0100))) {
+                dirty = 1;
             }
         }
     }
+    munmap((void *)data, size);
+    return dirty;
+}
 
-    if (!background) {
-        for (int i = 0; i < num_segments; i++) {
-            waitpid(pids[i], &status, 0);
+void *git_status_worker(void *arg) {
+    GitStatusJob *job = arg;
+    job->result = git_worktree_dirty(job->work_tree, job->index_path);
+    eventfd_write(git_status_event_fd, 1);
+    return NULL;
+}
+
+void start_git_status_scan() {
+    if (git_status_running) {
+        git_status_rerun = true;
+        return;
+    }
+    snprintf(git_status_job.work_tree, sizeof(git_status_job.work_tree), "%s", prompt_git.work_tree);
+    snprintf(git_status_job.index_path, sizeof(git_status_job.index_path), "%s/index", prompt_git.git_dir);
+    if (git_status_event_fd == -1 || pthread_create(&git_status_thread, NULL, git_status_worker, &git_status_job) != 0) {
+        // No event loop to report through: scan now
+        prompt_git.dirty = git_worktree_dirty(git_status_job.work_tree, git_status_job.index_path);
+        return;
+    }
+    git_status_running = true;
+    git_status_rerun = false;
+}
+
+void render_prompt();
+
+void handle_git_status_event(int fd, void *data) {
+    (void)data;
+    eventfd_t value;
+    if (eventfd_read(fd, &value) == -1 || !git_status_running) return;
+    pthread_join(git_status_thread, NULL);
+    git_status_running = false;
+    if (strcmp(git_status_job.work_tree, prompt_git.work_tree) != 0) return; // The shell moved on
+    bool changed = prompt_git.dirty != git_status_job.result;
+    prompt_git.dirty = git_status_job.result;
+    if (git_status_rerun) start_git_status_scan();
+    if (changed && current_prompt_is_primary) {
+        render_prompt();
+        redraw_requested = true;
+    }
+}
+
+void init_prompt() {
+    git_status_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (git_status_event_fd != -1 && event_loop_add(git_status_event_fd, handle_git_status_event, NULL) == -1) {
+        close(git_status_event_fd);
+        git_status_event_fd = -1;
+    }
+}
+
+// Find the work tree and git directory containing cwd, if it changed since last time
+void locate_git_repository(const char *cwd) {
+    if (strcmp(prompt_git.cwd, cwd) == 0) return;
+    snprintf(prompt_git.cwd, sizeof(prompt_git.cwd), "%s", cwd);
+    char dir[FILENAME_MAX];
+    snprintf(dir, sizeof(dir), "%s", cwd);
+    bool found = false;
+    do {
+        char dot_git[FILENAME_MAX + 8];
+        struct stat st;
+        snprintf(dot_git, sizeof(dot_git), "%s/.git", strcmp(dir, "/") == 0 ? "" : dir);
+        if (stat(dot_git, &st) == -1) continue;
+        if (S_ISDIR(st.st_mode)) {
+            snprintf(prompt_git.git_dir, sizeof(prompt_git.git_dir), "%s", dot_git);
+        } else { // A worktree or submodule: .git holds "gitdir: path"
+            char link[FILENAME_MAX];
+            int fd = open(dot_git, O_RDONLY | O_CLOEXEC);
+            ssize_t n = fd == -1 ? -1 : read(fd, link, sizeof(link) - 1);
+            if (fd != -1) close(fd);
+            if (n <= 8 || strncmp(link, "gitdir: ", 8) != 0) continue;
+            link[n] = '\0';
+            link[strcspn(link, "\n")] = '\0';
+            if (link[8] == '/') snprintf(prompt_git.git_dir, sizeof(prompt_git.git_dir), "%s", link + 8);
+            else snprintf(prompt_git.git_dir, sizeof(prompt_git.git_dir), "%s/%s", dir, link + 8);
         }
-    } else {
-        for (int i = 0; i < num_segments; i++) {
-             printf("[%d] ", pids[i]);
+        found = true;
+        break;
+    } while (parent_directory(dir));
+
+    if (!found || strcmp(prompt_git.work_tree, dir) != 0) prompt_git.dirty = -1; // Another repository
+    prompt_git.found = found;
+    snprintf(prompt_git.work_tree, sizeof(prompt_git.work_tree), "%s", found ? dir : "");
+}
+
+// The checked out branch, or the abbreviated commit when HEAD is detached
+bool read_git_branch(char *branch, size_t size) {
+    char head_path[FILENAME_MAX * 2 + 32], head[256];
+    snprintf(head_path, sizeof(head_path), "%s/HEAD", prompt_git.git_dir);
+    int fd = open(head_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    ssize_t n = read(fd, head, sizeof(head) - 1);
+    close(fd);
+    if (n <= 0) return false;
+    head[n] = '\0';
+    head[strcspn(head, "\n")] = '\0';
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) snprintf(branch, size, "%s", head + 16);
+    else if (strncmp(head, "ref: ", 5) == 0) snprintf(branch, size, "%s", head + 5);
+    else snprintf(branch, size, "%.7s", head);
+    return true;
+}
+
+const char *prompt_format() {
+    const char *format = get_shell_variable("SDN_PROMPT");
+    if (!format) format = getenv("SDN_PROMPT");
+    return format ? format : DEFAULT_PROMPT_FORMAT;
+}
+
+// Build current_prompt from $SDN_PROMPT
+void render_prompt() {
+    const char *format = prompt_format();
+
+    const char *cwd = current_directory();
+    if (!cwd) {
+        snprintf(current_prompt, sizeof(current_prompt), "sdn> ");
+        return;
+    }
+    char branch[256] = "";
+    bool wants_git = strstr(format, "%b") || strstr(format, "%g");
+    if (wants_git) {
+        locate_git_repository(cwd);
+        if (prompt_git.found && !read_git_branch(branch, sizeof(branch))) branch[0] = '\0';
+    }
+
+    size_t len = 0;
+    current_prompt[0] = '\0';
+    for (const char *p = format; *p && len < sizeof(current_prompt) - 1; p++) {
+        char piece[FILENAME_MAX + 300];
+        piece[0] = '\0';
+        if (*p != '%' || p[1] == '\0') {
+            piece[0] = *p;
+            piece[1] = '\0';
+        } else {
+            switch (*++p) {
+                case 'd': snprintf(piece, sizeof(piece), "%s", cwd); break;
+                case 'b': snprintf(piece, sizeof(piece), "%s", branch); break;
+                case 'g':
+                    if (branch[0]) snprintf(piece, sizeof(piece), " (%s%s)", branch, prompt_git.dirty == 1 ? "*" : "");
+                    break;
+                case 's': if (last_exit_status != 0) snprintf(piece, sizeof(piece), " [%d]", last_exit_status); break;
+                case 't':
+                    if (last_command_seconds >= 1) snprintf(piece, sizeof(piece), " %.1fs", last_command_seconds);
+                    break;
+                case '%': strcpy(piece, "%"); break;
+                default: snprintf(piece, sizeof(piece), "%%%c", *p); break;
+            }
         }
-        printf("\n");
+        len += snprintf(current_prompt + len, sizeof(current_prompt) - len, "%s", piece);
+    }
+}
+
+// Render the primary prompt and start refreshing the git dirty state behind it
+void get_prompt() {
+    render_prompt();
+    current_prompt_is_primary = true;
+    if (prompt_git.found && strstr(prompt_format(), "%g")) start_git_status_scan();
+}
+
+// --- Startup profile ---
+// `sdn --profile-startup` times each phase of interactive startup and prints
+// the breakdown on stderr just before the first prompt.
+
+#define MAX_STARTUP_PHASES 16
+
+typedef struct {
+    const char *name;
+    double seconds;
+} StartupPhase;
+
+bool profile_startup = false;
+StartupPhase startup_phases[MAX_STARTUP_PHASES];
+int startup_phase_count = 0;
+double startup_phase_mark = 0; // When the phase being timed began
+
+// Close the phase that began at the last mark and start the next one
+void end_startup_phase(const char *name) {
+    if (!profile_startup) return;
+    double now = monotonic_seconds();
+    if (startup_phase_count < MAX_STARTUP_PHASES) {
+        startup_phases[startup_phase_count].name = name;
+        startup_phases[startup_phase_count].seconds = now - startup_phase_mark;
+        startup_phase_count++;
+    }
+    startup_phase_mark = now;
+}
+
+void print_startup_profile(int history_entries) {
+    double total = 0;
+    fprintf(stderr, "%-16s %10s\n", "phase", "time");
+    for (int i = 0; i < startup_phase_count; i++) {
+        fprintf(stderr, "%-16s %8.3fms", startup_phases[i].name, startup_phases[i].seconds * 1000);
+        if (strcmp(startup_phases[i].name, "history") == 0) fprintf(stderr, "  (%d entries)", history_entries);
+        fprintf(stderr, "\n");
+        total += startup_phases[i].seconds;
     }
+    fprintf(stderr, "%-16s %8.3fms\n", "total", total * 1000);
 }
 
-int main(void) {
+int run_interactive() {
     char input_line_raw[MAX_LINE];
-    char input_line_for_parsing[MAX_LINE];
-    char history_entry_buffer[MAX_LINE];
+    char history_entry_buffer[MAX_LINE + 5]; // Room for a leading "time "
     char expanded_line[MAX_LINE];
+    char *pending_input = NULL; // Earlier lines of a construct still being typed
     
-    pid_t wpid; 
-    int status;
-    int overall_background; 
-    
-    CommandSegment command_segments[MAX_COMMAND_SEGMENTS];
-    int num_segments;
-    
+    interactive_shell = true;
     HistoryCache history_cache = {0};
+    end_startup_phase("arguments");
+    char history_file_path[FILENAME_MAX];
+    struct stat history_st;
+    get_history_file_path(history_file_path, sizeof(history_file_path));
+    if (stat(history_file_path, &history_st) == 0) maybe_compact_history(history_st.st_size);
     load_history_cache(&history_cache);
+    end_startup_phase("history");
+    init_event_loop(&history_cache);
+    init_local_alias_watch();
+    init_prompt();
+    end_startup_phase("event loop");
+    init_job_control();
+    end_startup_phase("terminal");
 
     // Initial load of local aliases for the starting directory
-    char initial_cwd[FILENAME_MAX];
-    if (getcwd(initial_cwd, sizeof(initial_cwd)) != NULL) {
-        load_local_aliases(initial_cwd);
-    }
+    const char *initial_cwd = current_directory();
+    end_startup_phase("working dir");
+    if (initial_cwd) load_local_aliases(initial_cwd);
+    end_startup_phase("local aliases");
 
     while (1) {
         
-        while ((wpid = waitpid(-1, &status, WNOHANG)) > 0) {
-            printf("Shell: Background process with PID %d terminated.\n", wpid);
-        }
+        reap_children();
+        print_job_notifications();
 
-        char prompt[FILENAME_MAX + 3];
-        get_prompt(prompt, sizeof(prompt));
-        printf("%s", prompt);
+        if (pending_input) {
+            strcpy(current_prompt, "> ");
+            current_prompt_is_primary = false;
+        } else {
+            get_prompt();
+        }
+        if (startup_phase_mark > 0) { // Only for the first prompt
+            end_startup_phase("first prompt");
+            print_startup_profile(history_cache.count);
+            startup_phase_mark = 0;
+        }
+        printf("%s", current_prompt);
         fflush(stdout);
 
-        int result = read_line_with_completion(input_line_raw, sizeof(input_line_raw), &history_cache);
+        int result = read_line_with_completion(input_line_raw, sizeof(input_line_raw), &history_cache,
+                                               current_prompt);
+        current_prompt_is_primary = false;
         
         if (result == -1) {
             printf("\nExiting sdn.\n");
             break;
         }
 
-        if (strlen(input_line_raw) == 0) {
+        if (strlen(input_line_raw) == 0 && !pending_input) {
             continue;
         }
+
+        // Aliases are expanded in the first word of each typed line, after an optional `time`
+        char *command_start = input_line_raw;
+        bool timed = false;
+        if (strncmp(command_start, "time", 4) == 0 && (command_start[4] == ' ' || command_start[4] == '\t')) {
+            timed = true;
+            command_start += 4;
+            while (*command_start == ' ' || *command_start == '\t') command_start++;
+        }
         
-        strncpy(expanded_line, input_line_raw, sizeof(expanded_line) - 1);
+        strncpy(expanded_line, command_start, sizeof(expanded_line) - 1);
         expanded_line[sizeof(expanded_line) - 1] = '\0';
 
+        double trace_start = trace_begin();
         char temp_line_for_first_word[MAX_LINE];
-        strcpy(temp_line_for_first_word, input_line_raw);
+        strcpy(temp_line_for_first_word, command_start);
         char *first_word = strtok(temp_line_for_first_word, " \t\n");
 
         if (first_word) {
             const char *alias_cmd_str = find_alias_command(first_word);
             if (alias_cmd_str) {
-                char *rest_of_command = strchr(input_line_raw, ' '); // Find first space
+                char *rest_of_command = strchr(command_start, ' '); // Find first space
                 if (rest_of_command) { // If there are arguments after the alias
                     // Skip the space itself for appending
                     snprintf(expanded_line, sizeof(expanded_line), "%s%s", alias_cmd_str, rest_of_command);
@@ -1355,13 +8374,13 @@ int main(void) {
                 }
             }
         }
+        trace_end("alias expansion", trace_start, first_word);
         
-        strncpy(history_entry_buffer, expanded_line, MAX_LINE - 1);
-        history_entry_buffer[MAX_LINE - 1] = '\0';
+        snprintf(history_entry_buffer, sizeof(history_entry_buffer), "%s%s", timed ? "time " : "", expanded_line);
 
+        // The line is written to the history file once it has run, with its status
+        trace_start = trace_begin();
         if (strlen(history_entry_buffer) > 0) {
-            save_to_history(history_entry_buffer);
-            
             int is_duplicate = 0;
             for (int i = 0; i < history_cache.count; i++) {
                 if (strcmp(history_cache.commands[i], history_entry_buffer) == 0) {
@@ -1375,140 +8394,142 @@ int main(void) {
                 history_cache.count++;
             }
         }
-        
-        strcpy(input_line_for_parsing, expanded_line);
+        trace_end("history cache", trace_start, NULL);
 
-        overall_background = 0;
-        int len = strlen(input_line_for_parsing);
-        if (len > 0 && input_line_for_parsing[len-1] == '&') {
-            overall_background = 1;
-            input_line_for_parsing[len-1] = '\0'; 
-            if (len > 1 && input_line_for_parsing[len-2] == ' ') {
-                 input_line_for_parsing[len-2] = '\0';
-            }
-        }
-        
-        if (strcmp(input_line_for_parsing, "exit") == 0) {
-            while ((wpid = waitpid(-1, &status, WNOHANG)) > 0) {
-                printf("Shell: Background process with PID %d terminated before exit.\n", wpid);
-            }
-            printf("Exiting sdn.\n");
-            break;
+        // Join with earlier lines when the previous input was incomplete
+        char *input_text;
+        if (pending_input) {
+            size_t needed = strlen(pending_input) + strlen(history_entry_buffer) + 2;
+            input_text = malloc(needed);
+            if (input_text) snprintf(input_text, needed, "%s\n%s", pending_input, history_entry_buffer);
+            free(pending_input);
+            pending_input = NULL;
+        } else {
+            input_text = strdup(history_entry_buffer);
         }
-        
-        num_segments = 0;
-        char *saveptr_pipe;
-        char *command_str = strtok_r(input_line_for_parsing, "|", &saveptr_pipe);
-        while(command_str != NULL && num_segments < MAX_COMMAND_SEGMENTS) {
-            char temp_cmd_str[MAX_LINE];
-            strncpy(temp_cmd_str, command_str, MAX_LINE-1);
-            temp_cmd_str[MAX_LINE-1] = '\0';
-
-            if (parse_single_command_segment(temp_cmd_str, &command_segments[num_segments]) == -1) {
-                num_segments = -1; // Indicate parsing error
-                break;
-            }
-            if (command_segments[num_segments].args[0] == NULL && command_segments[num_segments].inputFile == NULL && command_segments[num_segments].outputFile == NULL) {
-                // Empty segment, likely due to "||" or trailing/leading "|"
-                if (num_segments > 0 || strtok_r(NULL, "|", &saveptr_pipe) != NULL) { // only error if not the only segment or more segments follow
-                     fprintf(stderr, "sdn: syntax error near `|'\n");
-                     num_segments = -1;
-                     break;
-                }
-            } else {
-                 num_segments++;
-            }
-            command_str = strtok_r(NULL, "|", &saveptr_pipe);
+        if (!input_text) {
+            perror("sdn: malloc");
+            continue;
         }
 
-        // Perform variable expansion for all segments after parsing
-        if (num_segments > 0) {
-            for (int k_seg = 0; k_seg < num_segments; k_seg++) {
-                if (command_segments[k_seg].args[0] != NULL) { // Ensure there are args to expand
-                    expand_variables_in_args(command_segments[k_seg].args);
-                }
-            }
+        ParseStatus parse_status;
+        char error[128];
+        trace_start = trace_begin();
+        Node *root = parse_script(input_text, &parse_status, error, sizeof(error), NULL);
+        trace_end("parse", trace_start, input_text);
+        if (parse_status == PARSE_INCOMPLETE) {
+            pending_input = input_text; // Keep reading with a continuation prompt
+            continue;
+        }
+        const char *cwd = current_directory();
+        char history_cwd[FILENAME_MAX];
+        snprintf(history_cwd, sizeof(history_cwd), "%s", cwd ? cwd : "");
+        time_t started_at = time(NULL);
+        if (!root) {
+            fprintf(stderr, "sdn: %s\n", error);
+            last_exit_status = 2;
+            save_to_history(input_text, started_at, last_exit_status, 0, history_cwd);
+            free(input_text);
+            continue;
         }
 
+        interrupt_pending = 0;
+        double started = monotonic_seconds();
+        trace_start = trace_begin();
+        execute_node(root);
+        trace_end("execute", trace_start, history_entry_buffer);
+        last_command_seconds = monotonic_seconds() - started;
+        free_node(root);
+        if (interrupt_pending) { // Ctrl+C cut a loop or function short
+            interrupt_pending = 0;
+            last_exit_status = 130;
+            printf("\n");
+        }
+        trace_start = trace_begin();
+        save_to_history(input_text, started_at, last_exit_status, last_command_seconds, history_cwd);
+        trace_end("history", trace_start, NULL);
+        free(input_text);
 
-        if (num_segments == -1 || (num_segments == 0 && strlen(input_line_for_parsing) > 0) ) { 
-             for (int k = 0; k < MAX_COMMAND_SEGMENTS; k++) { 
-                free_command_segment_internals(&command_segments[k]);
-            }
-            continue;
+        if (exit_requested) {
+            reap_children();
+            print_job_notifications();
+            printf("Exiting sdn.\n");
+            break;
         }
-        if (num_segments == 0) {
-            continue;
+    }
+
+    free(pending_input);
+    free_history_cache(&history_cache);
+    return last_exit_status;
+}
+
+#ifndef SDN_NO_MAIN // bench/microbench.c compiles this file in with its own main()
+int main(int argc, char *argv[]) {
+    const char *command_string = NULL;
+    bool force_interactive = false;
+    int arg_index = 1;
+    while (arg_index < argc && argv[arg_index][0] == '-') {
+        if (strcmp(argv[arg_index], "-c") == 0 && arg_index + 1 < argc) {
+            command_string = argv[arg_index + 1];
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "-i") == 0) {
+            force_interactive = true;
+            arg_index++;
+        } else if (strcmp(argv[arg_index], "--profile-startup") == 0) {
+            profile_startup = force_interactive = true;
+            startup_phase_mark = monotonic_seconds();
+            arg_index++;
+        } else if (strcmp(argv[arg_index], "--") == 0) {
+            arg_index++;
+            break;
+        } else {
+            fprintf(stderr, "sdn: %s: invalid option\n", argv[arg_index]);
+            fprintf(stderr, "usage: sdn [-i] [--profile-startup] [-c command [name [arg ...]] | script [arg ...]]\n");
+            return 2;
         }
-        
-        int built_in_executed = 0;
-        if (num_segments == 1 && command_segments[0].args[0] != NULL) {
-            // Built-in command check
-            if (strcmp(command_segments[0].args[0], "cd") == 0) {
-                char target_dir[FILENAME_MAX];
-                if (command_segments[0].args[1] == NULL) {
-                    char *home_dir = getenv("HOME");
-                    if (home_dir) {
-                        strncpy(target_dir, home_dir, FILENAME_MAX -1);
-                        target_dir[FILENAME_MAX-1] = '\0';
-                    } else {
-                        fprintf(stderr, "sdn: cd: HOME not set\n");
-                        target_dir[0] = '\0'; 
-                    }
-                } else {
-                    strncpy(target_dir, command_segments[0].args[1], FILENAME_MAX -1);
-                    target_dir[FILENAME_MAX-1] = '\0';
-                }
+    }
 
-                if (target_dir[0] != '\0') {
-                    clear_local_aliases(); // Clear old local aliases
-                    if (chdir(target_dir) != 0) {
-                        perror("sdn: cd failed");
-                        // Attempt to reload local aliases for the original directory if chdir failed
-                        // though current_dir_path might be stale if chdir modified it partially
-                        // For simplicity, we might just leave local aliases cleared or try to get CWD again.
-                        char current_cwd_after_fail[FILENAME_MAX];
-                         if (getcwd(current_cwd_after_fail, sizeof(current_cwd_after_fail)) != NULL) {
-                            load_local_aliases(current_cwd_after_fail);
-                        }
-                    } else {
-                        // chdir was successful, load new local aliases
-                        char new_cwd[FILENAME_MAX];
-                        if (getcwd(new_cwd, sizeof(new_cwd)) != NULL) {
-                            load_local_aliases(new_cwd);
-                        } else {
-                            perror("sdn: getcwd failed after cd");
-                        }
-                    }
-                }
-                built_in_executed = 1;
-            } else if (strcmp(command_segments[0].args[0], "echo") == 0) { // ADDED echo built-in check
-                handle_echo_builtin(command_segments[0].args);
-                built_in_executed = 1;
-            } else if (strcmp(command_segments[0].args[0], "history") == 0) {
-                display_history();
-                built_in_executed = 1;
-            } else if (strcmp(command_segments[0].args[0], "alias") == 0) {
-                handle_alias_builtin(command_segments[0].args);
-                built_in_executed = 1;
-            } else if (strcmp(command_segments[0].args[0], "unalias") == 0) {
-                handle_unalias_builtin(command_segments[0].args);
-                built_in_executed = 1;
-            } else if (strcmp(command_segments[0].args[0], "export") == 0) {
-                handle_export_builtin(command_segments[0].args);
-                built_in_executed = 1;
-            }
+    if (command_string) {
+        // As in other shells, the word after the command string becomes $0
+        if (arg_index < argc) {
+            positional_params = &argv[arg_index];
+            positional_count = argc - arg_index;
+        } else {
+            positional_params = argv;
+            positional_count = 1;
         }
+        return run_script(command_string, "-c");
+    }
 
-        if (!built_in_executed) {
-            execute_pipeline(command_segments, num_segments, overall_background);
+    if (arg_index < argc) {
+        const char *script_path = argv[arg_index];
+        positional_params = &argv[arg_index];
+        positional_count = argc - arg_index;
+        int fd = open(script_path, O_RDONLY | O_CLOEXEC);
+        char *text = fd == -1 ? NULL : read_whole_fd(fd);
+        if (fd != -1) close(fd);
+        if (!text) {
+            fprintf(stderr, "sdn: %s: %s\n", script_path, strerror(errno));
+            return 127;
         }
+        int status = run_script(text, script_path);
+        free(text);
+        return status;
+    }
 
-        for (int k = 0; k < num_segments; k++) {
-            free_command_segment_internals(&command_segments[k]);
+    positional_params = argv;
+    positional_count = 1;
+    if (!force_interactive && !isatty(STDIN_FILENO)) {
+        char *text = read_whole_fd(STDIN_FILENO);
+        if (!text) {
+            perror("sdn: reading standard input");
+            return 1;
         }
+        int status = run_script(text, "stdin");
+        free(text);
+        return status;
     }
 
-    free_history_cache(&history_cache);
-    return 0;
+    return run_interactive();
 }
+#endif
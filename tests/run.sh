@@ -0,0 +1,95 @@
+#!/bin/sh
+# Regression tests: each case runs a command string with `sdn -c` inside a
+# scratch directory and compares its output and exit status.
+# Usage: tests/run.sh [path/to/sdn]
+
+SDN=$(cd "$(dirname "${1:-./sdn}")" && pwd)/$(basename "${1:-./sdn}")
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+cd "$WORK_DIR" || exit 1
+export HOME="$WORK_DIR"
+
+passed=0
+failed=0
+
+check() { # name expected_output expected_status command
+    output=$(timeout 10 "$SDN" -c "$4" 2>&1) # A hang fails with status 124
+    status=$?
+    if [ "$output" = "$2" ] && [ "$status" -eq "$3" ]; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        printf 'FAIL %s\n  command:  %s\n  expected: [%s] %s\n  got:      [%s] %s\n' \
+            "$1" "$4" "$3" "$2" "$status" "$output"
+    fi
+}
+
+printf 'line\n' > file
+
+# --- File copying builtins ---
+mkfifo fifo
+(sleep 0.2; echo from-fifo > fifo) &
+check "cat of a FIFO operand" "from-fifo" 0 'cat fifo'
+(sleep 0.2; echo from-fifo > fifo) &
+check "cat with stdin redirected from a FIFO" "from-fifo" 0 'cat < fifo'
+check "cat of regular files" "line
+line" 0 'cat file - < file'
+tee_files=$(seq -f "tee%g" 1 25 | tr '\n' ' ')
+check "tee writes more than 20 files" "line" 0 "cat file | tee $tee_files > /dev/null; cat tee25"
+
+# --- Directory-local aliases ---
+mkdir -p repo/sub gone
+echo "hi=echo local" > repo/.sdn_local_aliases
+echo "hi=echo gone" > gone/.sdn_local_aliases
+check "local aliases notice a repository created above" "sdn: alias: hi: not found
+hi='echo local'" 0 "cd repo/sub; alias hi; mkdir ../.git; cd /; cd '$WORK_DIR/repo/sub'; alias hi"
+check "local aliases are dropped when the directory is gone" "hi='echo gone'
+sdn: getcwd failed after cd: No such file or directory
+sdn: alias: hi: not found" 1 "cd gone; alias hi; rm -r '$WORK_DIR/gone'; cd .; alias hi"
+
+# --- History index ---
+printf '[2024-01-01 10:00:00 0 0.1 /tmp] echo alpha\n[2024-01-01 10:00:01 0 0.1 /tmp] echo other\n' > .sdn_history
+check "history search builds the index" "    1  2024-01-01 10:00:00  echo alpha" 0 'history -e alpha'
+printf '[2024-01-01 10:00:00 0 0.1 /tmp] echo bravo\n' | dd of=.sdn_history conv=notrunc 2>/dev/null
+check "history index notices an in-place rewrite" "    1  2024-01-01 10:00:00  echo bravo" 0 'history -e bravo'
+printf '\377\377\377\377\377\377\377\377' | dd of=.sdn_history.idx bs=1 seek=48 conv=notrunc 2>/dev/null
+check "history ignores a damaged index" "    2  2024-01-01 10:00:01  echo other" 0 'history -e other'
+
+# --- History compaction ---
+printf '[2024-01-01 10:00:00 0 0.1 /tmp] echo a\nnot a history line\n[2024-01-01 10:00:01 0 0.1 /tmp] echo a\n' > .sdn_history
+touch .sdn_history.Ab12Cd
+check "compaction keeps lines it cannot parse" "history: 3 lines (0 KiB) compacted to 2 lines (0 KiB)
+not a history line
+[2024-01-01 10:00:01 0 0.1 /tmp] echo a" 0 'history --compact; cat .sdn_history'
+check "compaction removes stale temp files" "1" 0 'test -e .sdn_history.Ab12Cd; echo $?'
+
+# --- parallel builtin ---
+check "parallel resumes a job stopped with SIGTSTP" "done 1" 0 "parallel sh -c 'kill -TSTP \$\$; echo done {}' ::: 1"
+
+# --- Pipeline optimizer ---
+check "cat rewrite keeps exit in a subshell" "survived" 0 'cat file | exit 3; echo survived'
+check "cat rewrite keeps cd in a subshell" "$WORK_DIR" 0 'cat file | cd /; pwd'
+check "cat rewrite keeps compound in a subshell" "1" 0 'X=1; cat file | { X=2; }; echo $X'
+check "cat rewrite feeds an external command" "1" 0 'cat file | wc -l'
+
+# --- Functions ---
+check "function redefining itself finishes the old body" "old
+new" 0 'f() { f() { echo new; }; echo old; }; f; f'
+
+# --- Arithmetic expansion ---
+check "LLONG_MIN / -1 wraps" "-9223372036854775808 0" 0 'm=$((-9223372036854775807 - 1)); echo $((m / -1)) $((m % -1))'
+check "overflow wraps at 64 bits" "-9223372036854775808 -6289078614652622815" 0 'echo $((9223372036854775807 + 1)) $((3 ** 40))'
+check "large exponent finishes" "0" 0 'echo $((2 ** 9223372036854775807))'
+check "shift counts are taken modulo 64" "1 -9223372036854775808 -4" 0 'echo $((1 << 64)) $((1 << -1)) $((-8 >> 1))'
+
+# --- Spawn attributes ---
+check "stacked nice increments add up" "8" 0 'a=$(nice); b=$(nice -n 5 nice -n 3 nice); echo $((b - a))'
+check "nice takes an attached value" "5 4" 0 'a=$(nice); b=$(nice -n5 nice); c=$(nice --adjustment=4 nice); echo $((b - a)) $((c - a))'
+check "ionice takes attached values" "best-effort: prio 7" 0 'ionice -c2 -n7 ionice'
+if command -v taskset >/dev/null 2>&1; then
+    check "taskset -p runs the real program" "pid 1's current affinity list" 0 "taskset -pc 1 | cut -d: -f1"
+fi
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]